@@ -0,0 +1,582 @@
+//
+// Copyright 2013 BiasedBit
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+//
+//  Created by Bruno de Carvalho (@biasedbit, http://biasedbit.com)
+//  Copyright (c) 2013 BiasedBit. All rights reserved.
+//
+
+
+#import "BBCappedCache.h"
+#import "BBConcurrentDictionary.h"
+
+#import <pthread.h>
+#import <sys/resource.h>
+#import <time.h>
+
+#ifdef GNUSTEP
+    #import <Foundation/NSDebug.h>
+#endif
+
+
+
+#pragma mark - Constants
+
+/** Mixed access benchmarks write once every this many operations and read otherwise. */
+static const NSUInteger kBBBenchmarkMixedAccessWriteInterval = 10;
+
+
+
+#pragma mark - Types
+
+typedef struct {
+    NSUInteger operations;
+    NSTimeInterval duration;
+    uint64_t objectAllocations;
+    uint64_t storageBytes; // 0 unless the benchmark writes to disk
+} BBBenchmarkMeasurement;
+
+typedef BBBenchmarkMeasurement (^BBBenchmarkBlock)(NSUInteger size);
+
+
+
+#pragma mark - Utility functions
+
+static NSString* BBBenchmarkStoragePath(void)
+{
+    static NSString* path;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        int processIdentifier = [[NSProcessInfo processInfo] processIdentifier];
+        NSString* directory = [NSString stringWithFormat:@"BBBenchmark-%d", processIdentifier];
+        path = [NSTemporaryDirectory() stringByAppendingPathComponent:directory];
+    });
+
+    return path;
+}
+
+static uint64_t BBBenchmarkStorageBytes(void)
+{
+    NSString* path = BBBenchmarkStoragePath();
+    NSFileManager* fileManager = [NSFileManager defaultManager];
+
+    uint64_t total = 0;
+    for (NSString* file in [fileManager enumeratorAtPath:path]) {
+        NSDictionary* attributes = [fileManager attributesOfItemAtPath:[path stringByAppendingPathComponent:file]
+                                                                 error:nil];
+        if ([[attributes fileType] isEqualToString:NSFileTypeRegular]) total += [attributes fileSize];
+    }
+
+    return total;
+}
+
+static NSTimeInterval BBBenchmarkTime(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec + ((NSTimeInterval)now.tv_nsec / NSEC_PER_SEC);
+}
+
+static uint64_t BBBenchmarkObjectAllocations(void)
+{
+#ifdef GNUSTEP
+    // Counts every object allocated since GSDebugAllocationActive(YES), whether it's still alive or not
+    uint64_t total = 0;
+    Class* classes = GSDebugAllocationClassList();
+    for (Class* class = classes; (class != NULL) && (*class != Nil); class++) total += GSDebugAllocationTotal(*class);
+    free(classes);
+
+    return total;
+#else
+    return 0;
+#endif
+}
+
+static uint64_t BBBenchmarkPeakResidentBytes(void)
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+
+#ifdef __APPLE__
+    return (uint64_t)usage.ru_maxrss;
+#else
+    return (uint64_t)usage.ru_maxrss * 1024; // kilobytes everywhere else
+#endif
+}
+
+static NSArray* BBBenchmarkKeys(NSString* prefix, NSUInteger count)
+{
+    NSMutableArray* keys = [NSMutableArray arrayWithCapacity:count];
+    for (NSUInteger i = 0; i < count; i++) [keys addObject:[NSString stringWithFormat:@"%@-%08u", prefix, (unsigned)i]];
+
+    return keys;
+}
+
+static NSArray* BBBenchmarkShuffledKeys(NSArray* keys)
+{
+    // Fixed seed, so every run and every commit looks keys up in the same order
+    NSMutableArray* shuffled = [keys mutableCopy];
+    uint64_t state = 0x9e3779b97f4a7c15ULL;
+    for (NSUInteger i = [shuffled count]; i > 1; i--) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        [shuffled exchangeObjectAtIndex:(i - 1) withObjectAtIndex:(NSUInteger)(state % i)];
+    }
+
+    return shuffled;
+}
+
+static BBBenchmarkMeasurement BBBenchmarkMeasure(NSUInteger operations, void (^block)(void))
+{
+    BBBenchmarkMeasurement measurement;
+    measurement.operations = operations;
+    measurement.storageBytes = 0;
+
+    uint64_t allocations = BBBenchmarkObjectAllocations();
+    NSTimeInterval start = BBBenchmarkTime();
+    @autoreleasepool {
+        block();
+    }
+    measurement.duration = BBBenchmarkTime() - start;
+    measurement.objectAllocations = BBBenchmarkObjectAllocations() - allocations;
+
+    return measurement;
+}
+
+
+
+#pragma mark -
+
+/** A typical small model object: a key, a string payload, a number and an expiration. */
+@interface BBBenchmarkItem : NSObject <BBCappedCacheItem>
+
+
+#pragma mark Creation
+
+- (instancetype)initWithKey:(NSString*)key payloadLength:(NSUInteger)payloadLength;
+
+
+#pragma mark Properties
+
+@property(strong, nonatomic) NSString* key;
+@property(strong, nonatomic) NSString* payload;
+@property(assign, nonatomic) NSInteger revision;
+@property(assign, nonatomic) NSTimeInterval expirationTimestamp;
+
+@end
+
+@implementation BBBenchmarkItem
+
+
+#pragma mark Creation
+
+- (instancetype)initWithKey:(NSString*)key payloadLength:(NSUInteger)payloadLength
+{
+    self = [super init];
+    if (self != nil) {
+        _key = key;
+        _payload = [@"" stringByPaddingToLength:payloadLength withString:@"BBRepository " startingAtIndex:0];
+        _revision = 1;
+    }
+
+    return self;
+}
+
+
+#pragma mark BBRepositoryItem
+
+- (instancetype)initWithRepositoryDictionary:(NSDictionary*)dictionary
+{
+    self = [super init];
+    if (self != nil) {
+        _key = dictionary[@"key"];
+        _payload = dictionary[@"payload"];
+        _revision = [dictionary[@"revision"] integerValue];
+        _expirationTimestamp = [dictionary[@"expiration"] doubleValue];
+    }
+
+    return self;
+}
+
+- (NSDictionary*)convertToRepositoryDictionary
+{
+    return @{@"key": _key, @"payload": _payload, @"revision": @(_revision), @"expiration": @(_expirationTimestamp)};
+}
+
+
+#pragma mark BBCappedCacheItem
+
+- (double)resourceUsage
+{
+    return 1;
+}
+
+@end
+
+
+
+#pragma mark -
+
+/** Same shape as `BBBenchmarkItem`, but expiring through the `NSDate` accessors, as cache items used to. */
+@interface BBBenchmarkDatedItem : NSObject <BBCacheItem>
+
+
+#pragma mark Creation
+
+- (instancetype)initWithKey:(NSString*)key payloadLength:(NSUInteger)payloadLength;
+
+
+#pragma mark Properties
+
+@property(strong, nonatomic) NSString* key;
+@property(strong, nonatomic) NSString* payload;
+@property(assign, nonatomic) NSInteger revision;
+@property(strong, nonatomic) NSDate* expirationDate;
+
+@end
+
+@implementation BBBenchmarkDatedItem
+
+
+#pragma mark Creation
+
+- (instancetype)initWithKey:(NSString*)key payloadLength:(NSUInteger)payloadLength
+{
+    self = [super init];
+    if (self != nil) {
+        _key = key;
+        _payload = [@"" stringByPaddingToLength:payloadLength withString:@"BBRepository " startingAtIndex:0];
+        _revision = 1;
+    }
+
+    return self;
+}
+
+@end
+
+
+
+#pragma mark -
+
+@interface BBBenchmarkRepository : BBRepository
+@end
+
+@implementation BBBenchmarkRepository
+
+- (NSString*)baseStoragePath
+{
+    return BBBenchmarkStoragePath();
+}
+
+- (BBBenchmarkItem*)createItemFromDictionary:(NSDictionary*)dictionary
+{
+    return [[BBBenchmarkItem alloc] initWithRepositoryDictionary:dictionary];
+}
+
+@end
+
+
+
+#pragma mark -
+
+@interface BBBenchmarkCache : BBCache
+@end
+
+@implementation BBBenchmarkCache
+
+- (NSString*)baseStoragePath
+{
+    return BBBenchmarkStoragePath();
+}
+
+- (BBBenchmarkItem*)createItemFromDictionary:(NSDictionary*)dictionary
+{
+    return [[BBBenchmarkItem alloc] initWithRepositoryDictionary:dictionary];
+}
+
+@end
+
+
+
+#pragma mark -
+
+@interface BBBenchmarkCappedCache : BBCappedCache
+@end
+
+@implementation BBBenchmarkCappedCache
+
+- (NSString*)baseStoragePath
+{
+    return BBBenchmarkStoragePath();
+}
+
+- (BBBenchmarkItem*)createItemFromDictionary:(NSDictionary*)dictionary
+{
+    return [[BBBenchmarkItem alloc] initWithRepositoryDictionary:dictionary];
+}
+
+@end
+
+
+
+#pragma mark - Benchmarks
+
+static NSUInteger BBBenchmarkPayloadLength(void)
+{
+    NSInteger payloadLength = [[NSUserDefaults standardUserDefaults] integerForKey:@"payloadLength"];
+    return (payloadLength > 0) ? (NSUInteger)payloadLength : 64;
+}
+
+static NSArray* BBBenchmarkItems(NSArray* keys)
+{
+    NSUInteger payloadLength = BBBenchmarkPayloadLength();
+    NSMutableArray* items = [NSMutableArray arrayWithCapacity:[keys count]];
+    for (NSString* key in keys) [items addObject:[[BBBenchmarkItem alloc] initWithKey:key payloadLength:payloadLength]];
+
+    return items;
+}
+
+static BBBenchmarkRepository* BBBenchmarkPopulatedRepositoryWithFormat(NSArray* keys,
+                                                                       BBRepositoryIndexFormat indexFormat)
+{
+    BBBenchmarkRepository* repository = [[BBBenchmarkRepository alloc] initWithIdentifier:@"benchmark"];
+    repository.indexFormat = indexFormat;
+    [repository reload];
+    [repository addItems:BBBenchmarkItems(keys)];
+
+    return repository;
+}
+
+static BBBenchmarkRepository* BBBenchmarkPopulatedRepository(NSArray* keys)
+{
+    return BBBenchmarkPopulatedRepositoryWithFormat(keys, BBRepositoryIndexFormatPropertyList);
+}
+
+static BBBenchmarkMeasurement BBBenchmarkMeasureReload(NSUInteger size, BBRepositoryIndexFormat indexFormat)
+{
+    NSArray* keys = BBBenchmarkKeys(@"item", size);
+    BBBenchmarkRepository* repository = BBBenchmarkPopulatedRepositoryWithFormat(keys, indexFormat);
+    [repository flush];
+
+    BBBenchmarkRepository* reloaded = [[BBBenchmarkRepository alloc] initWithIdentifier:@"benchmark"];
+    reloaded.indexFormat = indexFormat;
+    BBBenchmarkMeasurement measurement = BBBenchmarkMeasure(1, ^{
+        [reloaded reload];
+    });
+    measurement.storageBytes = BBBenchmarkStorageBytes();
+
+    return measurement;
+}
+
+static BBBenchmarkMeasurement BBBenchmarkMeasureFlush(NSUInteger size, BBRepositoryIndexFormat indexFormat)
+{
+    NSArray* keys = BBBenchmarkKeys(@"item", size);
+    BBBenchmarkRepository* repository = BBBenchmarkPopulatedRepositoryWithFormat(keys, indexFormat);
+    BBBenchmarkMeasurement measurement = BBBenchmarkMeasure(1, ^{
+        [repository flush];
+    });
+    measurement.storageBytes = BBBenchmarkStorageBytes();
+
+    return measurement;
+}
+
+/**
+ Every core reads and writes the dictionary at once, going through all the keys in its own order. Each access is made
+ holding `mutex`, unless it's `NULL`.
+ */
+static BBBenchmarkMeasurement BBBenchmarkMeasureMixedAccess(NSMutableDictionary* dictionary, NSUInteger size,
+                                                            pthread_mutex_t* mutex)
+{
+    NSArray* keys = BBBenchmarkKeys(@"item", size);
+    NSArray* items = BBBenchmarkItems(keys);
+    for (NSUInteger i = 0; i < size; i++) dictionary[keys[i]] = items[i];
+
+    NSArray* lookups = BBBenchmarkShuffledKeys(keys);
+    NSUInteger threadCount = [[NSProcessInfo processInfo] activeProcessorCount];
+    dispatch_queue_t queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+    return BBBenchmarkMeasure(size * threadCount, ^{
+        dispatch_apply(threadCount, queue, ^(size_t thread) {
+            // Starting at different offsets, so threads aren't all after the same key at the same time
+            NSUInteger offset = (thread * size) / threadCount;
+            for (NSUInteger i = 0; i < size; i++) {
+                NSString* key = lookups[(offset + i) % size];
+                if (mutex != NULL) pthread_mutex_lock(mutex);
+                if ((i % kBBBenchmarkMixedAccessWriteInterval) == 0) dictionary[key] = items[i];
+                else [dictionary objectForKey:key];
+                if (mutex != NULL) pthread_mutex_unlock(mutex);
+            }
+        });
+    });
+}
+
+static NSDictionary* BBBenchmarks(void)
+{
+    return @{
+        @"reload": ^BBBenchmarkMeasurement(NSUInteger size) {
+            return BBBenchmarkMeasureReload(size, BBRepositoryIndexFormatPropertyList);
+        },
+        @"reloadCompressed": ^BBBenchmarkMeasurement(NSUInteger size) {
+            return BBBenchmarkMeasureReload(size, BBRepositoryIndexFormatCompressedPropertyList);
+        },
+        @"flush": ^BBBenchmarkMeasurement(NSUInteger size) {
+            return BBBenchmarkMeasureFlush(size, BBRepositoryIndexFormatPropertyList);
+        },
+        @"flushCompressed": ^BBBenchmarkMeasurement(NSUInteger size) {
+            return BBBenchmarkMeasureFlush(size, BBRepositoryIndexFormatCompressedPropertyList);
+        },
+        @"addItem": ^BBBenchmarkMeasurement(NSUInteger size) {
+            BBBenchmarkRepository* repository = [[BBBenchmarkRepository alloc] initWithIdentifier:@"benchmark"];
+            [repository reload];
+            NSArray* items = BBBenchmarkItems(BBBenchmarkKeys(@"item", size));
+            return BBBenchmarkMeasure(size, ^{
+                for (BBBenchmarkItem* item in items) [repository addItem:item];
+            });
+        },
+        @"itemForKeyHit": ^BBBenchmarkMeasurement(NSUInteger size) {
+            NSArray* keys = BBBenchmarkKeys(@"item", size);
+            BBBenchmarkRepository* repository = BBBenchmarkPopulatedRepository(keys);
+            NSArray* lookups = BBBenchmarkShuffledKeys(keys);
+            return BBBenchmarkMeasure(size, ^{
+                for (NSString* key in lookups) [repository itemForKey:key];
+            });
+        },
+        @"itemForKeyMiss": ^BBBenchmarkMeasurement(NSUInteger size) {
+            BBBenchmarkRepository* repository = BBBenchmarkPopulatedRepository(BBBenchmarkKeys(@"item", size));
+            NSArray* lookups = BBBenchmarkShuffledKeys(BBBenchmarkKeys(@"absent", size));
+            return BBBenchmarkMeasure(size, ^{
+                for (NSString* key in lookups) [repository itemForKey:key];
+            });
+        },
+        @"cacheHit": ^BBBenchmarkMeasurement(NSUInteger size) {
+            // Timestamp accessors and the coarse clock; repeated hits within a second don't touch the item again
+            NSArray* keys = BBBenchmarkKeys(@"item", size);
+            BBBenchmarkCache* cache = [[BBBenchmarkCache alloc] initWithIdentifier:@"benchmark"];
+            [cache reload];
+            [cache addItems:BBBenchmarkItems(keys)];
+            NSArray* lookups = BBBenchmarkShuffledKeys(keys);
+            return BBBenchmarkMeasure(size, ^{
+                for (NSString* key in lookups) [cache itemForKey:key];
+            });
+        },
+        @"cacheHitWithDates": ^BBBenchmarkMeasurement(NSUInteger size) {
+            // The hit path as it was before the timestamp accessors: a new date for every item read
+            NSArray* keys = BBBenchmarkKeys(@"item", size);
+            BBBenchmarkCache* cache = [[BBBenchmarkCache alloc] initWithIdentifier:@"benchmark"];
+            cache.touchGranularity = 0;
+            [cache reload];
+            NSUInteger payloadLength = BBBenchmarkPayloadLength();
+            for (NSString* key in keys) {
+                [cache addItem:[[BBBenchmarkDatedItem alloc] initWithKey:key payloadLength:payloadLength]];
+            }
+            NSArray* lookups = BBBenchmarkShuffledKeys(keys);
+            return BBBenchmarkMeasure(size, ^{
+                for (NSString* key in lookups) [cache itemForKey:key];
+            });
+        },
+        @"cacheCompact": ^BBBenchmarkMeasurement(NSUInteger size) {
+            // Half of the items expired an hour ago, the other half expire in an hour
+            BBBenchmarkCache* cache = [[BBBenchmarkCache alloc] initWithIdentifier:@"benchmark"];
+            [cache reload];
+            NSArray* items = BBBenchmarkItems(BBBenchmarkKeys(@"item", size));
+            NSTimeInterval now = [NSDate timeIntervalSinceReferenceDate];
+            [items enumerateObjectsUsingBlock:^(BBBenchmarkItem* item, NSUInteger i, BOOL* stop) {
+                item.expirationTimestamp = ((i % 2) == 0) ? (now - 3600) : (now + 3600);
+            }];
+            [cache addItems:items];
+
+            return BBBenchmarkMeasure((size + 1) / 2, ^{
+                [cache compact];
+            });
+        },
+        @"cappedCacheInsertAtCapacity": ^BBBenchmarkMeasurement(NSUInteger size) {
+            // Every item inserted once the cache is full evicts another one
+            BBBenchmarkCappedCache* cache = [[BBBenchmarkCappedCache alloc] initWithIdentifier:@"benchmark"
+                                                                            resourceUsageLimit:size];
+            [cache reload];
+            [cache addItems:BBBenchmarkItems(BBBenchmarkKeys(@"resident", size))];
+            NSArray* items = BBBenchmarkItems(BBBenchmarkKeys(@"item", size));
+            return BBBenchmarkMeasure(size, ^{
+                for (BBBenchmarkItem* item in items) [cache addItem:item];
+            });
+        },
+        @"concurrentDictionaryMixed": ^BBBenchmarkMeasurement(NSUInteger size) {
+            return BBBenchmarkMeasureMixedAccess([[BBConcurrentDictionary alloc] init], size, NULL);
+        },
+        @"lockedDictionaryMixed": ^BBBenchmarkMeasurement(NSUInteger size) {
+            // The baseline: what guarding a plain dictionary with a single lock gets you
+            static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+            return BBBenchmarkMeasureMixedAccess([NSMutableDictionary dictionaryWithCapacity:size], size, &mutex);
+        },
+    };
+}
+
+
+
+#pragma mark - Main
+
+int main(int argc, const char* argv[])
+{
+    @autoreleasepool {
+        // Arguments are picked up by NSUserDefaults, e.g. bbbench -benchmark reload -size 10000
+        NSUserDefaults* defaults = [NSUserDefaults standardUserDefaults];
+        NSString* name = [defaults stringForKey:@"benchmark"];
+        NSInteger size = [defaults integerForKey:@"size"];
+        BBBenchmarkBlock benchmark = (name != nil) ? BBBenchmarks()[name] : nil;
+        if ((benchmark == nil) || (size <= 0)) {
+            fprintf(stderr, "usage: bbbench -benchmark <name> -size <entries> [-payloadLength <bytes>] [-commit <id>]\n"
+                            "benchmarks: %s\n",
+                    [[[[BBBenchmarks() allKeys] sortedArrayUsingSelector:@selector(compare:)]
+                      componentsJoinedByString:@" "] UTF8String]);
+            return 1;
+        }
+
+#ifdef GNUSTEP
+        GSDebugAllocationActive(YES);
+#endif
+
+        BBBenchmarkMeasurement measurement;
+        @autoreleasepool {
+            measurement = benchmark((NSUInteger)size);
+        }
+
+        [[NSFileManager defaultManager] removeItemAtPath:BBBenchmarkStoragePath() error:nil];
+
+        // One JSON object per line, so runs from different commits can be concatenated and compared
+        NSDictionary* result = @{
+            @"benchmark": name,
+            @"size": @(size),
+            @"commit": ([defaults stringForKey:@"commit"] ?: [NSNull null]),
+            @"itemShape": @{@"fields": @4, @"payloadBytes": @(BBBenchmarkPayloadLength())},
+            @"operations": @(measurement.operations),
+            @"seconds": @(measurement.duration),
+            @"nanosecondsPerOperation": @((measurement.duration * NSEC_PER_SEC) / MAX(measurement.operations, (NSUInteger)1)),
+#ifdef GNUSTEP
+            @"objectAllocations": @(measurement.objectAllocations),
+#else
+            @"objectAllocations": [NSNull null],
+#endif
+            @"peakResidentBytes": @(BBBenchmarkPeakResidentBytes()),
+            @"storageBytes": (measurement.storageBytes > 0) ? @(measurement.storageBytes) : [NSNull null]
+        };
+        NSData* json = [NSJSONSerialization dataWithJSONObject:result options:0 error:nil];
+        fwrite([json bytes], 1, [json length], stdout);
+        fputc('\n', stdout);
+    }
+
+    return 0;
+}
@@ -0,0 +1,95 @@
+//
+// Copyright 2013 BiasedBit
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+//
+//  Created by Bruno de Carvalho (@biasedbit, http://biasedbit.com)
+//  Copyright (c) 2013 BiasedBit. All rights reserved.
+//
+
+#import "BBCacheEvictionPolicy.h"
+
+
+
+#pragma mark -
+
+/** Outcome of replaying an access trace against one eviction policy. */
+@interface BBCacheTraceReplayResult : NSObject
+
+
+#pragma mark Properties
+
+@property(strong, nonatomic) NSString* policyName;
+@property(assign, nonatomic) NSUInteger capacity;
+@property(assign, nonatomic) NSUInteger accessCount;
+@property(assign, nonatomic) NSUInteger hitCount;
+@property(assign, nonatomic) NSUInteger evictionCount;
+/** Time spent in the policy's methods, in seconds. */
+@property(assign, nonatomic) NSTimeInterval policyDuration;
+
+
+#pragma mark Interface
+
+/** `hitCount` over `accessCount`, between 0 and 1. */
+- (double)hitRate;
+
+/** Average time spent in the policy per access, in nanoseconds. */
+- (double)nanosecondsPerAccess;
+
+@end
+
+
+
+#pragma mark -
+
+/**
+ Replays recorded access logs against eviction policies to compare their hit rates and cost.
+
+ The replay simulates a cache holding up to `capacity` keys, each of unit size. Every access to a key that's in the
+ cache is a hit and reported through `recordAccessOfKey:`; a miss evicts keys until there's room, as `BBCappedCache`
+ does, and then inserts the key. Only the time spent inside the policy counts towards its cost.
+
+ Usage:
+
+    NSArray* trace = [BBCacheTraceReplay keysFromTraceAtPath:path error:&error];
+    for (BBCacheTraceReplayResult* result in [BBCacheTraceReplay replayTraceWithBuiltInPolicies:trace capacity:1000]) {
+        NSLog(@"%@: %.2f%% hits, %.0fns/access", result.policyName, result.hitRate * 100, result.nanosecondsPerAccess);
+    }
+
+ @see BBCacheEvictionPolicy
+ */
+@interface BBCacheTraceReplay : NSObject
+
+
+#pragma mark Interface
+
+/**
+ Reads an access log, one access per line. Only the first whitespace separated field of each line is used as the key,
+ so logs with timestamps or sizes after the key can be used as they are; empty lines are skipped.
+
+ @param path Path of the log.
+ @param error Set to the cause of failure if this method returns `nil`.
+
+ @return The keys accessed, in order.
+ */
++ (NSArray*)keysFromTraceAtPath:(NSString*)path error:(NSError**)error;
+
++ (BBCacheTraceReplayResult*)replayTrace:(NSArray*)keys policy:(id<BBCacheEvictionPolicy>)policy
+                                capacity:(NSUInteger)capacity;
+
+/** Replays the trace against a fresh instance of each of the built-in policies, returning one result per policy. */
++ (NSArray*)replayTraceWithBuiltInPolicies:(NSArray*)keys capacity:(NSUInteger)capacity;
+
+@end
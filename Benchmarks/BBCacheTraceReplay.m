@@ -0,0 +1,157 @@
+//
+// Copyright 2013 BiasedBit
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+//
+//  Created by Bruno de Carvalho (@biasedbit, http://biasedbit.com)
+//  Copyright (c) 2013 BiasedBit. All rights reserved.
+//
+
+#import "BBCacheTraceReplay.h"
+
+#import <time.h>
+
+
+
+#pragma mark - Utility functions
+
+static uint64_t BBCacheTraceReplayNanoseconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return ((uint64_t)now.tv_sec * NSEC_PER_SEC) + (uint64_t)now.tv_nsec;
+}
+
+
+
+#pragma mark -
+
+@implementation BBCacheTraceReplayResult
+
+
+#pragma mark Interface
+
+- (double)hitRate
+{
+    return (_accessCount > 0) ? ((double)_hitCount / _accessCount) : 0;
+}
+
+- (double)nanosecondsPerAccess
+{
+    return (_accessCount > 0) ? ((_policyDuration * NSEC_PER_SEC) / _accessCount) : 0;
+}
+
+
+#pragma mark NSObject
+
+- (NSString*)description
+{
+    return [NSString stringWithFormat:@"%@ (capacity %u): %u/%u hits (%.2f%%), %u evictions, %.1fns per access",
+            _policyName, (unsigned int)_capacity, (unsigned int)_hitCount, (unsigned int)_accessCount,
+            [self hitRate] * 100, (unsigned int)_evictionCount, [self nanosecondsPerAccess]];
+}
+
+@end
+
+
+
+#pragma mark -
+
+@implementation BBCacheTraceReplay
+
+
+#pragma mark Interface
+
++ (NSArray*)keysFromTraceAtPath:(NSString*)path error:(NSError**)error
+{
+    NSString* contents = [NSString stringWithContentsOfFile:path encoding:NSUTF8StringEncoding error:error];
+    if (contents == nil) return nil;
+
+    NSMutableArray* keys = [NSMutableArray array];
+    NSCharacterSet* whitespace = [NSCharacterSet whitespaceCharacterSet];
+    [contents enumerateLinesUsingBlock:^(NSString* line, BOOL* stop) {
+        NSRange start = [line rangeOfCharacterFromSet:[whitespace invertedSet]];
+        if (start.location == NSNotFound) return;
+
+        NSRange end = [line rangeOfCharacterFromSet:whitespace options:0
+                                              range:NSMakeRange(start.location, [line length] - start.location)];
+        NSUInteger length = ((end.location == NSNotFound) ? [line length] : end.location) - start.location;
+        [keys addObject:[line substringWithRange:NSMakeRange(start.location, length)]];
+    }];
+
+    return keys;
+}
+
++ (BBCacheTraceReplayResult*)replayTrace:(NSArray*)keys policy:(id<BBCacheEvictionPolicy>)policy
+                                capacity:(NSUInteger)capacity
+{
+    NSMutableSet* resident = [NSMutableSet setWithCapacity:capacity];
+    NSUInteger hitCount = 0;
+    NSUInteger evictionCount = 0;
+    uint64_t policyNanoseconds = 0;
+
+    [policy removeAllKeys];
+    for (NSString* key in keys) {
+        if ([resident containsObject:key]) {
+            hitCount++;
+            uint64_t start = BBCacheTraceReplayNanoseconds();
+            [policy recordAccessOfKey:key];
+            policyNanoseconds += BBCacheTraceReplayNanoseconds() - start;
+            continue;
+        }
+
+        uint64_t start = BBCacheTraceReplayNanoseconds();
+        while ([resident count] >= capacity) {
+            NSString* evicted = [policy popEvictionCandidate];
+            if (evicted == nil) break;
+
+            // Mirror BBCappedCache, whose removal hook reports the eviction back to the policy
+            if ([resident containsObject:evicted]) {
+                [resident removeObject:evicted];
+                evictionCount++;
+            }
+            [policy recordRemovalOfKey:evicted];
+        }
+        [policy recordInsertionOfKey:key];
+        policyNanoseconds += BBCacheTraceReplayNanoseconds() - start;
+        [resident addObject:key];
+    }
+
+    BBCacheTraceReplayResult* result = [[BBCacheTraceReplayResult alloc] init];
+    result.policyName = [policy name];
+    result.capacity = capacity;
+    result.accessCount = [keys count];
+    result.hitCount = hitCount;
+    result.evictionCount = evictionCount;
+    result.policyDuration = (double)policyNanoseconds / NSEC_PER_SEC;
+
+    return result;
+}
+
++ (NSArray*)replayTraceWithBuiltInPolicies:(NSArray*)keys capacity:(NSUInteger)capacity
+{
+    NSArray* policyClasses = @[[BBCacheLRUEvictionPolicy class], [BBCacheLFUEvictionPolicy class],
+                               [BBCacheTinyLFUEvictionPolicy class], [BBCacheARCEvictionPolicy class]];
+
+    NSMutableArray* results = [NSMutableArray arrayWithCapacity:[policyClasses count]];
+    for (Class policyClass in policyClasses) {
+        [results addObject:[self replayTrace:keys policy:[[policyClass alloc] init] capacity:capacity]];
+    }
+
+    return results;
+}
+
+@end
@@ -0,0 +1,24 @@
+#!/bin/sh
+#
+# Runs every benchmark at every size, each in a process of its own so that peak RSS belongs to a single benchmark, and
+# prints one JSON object per line tagged with the current commit. Override BENCHMARKS, SIZES or PAYLOAD_LENGTH to narrow
+# a run down, e.g.:
+#
+#     SIZES="1000 10000" Benchmarks/run-benchmarks.sh > before.jsonl
+#
+
+set -e
+
+cd "$(dirname "$0")"
+
+BENCHMARKS=${BENCHMARKS:-"reload reloadCompressed flush flushCompressed addItem itemForKeyHit itemForKeyMiss cacheHit \
+    cacheHitWithDates cacheCompact cappedCacheInsertAtCapacity concurrentDictionaryMixed lockedDictionaryMixed"}
+SIZES=${SIZES:-"1000 10000 100000 1000000"}
+PAYLOAD_LENGTH=${PAYLOAD_LENGTH:-64}
+COMMIT=$(git rev-parse --short HEAD 2>/dev/null || echo unknown)
+
+for benchmark in $BENCHMARKS; do
+    for size in $SIZES; do
+        ./bbbench -benchmark "$benchmark" -size "$size" -payloadLength "$PAYLOAD_LENGTH" -commit "$COMMIT"
+    done
+done
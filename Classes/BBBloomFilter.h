@@ -0,0 +1,86 @@
+//
+// Copyright 2013 BiasedBit
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+//
+//  Created by Bruno de Carvalho (@biasedbit, http://biasedbit.com)
+//  Copyright (c) 2013 BiasedBit. All rights reserved.
+//
+
+#pragma mark -
+
+/**
+ Bloom filter over string keys: tells whether a key is definitely absent, or possibly present.
+
+ Sized at 10 bits per key with 7 hash functions, for a false-positive rate of about 1% while no more keys than
+ `capacity` have been added. Keys can't be removed; the filter is meant to be rebuilt from scratch every now and then,
+ which `rebuildWithKeysFromBlock:` does without ever producing a false negative for keys added concurrently.
+
+ All methods are thread-safe. `mightContainKey:` never takes a lock: the bits are read with atomic loads, and rebuilds
+ swap in a new bit array, freeing the old one once no lookup can still be reading it.
+ */
+@interface BBBloomFilter : NSObject
+
+
+#pragma mark Creation
+
+- (instancetype)initWithCapacity:(NSUInteger)capacity;
+
+/** Reads a filter written with `writeToFile:error:`, or returns `nil` if there's none or it's not valid. */
++ (instancetype)bloomFilterWithContentsOfFile:(NSString*)path;
+
+
+#pragma mark Properties
+
+/** Number of keys the filter was sized for. */
+@property(assign, nonatomic, readonly) NSUInteger capacity;
+
+/** Number of keys added since the filter was last built, including duplicates. */
+@property(assign, nonatomic, readonly) NSUInteger keyCount;
+
+/** Probability that `mightContainKey:` answers `YES` for a key that was never added, given the bits set so far. */
+@property(assign, nonatomic, readonly) double estimatedFalsePositiveRate;
+
+
+#pragma mark Interface
+
+- (void)addKey:(NSString*)key;
+- (BOOL)mightContainKey:(NSString*)key;
+
+/**
+ Rebuilds the filter from scratch, sized for the number of keys returned by `block` (with room to grow).
+
+ The block is called without holding any lock other than the one serializing rebuilds. Keys added from other threads
+ while the filter is being rebuilt are carried over, so as long as callers add keys *after* making them visible to the
+ block, no key is ever missed. If another rebuild (or `replaceContentsWithFilter:`) is in progress, this waits for it
+ to finish and then runs, so the filter always ends up built from the latest keys.
+ */
+- (void)rebuildWithKeysFromBlock:(NSArray* (^)(void))block;
+
+/**
+ Same as `rebuildWithKeysFromBlock:`, but gives up if another rebuild is in progress.
+
+ Meant for rebuilds that only make room for more keys, for which any rebuild that's already running will do.
+
+ @return `YES` if the filter was rebuilt, `NO` if another rebuild was in progress.
+ */
+- (BOOL)tryRebuildWithKeysFromBlock:(NSArray* (^)(void))block;
+
+/** Replaces this filter's contents with a copy of another's. */
+- (void)replaceContentsWithFilter:(BBBloomFilter*)filter;
+
+- (BOOL)writeToFile:(NSString*)path error:(NSError**)error;
+
+@end
@@ -0,0 +1,387 @@
+//
+// Copyright 2013 BiasedBit
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+//
+//  Created by Bruno de Carvalho (@biasedbit, http://biasedbit.com)
+//  Copyright (c) 2013 BiasedBit. All rights reserved.
+//
+
+#import "BBBloomFilter.h"
+
+#import <pthread.h>
+#import <sched.h>
+#import <stdatomic.h>
+
+
+
+#pragma mark - Constants
+
+static const char kBBBloomFilterMagic[4] = {'B', 'B', 'B', 'F'};
+static const uint32_t kBBBloomFilterVersion = 1;
+static const NSUInteger kBBBloomFilterHeaderLength = 32;
+static const NSUInteger kBBBloomFilterBitsPerKey = 10;
+static const NSUInteger kBBBloomFilterHashCount = 7;
+static const NSUInteger kBBBloomFilterMinimumCapacity = 1024;
+static const NSUInteger kBBBloomFilterReaderSlotCount = 32;
+
+
+
+#pragma mark - Types
+
+/** Bit array; readers access it without locking, so it's only ever freed once no reader can be holding it. */
+typedef struct {
+    uint64_t bitCount;
+    NSUInteger wordCount;
+    _Atomic uint64_t words[];
+} BBBloomFilterBits;
+
+/** Count of readers currently inside `mightContainKey:`, spread over slots on separate cache lines. */
+typedef struct {
+    _Atomic NSUInteger count;
+    uint8_t padding[64 - sizeof(NSUInteger)];
+} BBBloomFilterReaderSlot;
+
+
+
+#pragma mark - Utility functions
+
+static void BBBloomFilterHashKey(NSString* key, uint64_t* h1, uint64_t* h2)
+{
+    // FNV-1a over the UTF-16 characters, so hashes are stable across runs and OS releases; the filter is persisted
+    uint64_t hash = 14695981039346656037ULL;
+    unichar buffer[64];
+    NSUInteger length = [key length];
+    for (NSUInteger location = 0; location < length; location += 64) {
+        NSRange range = NSMakeRange(location, MIN((NSUInteger)64, length - location));
+        [key getCharacters:buffer range:range];
+        for (NSUInteger i = 0; i < range.length; i++) {
+            hash ^= buffer[i];
+            hash *= 1099511628211ULL;
+        }
+    }
+
+    // Second hash for double hashing, derived with a 64 bit finalizer; must be odd to cycle through every bit
+    uint64_t mixed = hash;
+    mixed ^= mixed >> 33;
+    mixed *= 0xff51afd7ed558ccdULL;
+    mixed ^= mixed >> 33;
+    mixed *= 0xc4ceb9fe1a85ec53ULL;
+    mixed ^= mixed >> 33;
+
+    *h1 = hash;
+    *h2 = mixed | 1;
+}
+
+static BBBloomFilterBits* BBBloomFilterBitsCreate(uint64_t bitCount)
+{
+    NSUInteger wordCount = (NSUInteger)((bitCount + 63) / 64);
+    BBBloomFilterBits* bits = calloc(1, sizeof(BBBloomFilterBits) + (wordCount * sizeof(uint64_t)));
+    bits->bitCount = bitCount;
+    bits->wordCount = wordCount;
+    for (NSUInteger i = 0; i < wordCount; i++) atomic_init(&bits->words[i], 0);
+
+    return bits;
+}
+
+static void BBBloomFilterSetKey(BBBloomFilterBits* bits, uint64_t h1, uint64_t h2)
+{
+    for (NSUInteger i = 0; i < kBBBloomFilterHashCount; i++) {
+        uint64_t bit = (h1 + (i * h2)) % bits->bitCount;
+        atomic_fetch_or_explicit(&bits->words[bit / 64], (1ULL << (bit % 64)), memory_order_relaxed);
+    }
+}
+
+static BOOL BBBloomFilterTestKey(BBBloomFilterBits* bits, uint64_t h1, uint64_t h2)
+{
+    for (NSUInteger i = 0; i < kBBBloomFilterHashCount; i++) {
+        uint64_t bit = (h1 + (i * h2)) % bits->bitCount;
+        uint64_t word = atomic_load_explicit(&bits->words[bit / 64], memory_order_relaxed);
+        if ((word & (1ULL << (bit % 64))) == 0) return NO;
+    }
+
+    return YES;
+}
+
+static NSUInteger BBBloomFilterReaderSlotForCurrentThread(void)
+{
+    uint64_t hash = (uint64_t)(uintptr_t)pthread_self();
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+
+    return (NSUInteger)(hash % kBBBloomFilterReaderSlotCount);
+}
+
+
+
+#pragma mark -
+
+@implementation BBBloomFilter
+{
+    // Serializes adds and swapping the bits; lookups never take it
+    pthread_mutex_t _lock;
+    // Serializes rebuilds and replacing the contents, so that none of them is lost to another running concurrently
+    pthread_mutex_t _rebuildLock;
+    _Atomic(BBBloomFilterBits*) _bits;
+    BBBloomFilterReaderSlot _readers[kBBBloomFilterReaderSlotCount];
+    NSUInteger _capacity;
+    NSUInteger _keyCount;
+    NSMutableArray* _keysAddedDuringRebuild;
+}
+
+
+#pragma mark Creation
+
+- (instancetype)initWithCapacity:(NSUInteger)capacity
+{
+    self = [super init];
+    if (self != nil) {
+        pthread_mutex_init(&_lock, NULL);
+        pthread_mutex_init(&_rebuildLock, NULL);
+        for (NSUInteger i = 0; i < kBBBloomFilterReaderSlotCount; i++) atomic_init(&_readers[i].count, 0);
+        _capacity = MAX(capacity, kBBBloomFilterMinimumCapacity);
+        atomic_init(&_bits, BBBloomFilterBitsCreate(_capacity * kBBBloomFilterBitsPerKey));
+    }
+
+    return self;
+}
+
++ (instancetype)bloomFilterWithContentsOfFile:(NSString*)path
+{
+    NSData* data = [NSData dataWithContentsOfFile:path];
+    if ([data length] < kBBBloomFilterHeaderLength) return nil;
+
+    // "BBBF" <version:4> <capacity:8> <key count:8> <bit count:8> <bits>, all big-endian; bit n of the array is bit
+    // n % 8 of byte n / 8
+    const uint8_t* bytes = [data bytes];
+    uint32_t version;
+    uint64_t header[3];
+    memcpy(&version, bytes + 4, sizeof(uint32_t));
+    memcpy(header, bytes + 8, sizeof(header));
+    if ((memcmp(bytes, kBBBloomFilterMagic, 4) != 0) || (CFSwapInt32BigToHost(version) != kBBBloomFilterVersion)) {
+        return nil;
+    }
+
+    uint64_t capacity = CFSwapInt64BigToHost(header[0]);
+    uint64_t keyCount = CFSwapInt64BigToHost(header[1]);
+    uint64_t bitCount = CFSwapInt64BigToHost(header[2]);
+    if ((bitCount != (capacity * kBBBloomFilterBitsPerKey)) ||
+        (([data length] - kBBBloomFilterHeaderLength) != ((bitCount + 7) / 8))) return nil;
+
+    BBBloomFilter* filter = [[self alloc] initWithCapacity:(NSUInteger)capacity];
+    BBBloomFilterBits* bits = atomic_load(&filter->_bits);
+    if (bits->bitCount != bitCount) return nil;
+
+    // Nobody else has seen the filter yet, so its bits can be filled in place
+    const uint8_t* bitBytes = bytes + kBBBloomFilterHeaderLength;
+    NSUInteger byteCount = [data length] - kBBBloomFilterHeaderLength;
+    for (NSUInteger i = 0; i < byteCount; i++) {
+        atomic_fetch_or_explicit(&bits->words[i / 8], ((uint64_t)bitBytes[i] << ((i % 8) * 8)), memory_order_relaxed);
+    }
+    filter->_keyCount = (NSUInteger)keyCount;
+
+    return filter;
+}
+
+- (void)dealloc
+{
+    free(atomic_load(&_bits));
+    pthread_mutex_destroy(&_lock);
+    pthread_mutex_destroy(&_rebuildLock);
+}
+
+
+#pragma mark Properties
+
+- (NSUInteger)capacity
+{
+    pthread_mutex_lock(&_lock);
+    NSUInteger capacity = _capacity;
+    pthread_mutex_unlock(&_lock);
+
+    return capacity;
+}
+
+- (NSUInteger)keyCount
+{
+    pthread_mutex_lock(&_lock);
+    NSUInteger keyCount = _keyCount;
+    pthread_mutex_unlock(&_lock);
+
+    return keyCount;
+}
+
+- (double)estimatedFalsePositiveRate
+{
+    // The bits can't be swapped, let alone freed, while we hold the lock
+    pthread_mutex_lock(&_lock);
+    BBBloomFilterBits* bits = atomic_load(&_bits);
+    uint64_t setBits = 0;
+    for (NSUInteger i = 0; i < bits->wordCount; i++) {
+        setBits += __builtin_popcountll(atomic_load_explicit(&bits->words[i], memory_order_relaxed));
+    }
+    uint64_t bitCount = bits->bitCount;
+    pthread_mutex_unlock(&_lock);
+
+    // A false positive is a key whose bits all happen to be set
+    return pow((double)setBits / bitCount, kBBBloomFilterHashCount);
+}
+
+
+#pragma mark Interface
+
+- (void)addKey:(NSString*)key
+{
+    uint64_t h1, h2;
+    BBBloomFilterHashKey(key, &h1, &h2);
+
+    pthread_mutex_lock(&_lock);
+    BBBloomFilterSetKey(atomic_load(&_bits), h1, h2);
+    _keyCount++;
+    [_keysAddedDuringRebuild addObject:key];
+    pthread_mutex_unlock(&_lock);
+}
+
+- (BOOL)mightContainKey:(NSString*)key
+{
+    if (key == nil) return NO;
+
+    uint64_t h1, h2;
+    BBBloomFilterHashKey(key, &h1, &h2);
+
+    // Announce ourselves before grabbing the bits, so whoever swaps them out waits for us before freeing them
+    _Atomic NSUInteger* readers = &_readers[BBBloomFilterReaderSlotForCurrentThread()].count;
+    atomic_fetch_add(readers, 1);
+    BOOL mightContain = BBBloomFilterTestKey(atomic_load(&_bits), h1, h2);
+    atomic_fetch_sub(readers, 1);
+
+    return mightContain;
+}
+
+- (void)rebuildWithKeysFromBlock:(NSArray* (^)(void))block
+{
+    // A rebuild replaces whatever the filter knows, so it can't be skipped because another one is running; the keys
+    // that one works with may be out of date by now. Wait for it, then run.
+    pthread_mutex_lock(&_rebuildLock);
+    [self rebuildWithKeys:block()];
+    pthread_mutex_unlock(&_rebuildLock);
+}
+
+- (BOOL)tryRebuildWithKeysFromBlock:(NSArray* (^)(void))block
+{
+    if (pthread_mutex_trylock(&_rebuildLock) != 0) return NO;
+
+    [self rebuildWithKeys:block()];
+    pthread_mutex_unlock(&_rebuildLock);
+
+    return YES;
+}
+
+- (void)replaceContentsWithFilter:(BBBloomFilter*)filter
+{
+    pthread_mutex_lock(&filter->_lock);
+    BBBloomFilterBits* source = atomic_load(&filter->_bits);
+    BBBloomFilterBits* bits = BBBloomFilterBitsCreate(source->bitCount);
+    for (NSUInteger i = 0; i < source->wordCount; i++) {
+        atomic_init(&bits->words[i], atomic_load_explicit(&source->words[i], memory_order_relaxed));
+    }
+    NSUInteger capacity = filter->_capacity;
+    NSUInteger keyCount = filter->_keyCount;
+    pthread_mutex_unlock(&filter->_lock);
+
+    pthread_mutex_lock(&_rebuildLock);
+    pthread_mutex_lock(&_lock);
+    BBBloomFilterBits* oldBits = atomic_exchange(&_bits, bits);
+    _capacity = capacity;
+    _keyCount = keyCount;
+    pthread_mutex_unlock(&_lock);
+    pthread_mutex_unlock(&_rebuildLock);
+
+    [self retireBits:oldBits];
+}
+
+- (BOOL)writeToFile:(NSString*)path error:(NSError**)error
+{
+    pthread_mutex_lock(&_lock);
+    BBBloomFilterBits* bits = atomic_load(&_bits);
+    uint32_t version = CFSwapInt32HostToBig(kBBBloomFilterVersion);
+    uint64_t header[3] = {
+        CFSwapInt64HostToBig(_capacity), CFSwapInt64HostToBig(_keyCount), CFSwapInt64HostToBig(bits->bitCount)
+    };
+
+    NSUInteger byteCount = (NSUInteger)((bits->bitCount + 7) / 8);
+    NSMutableData* data = [NSMutableData dataWithCapacity:kBBBloomFilterHeaderLength + byteCount];
+    [data appendBytes:kBBBloomFilterMagic length:4];
+    [data appendBytes:&version length:sizeof(uint32_t)];
+    [data appendBytes:header length:sizeof(header)];
+    [data setLength:(kBBBloomFilterHeaderLength + byteCount)];
+    uint8_t* bitBytes = (uint8_t*)[data mutableBytes] + kBBBloomFilterHeaderLength;
+    for (NSUInteger i = 0; i < byteCount; i++) {
+        uint64_t word = atomic_load_explicit(&bits->words[i / 8], memory_order_relaxed);
+        bitBytes[i] = (uint8_t)(word >> ((i % 8) * 8));
+    }
+    pthread_mutex_unlock(&_lock);
+
+    return [data writeToFile:path options:NSDataWritingAtomic error:error];
+}
+
+
+#pragma mark Private helpers
+
+- (void)rebuildWithKeys:(NSArray*)keys
+{
+    // Must be called with the rebuild lock held.
+    // Nothing added from here on can be missed: it's either in the keys or remembered and carried over below.
+    pthread_mutex_lock(&_lock);
+    _keysAddedDuringRebuild = [NSMutableArray array];
+    pthread_mutex_unlock(&_lock);
+
+    NSUInteger capacity = MAX([keys count] * 2, kBBBloomFilterMinimumCapacity);
+    BBBloomFilterBits* bits = BBBloomFilterBitsCreate(capacity * kBBBloomFilterBitsPerKey);
+    for (NSString* key in keys) {
+        uint64_t h1, h2;
+        BBBloomFilterHashKey(key, &h1, &h2);
+        BBBloomFilterSetKey(bits, h1, h2);
+    }
+
+    pthread_mutex_lock(&_lock);
+    for (NSString* key in _keysAddedDuringRebuild) {
+        uint64_t h1, h2;
+        BBBloomFilterHashKey(key, &h1, &h2);
+        BBBloomFilterSetKey(bits, h1, h2);
+    }
+
+    BBBloomFilterBits* oldBits = atomic_exchange(&_bits, bits);
+    _capacity = capacity;
+    _keyCount = [keys count] + [_keysAddedDuringRebuild count];
+    _keysAddedDuringRebuild = nil;
+    pthread_mutex_unlock(&_lock);
+
+    [self retireBits:oldBits];
+}
+
+- (void)retireBits:(BBBloomFilterBits*)bits
+{
+    // Anyone who could still be reading the old bits announced themselves before the swap. Seeing each slot empty
+    // once is enough: readers arriving after the swap get the new bits.
+    for (NSUInteger i = 0; i < kBBBloomFilterReaderSlotCount; i++) {
+        while (atomic_load(&_readers[i].count) != 0) sched_yield();
+    }
+
+    free(bits);
+}
+
+@end
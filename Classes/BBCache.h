@@ -29,6 +29,9 @@
 /** Default item duration, set to one week. */
 extern NSTimeInterval const kBBCacheDefaultItemDuration;
 
+/** Maximum amount of time, in seconds, each slice of automatic compaction runs for. */
+extern NSTimeInterval const kBBCacheAutoCompactionSliceDuration;
+
 
 
 #pragma mark -
@@ -46,11 +49,18 @@ extern NSTimeInterval const kBBCacheDefaultItemDuration;
  
  ## Purging items
  
- Purging expired items is **not** an automatic step. It is up to you to control when the items are purged (by calling
- `purgeStaleItems`). A good time to do this is when the app is sent to background or at any point in the app's
+ By default, purging expired items is **not** an automatic step. It is up to you to control when the items are purged
+ (by calling `compact`). A good time to do this is when the app is sent to background or at any point in the app's
  lifecycle where the repository is no longer (or will become) unnecessary, such as when exiting an area of the app that
  makes use of it.
 
+ Alternatively, set `autoCompactionInterval` and the cache will purge expired items by itself, in the background.
+
+ Items are indexed by expiration, in buckets of one minute, so purging only visits expired items rather than scanning
+ the whole cache. The index is maintained through the add, replace and remove hooks; subclasses that override
+ `didAddNewItem:`, `didReplaceItem:withNewItem:`, `didRemoveItem:` or `reloadComplete` **must** call `super`. Changing
+ an item's `expirationDate` while in the cache, other than through this class, requires adding the item again.
+
  @see BBCacheItem
  @see BBRepository
  */
@@ -95,6 +105,23 @@ extern NSTimeInterval const kBBCacheDefaultItemDuration;
  */
 @property(assign, nonatomic, readonly) NSTimeInterval itemDuration;
 
+/**
+ Interval, in seconds, at which the cache purges expired items by itself, on a background queue. Defaults to `0`, which
+ disables automatic compaction.
+
+ Each run purges items in slices of at most `kBBCacheAutoCompactionSliceDuration`, yielding the queue in between, so
+ that purging a large amount of items never holds up the cache for long.
+ */
+@property(assign, nonatomic) NSTimeInterval autoCompactionInterval;
+
+/**
+ Granularity, in seconds, of the clock used to touch items. Defaults to `1`.
+
+ Expirations set by touching items are rounded down to a multiple of this value, so an item read several times within
+ the same window is only re-stamped (and re-indexed) the first time. Set it to `0` to touch items on every read.
+ */
+@property(assign, nonatomic) NSTimeInterval touchGranularity;
+
 
 #pragma mark BBRepository overrides
 
@@ -108,6 +135,9 @@ extern NSTimeInterval const kBBCacheDefaultItemDuration;
  If the object doesn't have its `expirationDate` property set, it will be set to the current instant plus `itemDuration`
  seconds.
 
+ Items that implement neither pair of `BBCacheItem` expiration accessors are rejected, failing an assertion in debug
+ builds.
+
  Subclasses should override this method and change its input type to help guarantee type safety.
 
  @param item Item to add to the repository.
@@ -118,6 +148,20 @@ extern NSTimeInterval const kBBCacheDefaultItemDuration;
  */
 - (BOOL)addItem:(id<BBCacheItem>)item;
 
+/**
+ Adds a batch of items to the repository.
+
+ Like `addItem:`, sets the `expirationDate` of the items that don't have one and rejects those without expiration
+ accessors.
+
+ @param items Items to add to the repository.
+
+ @return Number of items that were added or replaced.
+
+ @see [BBRepository addItems:]
+ */
+- (NSUInteger)addItems:(NSArray*)items;
+
 
 #pragma mark Item expiration
 
@@ -127,6 +171,8 @@ extern NSTimeInterval const kBBCacheDefaultItemDuration;
 
 /**
  Destroy all items in this cache whose `expirationDate` property is inferior to the moment when this method is called.
+
+ Cost is proportional to the number of expired items, not to the number of items in the cache.
  
  Each expired item will be removed with the method `removeItemWithKey:`.
  
@@ -136,4 +182,13 @@ extern NSTimeInterval const kBBCacheDefaultItemDuration;
  */
 - (NSUInteger)compact;
 
+/**
+ Expiration of an item as seconds since the reference date, through whichever contract of `BBCacheItem` it implements.
+
+ @param item The item.
+
+ @return The expiration timestamp, or `0` if the item has none.
+ */
+- (NSTimeInterval)expirationTimestampForItem:(id<BBCacheItem>)item;
+
 @end
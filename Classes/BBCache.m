@@ -21,17 +21,79 @@
 
 #import "BBCache.h"
 
+#import <pthread.h>
+#import <time.h>
+
 
 
 #pragma mark - Constants
 
 NSTimeInterval const kBBCacheDefaultItemDuration = 604800; // 1 week
+NSTimeInterval const kBBCacheAutoCompactionSliceDuration = 0.005;
+
+static NSTimeInterval const kBBCacheExpirationBucketDuration = 60;
+static NSUInteger const kBBCacheCompactionBatchSize = 64;
+
+
+
+#pragma mark - Utility functions
+
+static int64_t BBCacheBucketForTimestamp(NSTimeInterval timestamp)
+{
+    return (int64_t)floor(timestamp / kBBCacheExpirationBucketDuration);
+}
+
+static NSTimeInterval BBCacheMonotonicTime(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec + ((NSTimeInterval)now.tv_nsec / NSEC_PER_SEC);
+}
+
+static NSTimeInterval BBCacheCoarseTimestamp(NSTimeInterval granularity)
+{
+    static NSTimeInterval baseTimestamp;
+    static NSTimeInterval baseMonotonicTime;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        baseTimestamp = CFAbsoluteTimeGetCurrent();
+        baseMonotonicTime = BBCacheMonotonicTime();
+    });
+
+    // Wall clock time at first use, advanced by the monotonic clock; immune to the user changing the device's clock.
+    // Every expiration is stamped and compared on this clock, never on the wall clock directly.
+    NSTimeInterval timestamp = baseTimestamp + (BBCacheMonotonicTime() - baseMonotonicTime);
+    if (granularity <= 0) return timestamp;
+
+    return floor(timestamp / granularity) * granularity;
+}
+
+static BOOL BBCacheItemHasExpirationAccessors(id<BBCacheItem> item)
+{
+    BOOL hasTimestampAccessors = [item respondsToSelector:@selector(expirationTimestamp)] &&
+                                 [item respondsToSelector:@selector(setExpirationTimestamp:)];
+    if (hasTimestampAccessors) return YES;
+
+    return [item respondsToSelector:@selector(expirationDate)] &&
+           [item respondsToSelector:@selector(setExpirationDate:)];
+}
 
 
 
 #pragma mark -
 
 @implementation BBCache
+{
+    // Expiration index: every key with an expiration, bucketed by minute. Guarded by _expirationLock.
+    pthread_mutex_t _expirationLock;
+    NSMutableDictionary* _expirationTimestamps;
+    NSMutableDictionary* _expirationBuckets;
+    int64_t _firstExpirationBucket;
+
+    dispatch_queue_t _compactionQueue;
+    dispatch_source_t _compactionTimer;
+}
 
 
 #pragma mark Creation
@@ -49,20 +111,76 @@ NSTimeInterval const kBBCacheDefaultItemDuration = 604800; // 1 week
 - (instancetype)initWithIdentifier:(NSString*)identifier itemDuration:(NSTimeInterval)itemDuration
 {
     self = [super initWithIdentifier:identifier];
-    if (self != nil) _itemDuration = itemDuration;
+    if (self != nil) {
+        _itemDuration = itemDuration;
+        _touchGranularity = 1;
+
+        pthread_mutex_init(&_expirationLock, NULL);
+        _expirationTimestamps = [NSMutableDictionary dictionary];
+        _expirationBuckets = [NSMutableDictionary dictionary];
+        _firstExpirationBucket = INT64_MAX;
+
+        NSString* queueName = [NSString stringWithFormat:@"com.biasedbit.BBCache.compaction.%@", identifier];
+        _compactionQueue = dispatch_queue_create([queueName UTF8String], DISPATCH_QUEUE_SERIAL);
+    }
 
     return self;
 }
 
+- (void)dealloc
+{
+    if (_compactionTimer != nil) dispatch_source_cancel(_compactionTimer);
+    pthread_mutex_destroy(&_expirationLock);
+}
+
+
+#pragma mark Cache properties
+
+- (void)setAutoCompactionInterval:(NSTimeInterval)autoCompactionInterval
+{
+    @synchronized (self) {
+        _autoCompactionInterval = MAX(autoCompactionInterval, (NSTimeInterval)0);
+
+        if (_compactionTimer != nil) {
+            dispatch_source_cancel(_compactionTimer);
+            _compactionTimer = nil;
+        }
+
+        if (_autoCompactionInterval == 0) return;
+
+        // The timer must not keep the cache alive
+        __weak BBCache* weakSelf = self;
+        uint64_t interval = (uint64_t)(_autoCompactionInterval * NSEC_PER_SEC);
+        _compactionTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, _compactionQueue);
+        dispatch_source_set_timer(_compactionTimer, dispatch_time(DISPATCH_TIME_NOW, interval), interval, interval / 10);
+        dispatch_source_set_event_handler(_compactionTimer, ^{
+            [weakSelf compactSlice];
+        });
+        dispatch_resume(_compactionTimer);
+    }
+}
+
 
 #pragma mark BBRepository overrides
 
+- (BOOL)destroy
+{
+    BOOL destroyed = [super destroy];
+    [self resetExpirationIndex];
+
+    return destroyed;
+}
+
 - (id)itemForKey:(NSString*)key
 {
     id<BBCacheItem> item = [super itemForKey:key];
     if (item == nil) return nil;
 
-    [self touchItem:item];
+    // Items aren't required to be thread-safe, so touch them under the same lock that guards their hooks
+    [self performWithLockForKey:key block:^{
+        // Unless it's been removed or replaced meanwhile, in which case the hooks already took care of the index
+        if ([self touchItem:item] && (_entries[key] == item)) [self indexExpirationOfItem:item];
+    }];
 
     return item;
 }
@@ -71,45 +189,265 @@ NSTimeInterval const kBBCacheDefaultItemDuration = 604800; // 1 week
 {
     if (item == nil) return NO;
 
+    NSAssert(BBCacheItemHasExpirationAccessors(item), @"%@ implements neither pair of BBCacheItem expiration accessors",
+             [item class]);
+    if (!BBCacheItemHasExpirationAccessors(item)) return NO;
+
     // Only change the expiration date if it's not nil; allows us to set custom expiration date
-    if ([item expirationDate] == nil) [self touchItem:item];
+    if ([self expirationTimestampForItem:item] == 0) [self touchItem:item];
 
     return [super addItem:item];
 }
 
+- (NSUInteger)addItems:(NSArray*)items
+{
+    NSMutableArray* validItems = [NSMutableArray arrayWithCapacity:[items count]];
+    for (id<BBCacheItem> item in items) {
+        NSAssert(BBCacheItemHasExpirationAccessors(item),
+                 @"%@ implements neither pair of BBCacheItem expiration accessors", [item class]);
+        if (!BBCacheItemHasExpirationAccessors(item)) continue;
+
+        if ([self expirationTimestampForItem:item] == 0) [self touchItem:item];
+        [validItems addObject:item];
+    }
+
+    return [super addItems:validItems];
+}
+
 - (NSString*)baseStoragePath
 {
     return [NSSearchPathForDirectoriesInDomains(NSCachesDirectory, NSUserDomainMask, YES) objectAtIndex:0];
 }
 
+- (BBRepositoryItemMetadata)metadataForItem:(id<BBCacheItem>)item
+{
+    BBRepositoryItemMetadata metadata = [super metadataForItem:item];
+    metadata.expirationTimestamp = [self expirationTimestampForItem:item];
+
+    return metadata;
+}
+
+- (void)reloadComplete
+{
+    [super reloadComplete];
+
+    // Rebuild the index from scratch; metadata is available without loading items
+    [self resetExpirationIndex];
+    [self enumerateItemMetadataUsingBlock:^(NSString* key, BBRepositoryItemMetadata metadata, BOOL* stop) {
+        pthread_mutex_lock(&_expirationLock);
+        [self indexKey:key expirationTimestamp:metadata.expirationTimestamp];
+        pthread_mutex_unlock(&_expirationLock);
+    }];
+}
+
+- (void)didAddNewItem:(id<BBCacheItem>)item
+{
+    [super didAddNewItem:item];
+    [self indexExpirationOfItem:item];
+}
+
+- (void)didReplaceItem:(id<BBCacheItem>)item withNewItem:(id<BBCacheItem>)newItem
+{
+    [super didReplaceItem:item withNewItem:newItem];
+    [self indexExpirationOfItem:newItem];
+}
+
+- (void)didRemoveItem:(id<BBCacheItem>)item
+{
+    [super didRemoveItem:item];
+
+    pthread_mutex_lock(&_expirationLock);
+    [self unindexKey:[item key]];
+    pthread_mutex_unlock(&_expirationLock);
+}
+
 
 #pragma mark Interface
 
 - (NSUInteger)compact
 {
-    NSDate* now = [NSDate date];
+    NSTimeInterval now = BBCacheCoarseTimestamp(0);
 
-    LogDebug(@"[%@] Purging stale items with expiry date < %@…", [self repositoryName], now);
+    LogDebug(@"[%@] Purging stale items with expiry date < %@…",
+             [self repositoryName], [NSDate dateWithTimeIntervalSinceReferenceDate:now]);
 
-    NSMutableArray* keysToRemove = [NSMutableArray array];
-    [_entries enumerateKeysAndObjectsUsingBlock:^(NSString* key, id<BBCacheItem> item, BOOL* stop) {
-        // If date is < to staleThreshold, then purge this item
-        NSDate* itemExpirationDate = [item expirationDate];
-        if ([[now earlierDate:itemExpirationDate] isEqualToDate:itemExpirationDate]) [keysToRemove addObject:key];
-    }];
+    return [self purgeItemsExpiredBefore:now deadline:DBL_MAX];
+}
 
-    for (NSString* key in keysToRemove) [self removeItemWithKey:key];
+- (NSTimeInterval)expirationTimestampForItem:(id<BBCacheItem>)item
+{
+    if ([item respondsToSelector:@selector(expirationTimestamp)]) return [item expirationTimestamp];
 
-    return [keysToRemove count];
+    return [[item expirationDate] timeIntervalSinceReferenceDate];
 }
 
 
 #pragma mark Private helpers
 
-- (void)touchItem:(id<BBCacheItem>)item
+- (BOOL)touchItem:(id<BBCacheItem>)item
+{
+    NSTimeInterval newExpiration = BBCacheCoarseTimestamp(_touchGranularity) + _itemDuration;
+
+    // Already touched within the current window of the clock, no need to do it again
+    if ([self expirationTimestampForItem:item] == newExpiration) return NO;
+
+    if ([item respondsToSelector:@selector(setExpirationTimestamp:)]) [item setExpirationTimestamp:newExpiration];
+    else [item setExpirationDate:[NSDate dateWithTimeIntervalSinceReferenceDate:newExpiration]];
+
+    return YES;
+}
+
+- (void)compactSlice
+{
+    NSTimeInterval now = BBCacheCoarseTimestamp(0);
+    NSUInteger purged = [self purgeItemsExpiredBefore:now deadline:(now + kBBCacheAutoCompactionSliceDuration)];
+    if (purged > 0) LogDebug(@"[%@] Automatically purged %u stale items.", [self repositoryName], purged);
+
+    // Ran out of time; let whatever else is waiting on the queue run before carrying on with the next slice
+    if ([self hasItemsExpiredBefore:now]) {
+        __weak BBCache* weakSelf = self;
+        dispatch_async(_compactionQueue, ^{
+            [weakSelf compactSlice];
+        });
+    }
+}
+
+- (NSUInteger)purgeItemsExpiredBefore:(NSTimeInterval)timestamp deadline:(NSTimeInterval)deadline
+{
+    NSUInteger purged = 0;
+    NSArray* keys = nil;
+    while (((keys = [self indexedKeysExpiredBefore:timestamp limit:kBBCacheCompactionBatchSize]) != nil) &&
+           ([keys count] > 0)) {
+        for (NSString* key in keys) {
+            // The item may have been touched since we looked it up; check again while holding its lock
+            __block BOOL removed = NO;
+            [self performWithLockForKey:key block:^{
+                pthread_mutex_lock(&_expirationLock);
+                NSNumber* expiration = _expirationTimestamps[key];
+                BOOL expired = (expiration != nil) && ([expiration doubleValue] <= timestamp);
+                pthread_mutex_unlock(&_expirationLock);
+                if (!expired) return;
+
+                removed = ([self removeItemWithKey:key] != nil);
+
+                // didRemoveItem: already took it out of the index, unless it wasn't there to be removed
+                pthread_mutex_lock(&_expirationLock);
+                [self unindexKey:key];
+                pthread_mutex_unlock(&_expirationLock);
+            }];
+
+            if (removed) purged++;
+        }
+
+        if (BBCacheCoarseTimestamp(0) >= deadline) break;
+    }
+
+    [self recordStatistic:BBRepositoryStatisticExpirations count:purged];
+
+    return purged;
+}
+
+- (BOOL)hasItemsExpiredBefore:(NSTimeInterval)timestamp
+{
+    return [[self indexedKeysExpiredBefore:timestamp limit:1] count] > 0;
+}
+
+- (void)resetExpirationIndex
+{
+    pthread_mutex_lock(&_expirationLock);
+    [_expirationTimestamps removeAllObjects];
+    [_expirationBuckets removeAllObjects];
+    _firstExpirationBucket = INT64_MAX;
+    pthread_mutex_unlock(&_expirationLock);
+}
+
+- (void)indexExpirationOfItem:(id<BBCacheItem>)item
+{
+    NSTimeInterval expirationTimestamp = [self expirationTimestampForItem:item];
+
+    pthread_mutex_lock(&_expirationLock);
+    [self indexKey:[item key] expirationTimestamp:expirationTimestamp];
+    pthread_mutex_unlock(&_expirationLock);
+}
+
+- (void)indexKey:(NSString*)key expirationTimestamp:(NSTimeInterval)expirationTimestamp
+{
+    // Must be called with the expiration lock held
+    NSNumber* current = _expirationTimestamps[key];
+    if ((current != nil) && ([current doubleValue] == expirationTimestamp)) return;
+
+    [self unindexKey:key];
+    if (expirationTimestamp == 0) return; // never expires
+
+    int64_t bucket = BBCacheBucketForTimestamp(expirationTimestamp);
+    NSMutableSet* keys = _expirationBuckets[@(bucket)];
+    if (keys == nil) {
+        keys = [NSMutableSet set];
+        _expirationBuckets[@(bucket)] = keys;
+    }
+
+    [keys addObject:key];
+    _expirationTimestamps[key] = @(expirationTimestamp);
+    _firstExpirationBucket = MIN(_firstExpirationBucket, bucket);
+}
+
+- (void)unindexKey:(NSString*)key
+{
+    // Must be called with the expiration lock held
+    NSNumber* current = _expirationTimestamps[key];
+    if (current == nil) return;
+
+    NSNumber* bucket = @(BBCacheBucketForTimestamp([current doubleValue]));
+    NSMutableSet* keys = _expirationBuckets[bucket];
+    [keys removeObject:key];
+    if ([keys count] == 0) [_expirationBuckets removeObjectForKey:bucket];
+
+    [_expirationTimestamps removeObjectForKey:key];
+}
+
+- (NSArray*)indexedKeysExpiredBefore:(NSTimeInterval)timestamp limit:(NSUInteger)limit
 {
-    NSDate* newExpiration = [NSDate dateWithTimeIntervalSinceNow:_itemDuration];
-    [item setExpirationDate:newExpiration];
+    int64_t lastBucket = BBCacheBucketForTimestamp(timestamp);
+    NSMutableArray* keys = [NSMutableArray array];
+
+    pthread_mutex_lock(&_expirationLock);
+    NSArray* buckets = nil;
+    if ((_firstExpirationBucket <= lastBucket) &&
+        ((uint64_t)(lastBucket - _firstExpirationBucket) > [_expirationBuckets count])) {
+        // It's been a long while since we last purged; cheaper to go through the buckets that exist than to walk every
+        // bucket in between.
+        NSMutableArray* existingBuckets = [NSMutableArray array];
+        for (NSNumber* bucket in _expirationBuckets) {
+            if ([bucket longLongValue] <= lastBucket) [existingBuckets addObject:bucket];
+        }
+        buckets = [existingBuckets sortedArrayUsingSelector:@selector(compare:)];
+        _firstExpirationBucket = ([buckets count] > 0) ? [buckets[0] longLongValue] : lastBucket;
+    }
+
+    if (buckets == nil) {
+        // Walk the wheel up until the current bucket, moving past the buckets already emptied
+        NSMutableArray* walkedBuckets = [NSMutableArray array];
+        for (int64_t bucket = _firstExpirationBucket; bucket <= lastBucket; bucket++) {
+            if (_expirationBuckets[@(bucket)] != nil) [walkedBuckets addObject:@(bucket)];
+            else if (bucket == _firstExpirationBucket) _firstExpirationBucket = bucket + 1;
+        }
+        buckets = walkedBuckets;
+    }
+
+    for (NSNumber* bucket in buckets) {
+        // Every item in a bucket before the last one has expired; in the last one, some may not have yet
+        for (NSString* key in _expirationBuckets[bucket]) {
+            if ([_expirationTimestamps[key] doubleValue] > timestamp) continue;
+
+            [keys addObject:key];
+            if ([keys count] >= limit) break;
+        }
+
+        if ([keys count] >= limit) break;
+    }
+    pthread_mutex_unlock(&_expirationLock);
+
+    return keys;
 }
 
 @end
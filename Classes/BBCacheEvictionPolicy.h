@@ -0,0 +1,111 @@
+//
+// Copyright 2013 BiasedBit
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+//
+//  Created by Bruno de Carvalho (@biasedbit, http://biasedbit.com)
+//  Copyright (c) 2013 BiasedBit. All rights reserved.
+//
+
+#pragma mark -
+
+/**
+ Decides which key a `BBCappedCache` evicts next when it goes over its resource usage limit.
+
+ The cache reports every key it holds as it's added (`recordInsertionOfKey:`), read (`recordAccessOfKey:`) and removed
+ (`recordRemovalOfKey:`), and calls `popEvictionCandidate` until it's back under the limit. Keys handed out by
+ `popEvictionCandidate` are forgotten by the policy as resident keys; the cache then removes them, which results in a
+ `recordRemovalOfKey:` call the policy must tolerate.
+
+ Calls are serialized by the cache, so implementations needn't be thread-safe. They should be O(1), as they're made
+ while holding the cache's accounting lock.
+
+ @see [BBCappedCache evictionPolicy]
+ */
+@protocol BBCacheEvictionPolicy <NSObject>
+
+@required
+
+/** Short name to identify the policy by in logs and trace replays. */
+- (NSString*)name;
+
+/** Called when an item is added under `key`, or replaced. */
+- (void)recordInsertionOfKey:(NSString*)key;
+
+/** Called when the item under `key` is read. */
+- (void)recordAccessOfKey:(NSString*)key;
+
+/** Called when the item under `key` is removed, for whatever reason. */
+- (void)recordRemovalOfKey:(NSString*)key;
+
+/** Returns the key that should be evicted next and stops tracking it, or `nil` if there's no key left. */
+- (NSString*)popEvictionCandidate;
+
+/** Forgets every key, along with any access history. */
+- (void)removeAllKeys;
+
+@end
+
+
+
+#pragma mark -
+
+/** Evicts the least recently used key. Keys are kept in a linked list, so every operation is O(1). */
+@interface BBCacheLRUEvictionPolicy : NSObject <BBCacheEvictionPolicy>
+@end
+
+
+
+#pragma mark -
+
+/**
+ Evicts the least frequently used key, the least recently used one amongst those with the same frequency.
+
+ Keys are kept in buckets per access count, linked in increasing order, so every operation is O(1). Counts are never
+ decayed and are lost once a key leaves the cache; prefer `BBCacheTinyLFUEvictionPolicy` when popularity shifts over time.
+ */
+@interface BBCacheLFUEvictionPolicy : NSObject <BBCacheEvictionPolicy>
+@end
+
+
+
+#pragma mark -
+
+/**
+ W-TinyLFU: a small LRU admission window in front of a segmented LRU main area, with admission to the main area gated
+ by access frequency.
+
+ Frequencies are estimated by a count-min sketch of 4-bit counters that are halved periodically, so that history, even
+ of keys no longer in the cache, ages out. New keys enter the window, which takes about 1% of the keys. When evicting,
+ the window's least recently used key competes with the main area's victim and the one seen less often goes. The main
+ area is split into probation and protected segments, the latter holding up to 80% of it, which keeps one-off scans from
+ flushing frequently used keys.
+ */
+@interface BBCacheTinyLFUEvictionPolicy : NSObject <BBCacheEvictionPolicy>
+@end
+
+
+
+#pragma mark -
+
+/**
+ Adaptive Replacement Cache: balances between recency and frequency by keeping keys seen once and keys seen more than
+ once in separate LRU lists, along with ghost lists of keys recently evicted from each.
+
+ A new key that hits a ghost list grows the share of the list it was evicted from. The size ARC works with is the
+ largest number of keys tracked at once, which for a cache that's reached its limit is the number of items it holds.
+ */
+@interface BBCacheARCEvictionPolicy : NSObject <BBCacheEvictionPolicy>
+@end
@@ -0,0 +1,683 @@
+//
+// Copyright 2013 BiasedBit
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+//
+//  Created by Bruno de Carvalho (@biasedbit, http://biasedbit.com)
+//  Copyright (c) 2013 BiasedBit. All rights reserved.
+//
+
+#import "BBCacheEvictionPolicy.h"
+
+
+
+#pragma mark - Constants
+
+static NSUInteger const kBBCacheTinyLFUSketchDepth = 4;
+static NSUInteger const kBBCacheTinyLFUSketchMinimumWidth = 64;
+static uint8_t const kBBCacheTinyLFUSketchMaximumCount = 15;
+static NSUInteger const kBBCacheTinyLFUSamplesPerCounter = 10;
+
+
+
+#pragma mark - Utility functions
+
+static uint64_t BBCacheEvictionPolicyMix(uint64_t hash)
+{
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+
+    return hash;
+}
+
+
+
+#pragma mark -
+
+@class BBCacheEvictionList;
+
+/**
+ Entry of a `BBCacheEvictionList`.
+
+ Links aren't retained; nodes are owned by the policy's key to node dictionary, so that releasing a long list doesn't
+ recurse through it.
+ */
+@interface BBCacheEvictionNode : NSObject
+{
+@public
+    NSString* _key;
+    __unsafe_unretained BBCacheEvictionNode* _previous;
+    __unsafe_unretained BBCacheEvictionNode* _next;
+    __unsafe_unretained BBCacheEvictionList* _list;
+}
+
+- (instancetype)initWithKey:(NSString*)key;
+
+@end
+
+@implementation BBCacheEvictionNode
+
+- (instancetype)initWithKey:(NSString*)key
+{
+    self = [super init];
+    if (self != nil) _key = key;
+
+    return self;
+}
+
+@end
+
+
+
+#pragma mark -
+
+/** Intrusive doubly linked list of `BBCacheEvictionNode`s, most recently used first. All operations are O(1). */
+@interface BBCacheEvictionList : NSObject
+{
+@public
+    NSUInteger _count;
+    // Only used by the LFU policy, which keeps one list per frequency, linked in increasing order
+    NSUInteger _frequency;
+    __unsafe_unretained BBCacheEvictionList* _previousList;
+    __unsafe_unretained BBCacheEvictionList* _nextList;
+}
+
+- (void)pushFront:(BBCacheEvictionNode*)node;
+- (void)removeNode:(BBCacheEvictionNode*)node;
+- (BBCacheEvictionNode*)back;
+
+@end
+
+@implementation BBCacheEvictionList
+{
+    BBCacheEvictionNode* _sentinel;
+}
+
+- (instancetype)init
+{
+    self = [super init];
+    if (self != nil) {
+        _sentinel = [[BBCacheEvictionNode alloc] initWithKey:nil];
+        _sentinel->_previous = _sentinel;
+        _sentinel->_next = _sentinel;
+    }
+
+    return self;
+}
+
+- (void)pushFront:(BBCacheEvictionNode*)node
+{
+    node->_previous = _sentinel;
+    node->_next = _sentinel->_next;
+    _sentinel->_next->_previous = node;
+    _sentinel->_next = node;
+    node->_list = self;
+    _count++;
+}
+
+- (void)removeNode:(BBCacheEvictionNode*)node
+{
+    node->_previous->_next = node->_next;
+    node->_next->_previous = node->_previous;
+    node->_previous = nil;
+    node->_next = nil;
+    node->_list = nil;
+    _count--;
+}
+
+- (BBCacheEvictionNode*)back
+{
+    return (_count > 0) ? _sentinel->_previous : nil;
+}
+
+@end
+
+
+
+#pragma mark -
+
+/**
+ Count-min sketch of 4 rows of saturating counters, halved every `kBBCacheTinyLFUSamplesPerCounter` increments per
+ counter so that old history fades.
+ */
+@interface BBCacheFrequencySketch : NSObject
+
+- (void)ensureCapacity:(NSUInteger)capacity;
+- (void)incrementKey:(NSString*)key;
+- (NSUInteger)frequencyOfKey:(NSString*)key;
+- (void)reset;
+
+@end
+
+@implementation BBCacheFrequencySketch
+{
+    uint8_t* _counters;
+    NSUInteger _width;
+    NSUInteger _additions;
+}
+
+- (instancetype)init
+{
+    self = [super init];
+    if (self != nil) {
+        _width = kBBCacheTinyLFUSketchMinimumWidth;
+        _counters = calloc(_width * kBBCacheTinyLFUSketchDepth, sizeof(uint8_t));
+    }
+
+    return self;
+}
+
+- (void)dealloc
+{
+    free(_counters);
+}
+
+- (void)ensureCapacity:(NSUInteger)capacity
+{
+    if (capacity <= _width) return;
+
+    // Growing loses the history; it only happens while the cache is warming up
+    while (_width < capacity) _width *= 2;
+    free(_counters);
+    _counters = calloc(_width * kBBCacheTinyLFUSketchDepth, sizeof(uint8_t));
+    _additions = 0;
+}
+
+- (void)incrementKey:(NSString*)key
+{
+    uint64_t hash = [key hash];
+    BOOL incremented = NO;
+    for (NSUInteger row = 0; row < kBBCacheTinyLFUSketchDepth; row++) {
+        uint8_t* counter = &_counters[(row * _width) + [self columnForHash:hash row:row]];
+        if (*counter < kBBCacheTinyLFUSketchMaximumCount) {
+            (*counter)++;
+            incremented = YES;
+        }
+    }
+
+    if (incremented && (++_additions >= (_width * kBBCacheTinyLFUSamplesPerCounter))) [self age];
+}
+
+- (NSUInteger)frequencyOfKey:(NSString*)key
+{
+    uint64_t hash = [key hash];
+    NSUInteger frequency = kBBCacheTinyLFUSketchMaximumCount;
+    for (NSUInteger row = 0; row < kBBCacheTinyLFUSketchDepth; row++) {
+        frequency = MIN(frequency, (NSUInteger)_counters[(row * _width) + [self columnForHash:hash row:row]]);
+    }
+
+    return frequency;
+}
+
+- (void)reset
+{
+    memset(_counters, 0, _width * kBBCacheTinyLFUSketchDepth);
+    _additions = 0;
+}
+
+- (NSUInteger)columnForHash:(uint64_t)hash row:(NSUInteger)row
+{
+    return (NSUInteger)(BBCacheEvictionPolicyMix(hash + (row * 0x9e3779b97f4a7c15ULL)) & (_width - 1));
+}
+
+- (void)age
+{
+    NSUInteger length = _width * kBBCacheTinyLFUSketchDepth;
+    for (NSUInteger i = 0; i < length; i++) _counters[i] >>= 1;
+    _additions /= 2;
+}
+
+@end
+
+
+
+#pragma mark -
+
+@implementation BBCacheLRUEvictionPolicy
+{
+    NSMutableDictionary* _nodes;
+    BBCacheEvictionList* _list;
+}
+
+- (instancetype)init
+{
+    self = [super init];
+    if (self != nil) {
+        _nodes = [NSMutableDictionary dictionary];
+        _list = [[BBCacheEvictionList alloc] init];
+    }
+
+    return self;
+}
+
+- (NSString*)name
+{
+    return @"LRU";
+}
+
+- (void)recordInsertionOfKey:(NSString*)key
+{
+    BBCacheEvictionNode* node = _nodes[key];
+    if (node == nil) {
+        node = [[BBCacheEvictionNode alloc] initWithKey:key];
+        _nodes[key] = node;
+    } else {
+        [_list removeNode:node];
+    }
+    [_list pushFront:node];
+}
+
+- (void)recordAccessOfKey:(NSString*)key
+{
+    BBCacheEvictionNode* node = _nodes[key];
+    if (node == nil) return;
+
+    [_list removeNode:node];
+    [_list pushFront:node];
+}
+
+- (void)recordRemovalOfKey:(NSString*)key
+{
+    BBCacheEvictionNode* node = _nodes[key];
+    if (node == nil) return;
+
+    [_list removeNode:node];
+    [_nodes removeObjectForKey:key];
+}
+
+- (NSString*)popEvictionCandidate
+{
+    BBCacheEvictionNode* node = [_list back];
+    if (node == nil) return nil;
+
+    NSString* key = node->_key;
+    [self recordRemovalOfKey:key];
+
+    return key;
+}
+
+- (void)removeAllKeys
+{
+    while ([_list back] != nil) [_list removeNode:[_list back]];
+    [_nodes removeAllObjects];
+}
+
+@end
+
+
+
+#pragma mark -
+
+@implementation BBCacheLFUEvictionPolicy
+{
+    NSMutableDictionary* _nodes;
+    // Owns the frequency lists, which are also linked to one another in increasing order of frequency from _lowest
+    NSMutableDictionary* _lists;
+    __unsafe_unretained BBCacheEvictionList* _lowest;
+}
+
+- (instancetype)init
+{
+    self = [super init];
+    if (self != nil) {
+        _nodes = [NSMutableDictionary dictionary];
+        _lists = [NSMutableDictionary dictionary];
+    }
+
+    return self;
+}
+
+- (NSString*)name
+{
+    return @"LFU";
+}
+
+- (void)recordInsertionOfKey:(NSString*)key
+{
+    if (_nodes[key] != nil) {
+        [self recordAccessOfKey:key];
+        return;
+    }
+
+    BBCacheEvictionNode* node = [[BBCacheEvictionNode alloc] initWithKey:key];
+    _nodes[key] = node;
+    [[self listWithFrequency:1 after:nil] pushFront:node];
+}
+
+- (void)recordAccessOfKey:(NSString*)key
+{
+    BBCacheEvictionNode* node = _nodes[key];
+    if (node == nil) return;
+
+    BBCacheEvictionList* list = node->_list;
+    BBCacheEvictionList* nextList = [self listWithFrequency:(list->_frequency + 1) after:list];
+    [self removeNode:node];
+    [nextList pushFront:node];
+}
+
+- (void)recordRemovalOfKey:(NSString*)key
+{
+    BBCacheEvictionNode* node = _nodes[key];
+    if (node == nil) return;
+
+    [self removeNode:node];
+    [_nodes removeObjectForKey:key];
+}
+
+- (NSString*)popEvictionCandidate
+{
+    BBCacheEvictionNode* node = [_lowest back];
+    if (node == nil) return nil;
+
+    NSString* key = node->_key;
+    [self recordRemovalOfKey:key];
+
+    return key;
+}
+
+- (void)removeAllKeys
+{
+    [_nodes removeAllObjects];
+    [_lists removeAllObjects];
+    _lowest = nil;
+}
+
+#pragma mark Private helpers
+
+- (BBCacheEvictionList*)listWithFrequency:(NSUInteger)frequency after:(BBCacheEvictionList*)previousList
+{
+    // The list for a frequency, if it exists, is always right after the one for the frequency before, or first
+    BBCacheEvictionList* candidate = (previousList != nil) ? previousList->_nextList : _lowest;
+    if ((candidate != nil) && (candidate->_frequency == frequency)) return candidate;
+
+    BBCacheEvictionList* list = [[BBCacheEvictionList alloc] init];
+    list->_frequency = frequency;
+    list->_previousList = previousList;
+    list->_nextList = candidate;
+    if (candidate != nil) candidate->_previousList = list;
+    if (previousList != nil) previousList->_nextList = list;
+    else _lowest = list;
+    _lists[@(frequency)] = list;
+
+    return list;
+}
+
+- (void)removeNode:(BBCacheEvictionNode*)node
+{
+    BBCacheEvictionList* list = node->_list;
+    [list removeNode:node];
+    if (list->_count > 0) return;
+
+    // Unlink lists as they empty, so that _lowest always has something to evict
+    if (list->_previousList != nil) list->_previousList->_nextList = list->_nextList;
+    else _lowest = list->_nextList;
+    if (list->_nextList != nil) list->_nextList->_previousList = list->_previousList;
+    [_lists removeObjectForKey:@(list->_frequency)];
+}
+
+@end
+
+
+
+#pragma mark -
+
+@implementation BBCacheTinyLFUEvictionPolicy
+{
+    NSMutableDictionary* _nodes;
+    BBCacheEvictionList* _window;
+    BBCacheEvictionList* _probation;
+    BBCacheEvictionList* _protected;
+    BBCacheFrequencySketch* _sketch;
+}
+
+- (instancetype)init
+{
+    self = [super init];
+    if (self != nil) {
+        _nodes = [NSMutableDictionary dictionary];
+        _window = [[BBCacheEvictionList alloc] init];
+        _probation = [[BBCacheEvictionList alloc] init];
+        _protected = [[BBCacheEvictionList alloc] init];
+        _sketch = [[BBCacheFrequencySketch alloc] init];
+    }
+
+    return self;
+}
+
+- (NSString*)name
+{
+    return @"W-TinyLFU";
+}
+
+- (void)recordInsertionOfKey:(NSString*)key
+{
+    if (_nodes[key] != nil) {
+        [self recordAccessOfKey:key];
+        return;
+    }
+
+    [_sketch incrementKey:key];
+
+    BBCacheEvictionNode* node = [[BBCacheEvictionNode alloc] initWithKey:key];
+    _nodes[key] = node;
+    [_window pushFront:node];
+    [_sketch ensureCapacity:[_nodes count]];
+}
+
+- (void)recordAccessOfKey:(NSString*)key
+{
+    [_sketch incrementKey:key];
+
+    BBCacheEvictionNode* node = _nodes[key];
+    if (node == nil) return;
+
+    BBCacheEvictionList* list = node->_list;
+    [list removeNode:node];
+    if (list == _window) {
+        [_window pushFront:node];
+        return;
+    }
+
+    // Anything used again while in the main area is promoted; keep the protected segment within its share
+    [_protected pushFront:node];
+    NSUInteger mainCount = [_nodes count] - _window->_count;
+    while (_protected->_count > ((mainCount * 4) / 5)) {
+        BBCacheEvictionNode* demoted = [_protected back];
+        [_protected removeNode:demoted];
+        [_probation pushFront:demoted];
+    }
+}
+
+- (void)recordRemovalOfKey:(NSString*)key
+{
+    BBCacheEvictionNode* node = _nodes[key];
+    if (node == nil) return;
+
+    [node->_list removeNode:node];
+    [_nodes removeObjectForKey:key];
+}
+
+- (NSString*)popEvictionCandidate
+{
+    BBCacheEvictionNode* victim = [_probation back] ?: [_protected back];
+    BBCacheEvictionNode* candidate = [_window back];
+
+    NSUInteger windowLimit = MAX([_nodes count] / 100, (NSUInteger)1);
+    BBCacheEvictionNode* evicted = nil;
+    if ((candidate != nil) && ((_window->_count > windowLimit) || (victim == nil))) {
+        // The window's oldest key leaves it either way; it only makes it into the main area if it's seen more often
+        // than the key it would displace there
+        if ((victim != nil) && ([_sketch frequencyOfKey:candidate->_key] > [_sketch frequencyOfKey:victim->_key])) {
+            [_window removeNode:candidate];
+            [_probation pushFront:candidate];
+            evicted = victim;
+        } else {
+            evicted = candidate;
+        }
+    } else {
+        evicted = victim;
+    }
+
+    if (evicted == nil) return nil;
+
+    NSString* key = evicted->_key;
+    [self recordRemovalOfKey:key];
+
+    return key;
+}
+
+- (void)removeAllKeys
+{
+    for (BBCacheEvictionList* list in @[_window, _probation, _protected]) {
+        while ([list back] != nil) [list removeNode:[list back]];
+    }
+    [_nodes removeAllObjects];
+    [_sketch reset];
+}
+
+@end
+
+
+
+#pragma mark -
+
+@implementation BBCacheARCEvictionPolicy
+{
+    // Both resident and ghost keys; a node's list tells which it is
+    NSMutableDictionary* _nodes;
+    BBCacheEvictionList* _recent;
+    BBCacheEvictionList* _frequent;
+    BBCacheEvictionList* _recentGhosts;
+    BBCacheEvictionList* _frequentGhosts;
+    double _recentTarget;
+    NSUInteger _capacity;
+}
+
+- (instancetype)init
+{
+    self = [super init];
+    if (self != nil) {
+        _nodes = [NSMutableDictionary dictionary];
+        _recent = [[BBCacheEvictionList alloc] init];
+        _frequent = [[BBCacheEvictionList alloc] init];
+        _recentGhosts = [[BBCacheEvictionList alloc] init];
+        _frequentGhosts = [[BBCacheEvictionList alloc] init];
+    }
+
+    return self;
+}
+
+- (NSString*)name
+{
+    return @"ARC";
+}
+
+- (void)recordInsertionOfKey:(NSString*)key
+{
+    BBCacheEvictionNode* node = _nodes[key];
+    if (node == nil) {
+        node = [[BBCacheEvictionNode alloc] initWithKey:key];
+        _nodes[key] = node;
+        [_recent pushFront:node];
+    } else {
+        BBCacheEvictionList* list = node->_list;
+        if (list == _recentGhosts) {
+            // Evicted from the recent list too early; give it more room
+            double delta = MAX((double)_frequentGhosts->_count / _recentGhosts->_count, 1.0);
+            _recentTarget = MIN(_recentTarget + delta, (double)_capacity);
+        } else if (list == _frequentGhosts) {
+            double delta = MAX((double)_recentGhosts->_count / _frequentGhosts->_count, 1.0);
+            _recentTarget = MAX(_recentTarget - delta, 0.0);
+        }
+        [list removeNode:node];
+        [_frequent pushFront:node];
+    }
+
+    _capacity = MAX(_capacity, _recent->_count + _frequent->_count);
+    [self trimGhosts];
+}
+
+- (void)recordAccessOfKey:(NSString*)key
+{
+    BBCacheEvictionNode* node = _nodes[key];
+    if ((node == nil) || ((node->_list != _recent) && (node->_list != _frequent))) return;
+
+    [node->_list removeNode:node];
+    [_frequent pushFront:node];
+}
+
+- (void)recordRemovalOfKey:(NSString*)key
+{
+    // Keys removed explicitly, rather than evicted, don't leave a ghost behind
+    BBCacheEvictionNode* node = _nodes[key];
+    if ((node == nil) || ((node->_list != _recent) && (node->_list != _frequent))) return;
+
+    [node->_list removeNode:node];
+    [_nodes removeObjectForKey:key];
+}
+
+- (NSString*)popEvictionCandidate
+{
+    BBCacheEvictionNode* node = nil;
+    BBCacheEvictionList* ghosts = nil;
+    if ((_recent->_count > 0) && ((_recent->_count > _recentTarget) || (_frequent->_count == 0))) {
+        node = [_recent back];
+        ghosts = _recentGhosts;
+    } else {
+        node = [_frequent back];
+        ghosts = _frequentGhosts;
+    }
+    if (node == nil) return nil;
+
+    [node->_list removeNode:node];
+    [ghosts pushFront:node];
+    [self trimGhosts];
+
+    return node->_key;
+}
+
+- (void)removeAllKeys
+{
+    for (BBCacheEvictionList* list in @[_recent, _frequent, _recentGhosts, _frequentGhosts]) {
+        while ([list back] != nil) [list removeNode:[list back]];
+    }
+    [_nodes removeAllObjects];
+    _recentTarget = 0;
+    _capacity = 0;
+}
+
+#pragma mark Private helpers
+
+- (void)trimGhosts
+{
+    // Recent keys and their ghosts never take more than the capacity, and all ghosts together no more than that either
+    while ((_recentGhosts->_count > 0) && ((_recent->_count + _recentGhosts->_count) > _capacity)) {
+        [self dropGhost:[_recentGhosts back]];
+    }
+    while ((_recentGhosts->_count + _frequentGhosts->_count) > _capacity) {
+        [self dropGhost:([_frequentGhosts back] ?: [_recentGhosts back])];
+    }
+}
+
+- (void)dropGhost:(BBCacheEvictionNode*)node
+{
+    [node->_list removeNode:node];
+    [_nodes removeObjectForKey:node->_key];
+}
+
+@end
@@ -25,10 +25,28 @@
 
 #pragma mark -
 
+/**
+ An item that can be stored in a `BBCache`.
+
+ Items must implement either the `NSDate` based `expirationDate`/`setExpirationDate:` pair or the raw
+ `expirationTimestamp`/`setExpirationTimestamp:` pair. When both are implemented, the cache only uses the latter, which
+ spares it from allocating a date every time an item is touched.
+ */
 @protocol BBCacheItem <BBRepositoryItem>
 
-@required
+
+#pragma mark Expiration as a date
+
+@optional
 - (NSDate*)expirationDate;
 - (void)setExpirationDate:(NSDate*)date;
 
+
+#pragma mark Expiration as a timestamp
+
+/** Expiration as seconds since the reference date (see `NSDate`), or `0` if the item doesn't have one yet. */
+@optional
+- (NSTimeInterval)expirationTimestamp;
+- (void)setExpirationTimestamp:(NSTimeInterval)timestamp;
+
 @end
@@ -20,12 +20,26 @@
 //
 
 #import "BBCache.h"
+#import "BBCacheEvictionPolicy.h"
 #import "BBCappedCacheItem.h"
 
 
 
 #pragma mark -
 
+/**
+ Cache that evicts items whenever the sum of the items' `resourceUsage` goes over `resourceUsageLimit`; by default, the
+ ones with the earliest expiration first, otherwise in the order picked by its `evictionPolicy`.
+
+ The total resource usage is kept up to date as items are added, replaced and removed, and items are kept in a heap
+ ordered by expiration, so accounting is O(1) and each eviction is O(log n), regardless of the number of items.
+
+ Both are maintained through the add, replace and remove hooks; subclasses that override `didAddNewItem:`,
+ `didReplaceItem:withNewItem:`, `didRemoveItem:` or `reloadComplete` **must** call `super`. Items must not change their
+ `resourceUsage` while in the cache; replace them instead.
+
+ @see BBCappedCacheItem
+ */
 @interface BBCappedCache : BBCache
 
 
@@ -63,8 +77,35 @@
 ///-----------------------------
 
 - (BOOL)addItem:(id<BBCappedCacheItem>)item;
+- (NSUInteger)addItems:(NSArray*)items;
 
 
+#pragma mark Resource usage
+
+///---------------------
+/// @name Resource usage
+///---------------------
+
+/** Sum of the `resourceUsage` of every item in the cache, including the ones not loaded yet. O(1). */
 - (double)totalResourceUsage;
 
+
+#pragma mark Eviction
+
+///---------------
+/// @name Eviction
+///---------------
+
+/**
+ Policy that picks the items to evict when over `resourceUsageLimit`. Defaults to `nil`, meaning earliest expiration
+ first, which, since reading an item pushes its expiration back, approximates LRU.
+
+ Built-in policies are `BBCacheLRUEvictionPolicy`, `BBCacheLFUEvictionPolicy`, `BBCacheTinyLFUEvictionPolicy` and
+ `BBCacheARCEvictionPolicy`; `BBCacheTraceReplay`, under `Benchmarks`, compares them against recorded access logs. A
+ policy must not be shared between caches. Setting one seeds it with the keys currently in the cache, earliest expiration first.
+
+ Expired items are still removed by `compact` before the policy is consulted.
+ */
+@property(strong, nonatomic) id<BBCacheEvictionPolicy> evictionPolicy;
+
 @end
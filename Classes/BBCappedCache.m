@@ -21,11 +21,23 @@
 
 #import "BBCappedCache.h"
 
+#import <pthread.h>
+
+#import "BBExpirationHeap.h"
+
 
 
 #pragma mark -
 
 @implementation BBCappedCache
+{
+    // Guards every accounting ivar below; hooks for different keys run concurrently
+    pthread_mutex_t _accountingLock;
+    double _totalResourceUsage;
+    NSMutableDictionary* _expirationTimestamps;
+    BBExpirationHeap* _evictionQueue;
+    id<BBCacheEvictionPolicy> _evictionPolicy;
+}
 
 
 #pragma mark Creation
@@ -51,7 +63,10 @@
 - (instancetype)initWithIdentifier:(NSString*)identifier resourceUsageLimit:(double)resourceUsageLimit
 {
     self = [super initWithIdentifier:identifier];
-    if (self != nil) _resourceUsageLimit = resourceUsageLimit;
+    if (self != nil) {
+        _resourceUsageLimit = resourceUsageLimit;
+        [self setupAccounting];
+    }
 
     return self;
 }
@@ -60,14 +75,49 @@
                 resourceUsageLimit:(double)resourceUsageLimit
 {
     self = [super initWithIdentifier:identifier itemDuration:itemDuration];
-    if (self != nil) _resourceUsageLimit = resourceUsageLimit;
+    if (self != nil) {
+        _resourceUsageLimit = resourceUsageLimit;
+        [self setupAccounting];
+    }
 
     return self;
 }
 
+- (void)dealloc
+{
+    pthread_mutex_destroy(&_accountingLock);
+}
+
 
 #pragma mark BBRepository overrides
 
+- (BOOL)destroy
+{
+    BOOL destroyed = [super destroy];
+    [self resetAccounting];
+
+    return destroyed;
+}
+
+- (id)itemForKey:(NSString*)key
+{
+    id<BBCappedCacheItem> item = [super itemForKey:key];
+    if (item == nil) return nil;
+
+    // The item was just touched, so its position in the eviction queue changed; unless it's been removed or replaced
+    // since, in which case the hooks already took care of it.
+    [self performWithLockForKey:key block:^{
+        if (_entries[key] == item) {
+            [self trackExpirationOfItem:item];
+            pthread_mutex_lock(&_accountingLock);
+            [_evictionPolicy recordAccessOfKey:key];
+            pthread_mutex_unlock(&_accountingLock);
+        }
+    }];
+
+    return item;
+}
+
 - (BOOL)addItem:(id<BBCappedCacheItem>)item
 {
     double resourceUsageAfterAdding = [self totalResourceUsage] + [item resourceUsage];
@@ -78,6 +128,86 @@
     return [super addItem:item];
 }
 
+- (NSUInteger)addItems:(NSArray*)items
+{
+    // Same as addItem:, but account for the whole batch at once so we compact at most once
+    double resourceUsageAfterAdding = [self totalResourceUsage];
+    for (id<BBCappedCacheItem> item in items) resourceUsageAfterAdding += [item resourceUsage];
+
+    BOOL overCapacity = resourceUsageAfterAdding > _resourceUsageLimit;
+
+    if (overCapacity) [self compact];
+
+    return [super addItems:items];
+}
+
+- (BBRepositoryItemMetadata)metadataForItem:(id<BBCappedCacheItem>)item
+{
+    BBRepositoryItemMetadata metadata = [super metadataForItem:item];
+    metadata.resourceUsage = [item resourceUsage];
+
+    return metadata;
+}
+
+- (void)reloadComplete
+{
+    [super reloadComplete];
+
+    // Rebuild the accounting from scratch; metadata is available without loading items
+    [self resetAccounting];
+    [self enumerateItemMetadataUsingBlock:^(NSString* key, BBRepositoryItemMetadata metadata, BOOL* stop) {
+        pthread_mutex_lock(&_accountingLock);
+        _totalResourceUsage += metadata.resourceUsage;
+        [self trackKey:key expirationTimestamp:metadata.expirationTimestamp];
+        [_evictionPolicy recordInsertionOfKey:key];
+        pthread_mutex_unlock(&_accountingLock);
+    }];
+}
+
+- (void)didAddNewItem:(id<BBCappedCacheItem>)item
+{
+    [super didAddNewItem:item];
+
+    pthread_mutex_lock(&_accountingLock);
+    _totalResourceUsage += [item resourceUsage];
+    [_evictionPolicy recordInsertionOfKey:[item key]];
+    pthread_mutex_unlock(&_accountingLock);
+
+    [self trackExpirationOfItem:item];
+}
+
+- (void)didReplaceItem:(id<BBCappedCacheItem>)item withNewItem:(id<BBCappedCacheItem>)newItem
+{
+    [super didReplaceItem:item withNewItem:newItem];
+
+    pthread_mutex_lock(&_accountingLock);
+    _totalResourceUsage += [newItem resourceUsage] - [item resourceUsage];
+    [_evictionPolicy recordInsertionOfKey:[newItem key]];
+    pthread_mutex_unlock(&_accountingLock);
+
+    [self trackExpirationOfItem:newItem];
+}
+
+- (void)didRemoveItem:(id<BBCappedCacheItem>)item
+{
+    [super didRemoveItem:item];
+
+    // Whatever is left in the eviction queue for this key is now stale and will be skipped when popped
+    pthread_mutex_lock(&_accountingLock);
+    _totalResourceUsage -= [item resourceUsage];
+    [_expirationTimestamps removeObjectForKey:[item key]];
+    [_evictionPolicy recordRemovalOfKey:[item key]];
+    pthread_mutex_unlock(&_accountingLock);
+}
+
+- (BBRepositoryStatistics*)statistics
+{
+    BBRepositoryStatistics* statistics = [super statistics];
+    statistics.resourceUsage = [self totalResourceUsage];
+
+    return statistics;
+}
+
 
 #pragma mark BBCache overrides
 
@@ -85,40 +215,125 @@
 {
     // Begin by ejecting stale items...
     NSUInteger deletedItems = [super compact];
-    double currentResourceUsage = [self totalResourceUsage];
-
-    // If we're under the resource usage limit, no need to compact further; bail out.
-    if (currentResourceUsage <= _resourceUsageLimit) return deletedItems;
 
-    // If we're over the limit, we need to remove items until we fit the limit again.
-    // This means sorting items by their expiration date (older ones first) and removing them.
-    NSComparator comparator = ^NSComparisonResult(id<BBCappedCacheItem> a, id<BBCappedCacheItem> b) {
-        return [[a expirationDate] compare:[b expirationDate]];
-    };
+    // ... then, if we're still over the limit, evict items as the policy sees fit until we fit it again.
+    NSUInteger evictedItems = 0;
+    while ([self totalResourceUsage] > _resourceUsageLimit) {
+        NSString* key = [self popEvictionCandidate];
+        if (key == nil) break;
 
-    NSArray* sortedItems = [[_entries allValues] sortedArrayUsingComparator:comparator];
-    for (id<BBCappedCacheItem> item in sortedItems) {
-        deletedItems++;
-        currentResourceUsage -= [item resourceUsage];
-        [self removeItemWithKey:[item key]];
-
-        // Bail out if at any point we go under the file limit
-        if (currentResourceUsage <= _resourceUsageLimit) return deletedItems;
+        if ([self removeItemWithKey:key] != nil) evictedItems++;
     }
+    [self recordStatistic:BBRepositoryStatisticEvictions count:evictedItems];
+    deletedItems += evictedItems;
 
     return deletedItems;
 }
 
-#pragma mark ???
+
+#pragma mark Interface
+
+- (id<BBCacheEvictionPolicy>)evictionPolicy
+{
+    pthread_mutex_lock(&_accountingLock);
+    id<BBCacheEvictionPolicy> evictionPolicy = _evictionPolicy;
+    pthread_mutex_unlock(&_accountingLock);
+
+    return evictionPolicy;
+}
+
+- (void)setEvictionPolicy:(id<BBCacheEvictionPolicy>)evictionPolicy
+{
+    pthread_mutex_lock(&_accountingLock);
+    _evictionPolicy = evictionPolicy;
+
+    // There's no history to go by, so hand it whatever's in the cache in order of expiration
+    [evictionPolicy removeAllKeys];
+    NSArray* keys = [_expirationTimestamps keysSortedByValueUsingSelector:@selector(compare:)];
+    for (NSString* key in keys) [evictionPolicy recordInsertionOfKey:key];
+    pthread_mutex_unlock(&_accountingLock);
+}
 
 - (double)totalResourceUsage
 {
-    double total = 0;
-    for (id<BBCappedCacheItem> item in [_entries allValues]) {
-        total += [item resourceUsage];
+    pthread_mutex_lock(&_accountingLock);
+    double totalResourceUsage = _totalResourceUsage;
+    pthread_mutex_unlock(&_accountingLock);
+
+    return totalResourceUsage;
+}
+
+
+#pragma mark Private helpers
+
+- (void)setupAccounting
+{
+    pthread_mutex_init(&_accountingLock, NULL);
+    _expirationTimestamps = [NSMutableDictionary dictionary];
+    _evictionQueue = [[BBExpirationHeap alloc] init];
+}
+
+- (void)resetAccounting
+{
+    pthread_mutex_lock(&_accountingLock);
+    _totalResourceUsage = 0;
+    [_expirationTimestamps removeAllObjects];
+    [_evictionQueue removeAllKeys];
+    [_evictionPolicy removeAllKeys];
+    pthread_mutex_unlock(&_accountingLock);
+}
+
+- (void)trackExpirationOfItem:(id<BBCappedCacheItem>)item
+{
+    NSTimeInterval expirationTimestamp = [self expirationTimestampForItem:item];
+
+    pthread_mutex_lock(&_accountingLock);
+    [self trackKey:[item key] expirationTimestamp:expirationTimestamp];
+    pthread_mutex_unlock(&_accountingLock);
+}
+
+- (void)trackKey:(NSString*)key expirationTimestamp:(NSTimeInterval)expirationTimestamp
+{
+    // Must be called with the accounting lock held
+    NSNumber* current = _expirationTimestamps[key];
+    if ((current != nil) && ([current doubleValue] == expirationTimestamp)) return;
+
+    _expirationTimestamps[key] = @(expirationTimestamp);
+    [_evictionQueue addKey:key expirationTimestamp:expirationTimestamp];
+
+    // Touches leave stale entries behind; once they outnumber the live ones, rebuild the queue from scratch
+    NSUInteger liveCount = [_expirationTimestamps count];
+    if ([_evictionQueue count] > ((liveCount * 2) + 64)) {
+        [_evictionQueue removeAllKeys];
+        [_expirationTimestamps enumerateKeysAndObjectsUsingBlock:^(NSString* liveKey, NSNumber* timestamp, BOOL* stop) {
+            [_evictionQueue addKey:liveKey expirationTimestamp:[timestamp doubleValue]];
+        }];
+    }
+}
+
+- (NSString*)popEvictionCandidate
+{
+    pthread_mutex_lock(&_accountingLock);
+    if (_evictionPolicy != nil) {
+        NSString* key = [_evictionPolicy popEvictionCandidate];
+        pthread_mutex_unlock(&_accountingLock);
+
+        return key;
+    }
+
+    NSString* key = nil;
+    NSTimeInterval expirationTimestamp = 0;
+    while ((key = [_evictionQueue popKeyWithExpirationTimestamp:&expirationTimestamp]) != nil) {
+        // Skip entries for keys that were removed or pushed again with a later expiration since
+        NSNumber* current = _expirationTimestamps[key];
+        if ((current != nil) && ([current doubleValue] == expirationTimestamp)) {
+            [_expirationTimestamps removeObjectForKey:key];
+            break;
+        }
     }
+    pthread_mutex_unlock(&_accountingLock);
 
-    return total;
+    return key;
 }
 
 @end
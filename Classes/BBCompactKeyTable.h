@@ -0,0 +1,42 @@
+//
+// Copyright 2013 BiasedBit
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+//
+//  Created by Bruno de Carvalho (@biasedbit, http://biasedbit.com)
+//  Copyright (c) 2013 BiasedBit. All rights reserved.
+//
+
+#pragma mark -
+
+/**
+ Mutable dictionary keyed by strings, laid out for millions of short keys.
+
+ Keys aren't kept as `NSString` objects. Their UTF-8 bytes are appended to a single contiguous arena, and the table
+ itself is a power of two array of 16 byte slots (64-bit hash, arena offset, length), probed linearly, with the values
+ in a parallel array. A lookup converts the incoming string to UTF-8 once, without copying for ASCII strings and on
+ the stack for most others, then hashes those bytes and compares them against candidate keys in the arena without
+ creating any object. Removals shift the following slots back rather than leaving
+ tombstones, and space left in the arena by removed keys is reclaimed once it makes up half of it.
+
+ Keys are recreated as `NSString` instances only when enumerating or calling `allKeys`.
+
+ Not thread-safe. Keys must be strings that can be represented in UTF-8: inserting any other key raises an
+ `NSInvalidArgumentException`, while looking one up or removing it finds nothing.
+
+ @see [BBConcurrentDictionary compactKeys]
+ */
+@interface BBCompactKeyTable : NSMutableDictionary
+@end
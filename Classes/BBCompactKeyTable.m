@@ -0,0 +1,456 @@
+//
+// Copyright 2013 BiasedBit
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+//
+//  Created by Bruno de Carvalho (@biasedbit, http://biasedbit.com)
+//  Copyright (c) 2013 BiasedBit. All rights reserved.
+//
+
+#import "BBCompactKeyTable.h"
+
+
+
+#pragma mark - Constants
+
+static NSUInteger const kBBCompactKeyTableMinimumCapacity = 16;
+static NSUInteger const kBBCompactKeyTableConversionBufferSize = 256;
+static NSUInteger const kBBCompactKeyTableMinimumArenaCapacity = 4096;
+
+
+
+#pragma mark - Types
+
+typedef struct {
+    /** Never 0 for a used slot; 0 marks an empty one. */
+    uint64_t hash;
+    uint32_t keyOffset;
+    uint32_t keyLength;
+} BBCompactKeyTableSlot;
+
+/**
+ A key as the table sees it: its UTF-8 bytes and their hash, worked out once per operation. The bytes point into the
+ string itself, into a caller provided buffer or, for long keys that need converting, into `allocatedBytes`.
+ */
+typedef struct {
+    const uint8_t* bytes;
+    NSUInteger length;
+    uint64_t hash;
+    uint8_t* allocatedBytes;
+} BBCompactKeyTableKey;
+
+
+
+#pragma mark - Utility functions
+
+static uint64_t BBCompactKeyTableHash(const uint8_t* bytes, NSUInteger length)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (NSUInteger i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+
+    // FNV-1a leaves the top bits poorly mixed, and the table indexes with the low ones; finalize, then reserve 0
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+
+    return (hash != 0) ? hash : 1;
+}
+
+/** Returns `NO` if the key can't be represented in UTF-8. Must be balanced by `BBCompactKeyTableKeyRelease`. */
+static BOOL BBCompactKeyTableKeyMake(NSString* string, uint8_t* buffer, NSUInteger bufferLength,
+                                     BBCompactKeyTableKey* key)
+{
+    key->allocatedBytes = NULL;
+
+    // Most keys are plain ASCII strings whose bytes can be had without converting anything. That's only the case if
+    // the C string is exactly as long as the string; an embedded NUL would cut it short.
+    const char* cString = CFStringGetCStringPtr((__bridge CFStringRef)string, kCFStringEncodingUTF8);
+    size_t cStringLength = (cString != NULL) ? strlen(cString) : 0;
+    if ((cString != NULL) && (cStringLength == (size_t)CFStringGetLength((__bridge CFStringRef)string))) {
+        key->bytes = (const uint8_t*)cString;
+        key->length = cStringLength;
+        key->hash = BBCompactKeyTableHash(key->bytes, key->length);
+        return YES;
+    }
+
+    // Otherwise convert, on the stack unless it's too long to fit
+    NSUInteger maximumLength = [string maximumLengthOfBytesUsingEncoding:NSUTF8StringEncoding];
+    uint8_t* bytes = buffer;
+    if (maximumLength > bufferLength) {
+        key->allocatedBytes = malloc(maximumLength);
+        bytes = key->allocatedBytes;
+    }
+
+    NSUInteger length = 0;
+    NSRange remaining = NSMakeRange(0, 0);
+    NSRange range = NSMakeRange(0, [string length]);
+    if (range.length > 0) {
+        BOOL converted = [string getBytes:bytes maxLength:maximumLength usedLength:&length
+                                 encoding:NSUTF8StringEncoding options:0 range:range remainingRange:&remaining];
+        if (!converted || (remaining.length > 0)) {
+            free(key->allocatedBytes);
+            key->allocatedBytes = NULL;
+            return NO;
+        }
+    }
+
+    key->bytes = bytes;
+    key->length = length;
+    key->hash = BBCompactKeyTableHash(bytes, length);
+
+    return YES;
+}
+
+static void BBCompactKeyTableKeyRelease(BBCompactKeyTableKey* key)
+{
+    free(key->allocatedBytes);
+    key->allocatedBytes = NULL;
+}
+
+
+
+#pragma mark -
+
+@implementation BBCompactKeyTable
+{
+    BBCompactKeyTableSlot* _slots;
+    __strong id* _values;
+    NSUInteger _capacity;
+    NSUInteger _count;
+    uint8_t* _arena;
+    NSUInteger _arenaLength;
+    NSUInteger _arenaCapacity;
+    NSUInteger _arenaGarbage;
+}
+
+
+#pragma mark Creation
+
+- (instancetype)init
+{
+    return [self initWithCapacity:0];
+}
+
+- (instancetype)initWithCapacity:(NSUInteger)numItems
+{
+    self = [super init];
+    if (self != nil) {
+        // Stay under 3/4 full
+        NSUInteger capacity = kBBCompactKeyTableMinimumCapacity;
+        while ((capacity * 3) < (numItems * 4)) capacity *= 2;
+        [self allocateSlotsWithCapacity:capacity];
+    }
+
+    return self;
+}
+
+- (instancetype)initWithObjects:(const id[])objects forKeys:(const id<NSCopying>[])keys count:(NSUInteger)count
+{
+    self = [self initWithCapacity:count];
+    if (self != nil) {
+        for (NSUInteger i = 0; i < count; i++) [self setObject:objects[i] forKey:keys[i]];
+    }
+
+    return self;
+}
+
+- (void)dealloc
+{
+    for (NSUInteger i = 0; i < _capacity; i++) _values[i] = nil;
+    free(_values);
+    free(_slots);
+    free(_arena);
+}
+
+
+#pragma mark NSDictionary primitives
+
+- (NSUInteger)count
+{
+    return _count;
+}
+
+- (id)objectForKey:(id)key
+{
+    if (![key isKindOfClass:[NSString class]]) return nil;
+
+    // A key that can't be represented in UTF-8 can't have been inserted either
+    uint8_t buffer[kBBCompactKeyTableConversionBufferSize];
+    BBCompactKeyTableKey tableKey;
+    if (!BBCompactKeyTableKeyMake(key, buffer, sizeof(buffer), &tableKey)) return nil;
+
+    NSUInteger index = [self indexOfKey:&tableKey];
+    BBCompactKeyTableKeyRelease(&tableKey);
+
+    return (index != NSNotFound) ? _values[index] : nil;
+}
+
+- (NSEnumerator*)keyEnumerator
+{
+    return [[self allKeys] objectEnumerator];
+}
+
+
+#pragma mark NSMutableDictionary primitives
+
+- (void)setObject:(id)object forKey:(id<NSCopying>)key
+{
+    if (object == nil) [NSException raise:NSInvalidArgumentException format:@"Object for key '%@' is nil", key];
+    if (![(id)key isKindOfClass:[NSString class]]) {
+        [NSException raise:NSInvalidArgumentException format:@"Key '%@' is not a string", key];
+    }
+
+    uint8_t buffer[kBBCompactKeyTableConversionBufferSize];
+    BBCompactKeyTableKey tableKey;
+    if (!BBCompactKeyTableKeyMake((NSString*)key, buffer, sizeof(buffer), &tableKey)) {
+        [NSException raise:NSInvalidArgumentException format:@"Key '%@' can't be represented in UTF-8", key];
+    }
+
+    NSUInteger index = [self indexOfKey:&tableKey];
+    if (index != NSNotFound) {
+        _values[index] = object;
+        BBCompactKeyTableKeyRelease(&tableKey);
+        return;
+    }
+
+    if ((_arenaLength + tableKey.length) > UINT32_MAX) {
+        BBCompactKeyTableKeyRelease(&tableKey);
+        [NSException raise:NSMallocException format:@"Key arena can't grow past 4GB"];
+    }
+    if (((_count + 1) * 4) > (_capacity * 3)) [self resizeToCapacity:(_capacity * 2)];
+
+    NSUInteger keyOffset = _arenaLength;
+    [self ensureArenaCapacity:(_arenaLength + tableKey.length)];
+    memcpy(_arena + keyOffset, tableKey.bytes, tableKey.length);
+    _arenaLength += tableKey.length;
+
+    NSUInteger mask = _capacity - 1;
+    index = (NSUInteger)tableKey.hash & mask;
+    while (_slots[index].hash != 0) index = (index + 1) & mask;
+
+    _slots[index].hash = tableKey.hash;
+    _slots[index].keyOffset = (uint32_t)keyOffset;
+    _slots[index].keyLength = (uint32_t)tableKey.length;
+    _values[index] = object;
+    _count++;
+
+    BBCompactKeyTableKeyRelease(&tableKey);
+}
+
+- (void)removeObjectForKey:(id)key
+{
+    if (![key isKindOfClass:[NSString class]]) return;
+
+    uint8_t buffer[kBBCompactKeyTableConversionBufferSize];
+    BBCompactKeyTableKey tableKey;
+    if (!BBCompactKeyTableKeyMake(key, buffer, sizeof(buffer), &tableKey)) return;
+
+    NSUInteger index = [self indexOfKey:&tableKey];
+    BBCompactKeyTableKeyRelease(&tableKey);
+    if (index == NSNotFound) return;
+
+    _arenaGarbage += _slots[index].keyLength;
+    _count--;
+
+    // Shift back every following slot that would no longer be reachable from its home slot across the gap
+    NSUInteger mask = _capacity - 1;
+    NSUInteger gap = index;
+    NSUInteger next = index;
+    while (YES) {
+        next = (next + 1) & mask;
+        if (_slots[next].hash == 0) break;
+
+        NSUInteger home = (NSUInteger)_slots[next].hash & mask;
+        BOOL reachable = (gap <= next) ? ((gap < home) && (home <= next)) : ((gap < home) || (home <= next));
+        if (reachable) continue;
+
+        _slots[gap] = _slots[next];
+        _values[gap] = _values[next];
+        gap = next;
+    }
+    _slots[gap].hash = 0;
+    _values[gap] = nil;
+
+    if ((_arenaGarbage * 2) > _arenaLength) [self compactArena];
+}
+
+
+#pragma mark NSDictionary overrides
+
+- (NSArray*)allKeys
+{
+    NSMutableArray* keys = [NSMutableArray arrayWithCapacity:_count];
+    [self enumerateKeysAndObjectsUsingBlock:^(id key, id object, BOOL* stop) {
+        [keys addObject:key];
+    }];
+
+    return keys;
+}
+
+- (NSArray*)allValues
+{
+    NSMutableArray* values = [NSMutableArray arrayWithCapacity:_count];
+    for (NSUInteger i = 0; i < _capacity; i++) {
+        if (_slots[i].hash != 0) [values addObject:_values[i]];
+    }
+
+    return values;
+}
+
+- (void)enumerateKeysAndObjectsUsingBlock:(void (^)(id key, id object, BOOL* stop))block
+{
+    BOOL stop = NO;
+    for (NSUInteger i = 0; (i < _capacity) && !stop; i++) {
+        if (_slots[i].hash == 0) continue;
+
+        block([self keyAtIndex:i], _values[i], &stop);
+    }
+}
+
+- (void)enumerateKeysAndObjectsWithOptions:(NSEnumerationOptions)options
+                                usingBlock:(void (^)(id key, id object, BOOL* stop))block
+{
+    [self enumerateKeysAndObjectsUsingBlock:block];
+}
+
+- (id)copyWithZone:(NSZone*)zone
+{
+    return [self mutableCopyWithZone:zone];
+}
+
+- (id)mutableCopyWithZone:(NSZone*)zone
+{
+    // Straight copies of the arrays; no rehashing, no key objects
+    BBCompactKeyTable* copy = [[[self class] allocWithZone:zone] initWithCapacity:0];
+    [copy copyContentsFromTable:self];
+
+    return copy;
+}
+
+
+#pragma mark NSMutableDictionary overrides
+
+- (void)removeAllObjects
+{
+    for (NSUInteger i = 0; i < _capacity; i++) _values[i] = nil;
+    memset(_slots, 0, _capacity * sizeof(BBCompactKeyTableSlot));
+    _count = 0;
+    _arenaLength = 0;
+    _arenaGarbage = 0;
+}
+
+
+#pragma mark Private helpers
+
+- (void)allocateSlotsWithCapacity:(NSUInteger)capacity
+{
+    _capacity = capacity;
+    _slots = calloc(capacity, sizeof(BBCompactKeyTableSlot));
+    _values = (__strong id*)calloc(capacity, sizeof(id));
+}
+
+- (NSUInteger)indexOfKey:(const BBCompactKeyTableKey*)key
+{
+    // Full 64-bit hashes rule out nearly every other key before their bytes are ever compared
+    NSUInteger mask = _capacity - 1;
+    for (NSUInteger index = (NSUInteger)key->hash & mask; _slots[index].hash != 0; index = (index + 1) & mask) {
+        BBCompactKeyTableSlot* slot = &_slots[index];
+        if ((slot->hash == key->hash) && (slot->keyLength == key->length) &&
+            (memcmp(_arena + slot->keyOffset, key->bytes, key->length) == 0)) return index;
+    }
+
+    return NSNotFound;
+}
+
+- (NSString*)keyAtIndex:(NSUInteger)index
+{
+    return [[NSString alloc] initWithBytes:(_arena + _slots[index].keyOffset) length:_slots[index].keyLength
+                                  encoding:NSUTF8StringEncoding];
+}
+
+- (void)resizeToCapacity:(NSUInteger)capacity
+{
+    BBCompactKeyTableSlot* oldSlots = _slots;
+    __strong id* oldValues = _values;
+    NSUInteger oldCapacity = _capacity;
+
+    [self allocateSlotsWithCapacity:capacity];
+    NSUInteger mask = capacity - 1;
+    for (NSUInteger i = 0; i < oldCapacity; i++) {
+        if (oldSlots[i].hash == 0) continue;
+
+        NSUInteger index = (NSUInteger)oldSlots[i].hash & mask;
+        while (_slots[index].hash != 0) index = (index + 1) & mask;
+        _slots[index] = oldSlots[i];
+        _values[index] = oldValues[i];
+        oldValues[i] = nil;
+    }
+
+    free(oldSlots);
+    free(oldValues);
+}
+
+- (void)ensureArenaCapacity:(NSUInteger)capacity
+{
+    if (capacity <= _arenaCapacity) return;
+
+    NSUInteger arenaCapacity = MAX(_arenaCapacity, kBBCompactKeyTableMinimumArenaCapacity);
+    while (arenaCapacity < capacity) arenaCapacity *= 2;
+    _arena = realloc(_arena, arenaCapacity);
+    _arenaCapacity = arenaCapacity;
+}
+
+- (void)compactArena
+{
+    uint8_t* arena = malloc(MAX(_arenaLength - _arenaGarbage, (NSUInteger)1));
+    NSUInteger arenaLength = 0;
+    for (NSUInteger i = 0; i < _capacity; i++) {
+        if (_slots[i].hash == 0) continue;
+
+        memcpy(arena + arenaLength, _arena + _slots[i].keyOffset, _slots[i].keyLength);
+        _slots[i].keyOffset = (uint32_t)arenaLength;
+        arenaLength += _slots[i].keyLength;
+    }
+
+    free(_arena);
+    _arena = arena;
+    _arenaLength = arenaLength;
+    _arenaCapacity = MAX(arenaLength, (NSUInteger)1);
+    _arenaGarbage = 0;
+}
+
+- (void)copyContentsFromTable:(BBCompactKeyTable*)table
+{
+    for (NSUInteger i = 0; i < _capacity; i++) _values[i] = nil;
+    free(_slots);
+    free(_values);
+    free(_arena);
+
+    [self allocateSlotsWithCapacity:table->_capacity];
+    memcpy(_slots, table->_slots, _capacity * sizeof(BBCompactKeyTableSlot));
+    for (NSUInteger i = 0; i < _capacity; i++) _values[i] = table->_values[i];
+    _count = table->_count;
+
+    _arena = malloc(MAX(table->_arenaLength, (NSUInteger)1));
+    memcpy(_arena, table->_arena, table->_arenaLength);
+    _arenaLength = table->_arenaLength;
+    _arenaCapacity = MAX(table->_arenaLength, (NSUInteger)1);
+    _arenaGarbage = table->_arenaGarbage;
+}
+
+@end
@@ -0,0 +1,87 @@
+//
+// Copyright 2013 BiasedBit
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+//
+//  Created by Bruno de Carvalho (@biasedbit, http://biasedbit.com)
+//  Copyright (c) 2013 BiasedBit. All rights reserved.
+//
+
+#pragma mark - Constants
+
+/** Default number of stripes, i.e. the number of threads that can access different keys without contending. */
+extern NSUInteger const kBBConcurrentDictionaryDefaultStripeCount;
+
+
+
+#pragma mark -
+
+/**
+ Thread-safe `NSMutableDictionary` that splits its entries across a number of stripes, each guarded by its own lock.
+
+ Operations on keys that land in different stripes never contend with each other. Each stripe is a
+ `BBPersistentDictionary`: writers derive a new version of it, copying O(log n) nodes, and swap it in, while
+ `objectForKey:`, `count`, enumeration and `copy` load the current version atomically and carry on without taking any
+ lock. A `snapshot` therefore costs O(number of stripes) regardless of the number of entries and never holds up writers.
+ Stripes are grabbed one at a time, so while each stripe is consistent, a snapshot isn't an atomic view of the whole
+ dictionary. Writers never wait for readers: a replaced version is set aside, and released by that or a later write to
+ the same stripe once no read that could still be using it is left.
+
+ None of this holds with `compactKeys`, where stripes are modified in place: reads take the stripe lock and snapshots
+ copy every stripe. Turning it on is the only time a writer waits for lock-free reads in progress.
+
+ Stripe locks are recursive and can be held by callers through `lockKey:` and `unlockKey:`, to make a sequence of
+ operations on a single key atomic.
+ */
+@interface BBConcurrentDictionary : NSMutableDictionary
+
+
+#pragma mark Creation
+
+- (instancetype)initWithStripeCount:(NSUInteger)stripeCount;
+
+
+#pragma mark Properties
+
+@property(assign, nonatomic, readonly) NSUInteger stripeCount;
+
+/**
+ Keep each stripe in a `BBCompactKeyTable` rather than a `BBPersistentDictionary`.
+
+ Uses a fraction of the memory per entry and looks keys up without allocating, but writers modify stripes in place, so
+ reads take the stripe lock and a `snapshot` has to copy every stripe, at O(n). Changing this converts every entry,
+ with all stripes locked.
+
+ Only string keys are supported in this mode. Defaults to `NO`.
+ */
+@property(assign, nonatomic) BOOL compactKeys;
+
+
+#pragma mark Interface
+
+/** Acquires the lock for the stripe the given key belongs to. Must be balanced by a call to `unlockKey:`. */
+- (void)lockKey:(id)key;
+- (void)unlockKey:(id)key;
+
+/** Same as `lockKey:`, but gives up instead of waiting if the lock is held by another thread. */
+- (BOOL)tryLockKey:(id)key;
+
+/** Atomically replaces all the entries in this dictionary with the ones in `dictionary`. */
+- (void)replaceContentsWithDictionary:(NSDictionary*)dictionary;
+
+/** Immutable view of the current contents, unaffected by later changes. Same as `copy`. */
+- (NSDictionary*)snapshot;
+
+@end
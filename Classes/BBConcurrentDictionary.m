@@ -0,0 +1,566 @@
+//
+// Copyright 2013 BiasedBit
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+//
+//  Created by Bruno de Carvalho (@biasedbit, http://biasedbit.com)
+//  Copyright (c) 2013 BiasedBit. All rights reserved.
+//
+
+#import "BBConcurrentDictionary.h"
+
+#import <pthread.h>
+#import <sched.h>
+#import <stdatomic.h>
+
+#import "BBCompactKeyTable.h"
+#import "BBPersistentDictionary.h"
+
+
+
+#pragma mark - Constants
+
+NSUInteger const kBBConcurrentDictionaryDefaultStripeCount = 32;
+
+// At most 32, so that the slots a retired stripe waits on fit in a 32-bit mask
+static const NSUInteger kBBConcurrentDictionaryReaderSlotCount = 32;
+
+
+
+#pragma mark - Types
+
+/** Number of threads reading stripes without a lock; one per cache line, so readers don't contend on it. */
+typedef struct {
+    _Atomic NSUInteger count;
+    uint8_t padding[64 - sizeof(NSUInteger)];
+} BBConcurrentDictionaryReaderSlot;
+
+/** A replaced stripe version, still retained, and the reader slots that must be seen empty before releasing it. */
+typedef struct {
+    void* stripe;
+    uint32_t pendingReaderSlots;
+} BBConcurrentDictionaryRetiredStripe;
+
+/** Versions replaced in one stripe and not yet released. Guarded by the stripe's lock. */
+typedef struct {
+    BBConcurrentDictionaryRetiredStripe* entries;
+    NSUInteger count;
+    NSUInteger capacity;
+} BBConcurrentDictionaryRetireList;
+
+
+
+#pragma mark - Utility functions
+
+static NSUInteger BBConcurrentDictionaryStripeForKey(id key, NSUInteger stripeCount)
+{
+    // Mix the hash a bit; NSString hashes for keys sharing a long prefix tend to only differ in the low bits
+    NSUInteger hash = [key hash];
+    hash ^= (hash >> 16);
+    hash *= 0x45d9f3b;
+    hash ^= (hash >> 16);
+
+    return hash % stripeCount;
+}
+
+static NSUInteger BBConcurrentDictionaryReaderSlotForCurrentThread(void)
+{
+    uint64_t hash = (uint64_t)(uintptr_t)pthread_self();
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+
+    return (NSUInteger)(hash % kBBConcurrentDictionaryReaderSlotCount);
+}
+
+
+
+#pragma mark -
+
+/** Immutable view over the stripes of a `BBConcurrentDictionary`, as they were when it was taken. */
+@interface BBConcurrentDictionarySnapshot : NSDictionary
+
+- (instancetype)initWithStripes:(NSArray*)stripes;
+
+@end
+
+@implementation BBConcurrentDictionarySnapshot
+{
+    NSArray* _stripes;
+    NSUInteger _count;
+}
+
+
+#pragma mark Creation
+
+- (instancetype)initWithStripes:(NSArray*)stripes
+{
+    self = [super init];
+    if (self != nil) {
+        _stripes = stripes;
+        for (NSDictionary* stripe in stripes) _count += [stripe count];
+    }
+
+    return self;
+}
+
+
+#pragma mark NSDictionary primitives
+
+- (NSUInteger)count
+{
+    return _count;
+}
+
+- (id)objectForKey:(id)key
+{
+    if (key == nil) return nil;
+
+    return [_stripes[BBConcurrentDictionaryStripeForKey(key, [_stripes count])] objectForKey:key];
+}
+
+- (NSEnumerator*)keyEnumerator
+{
+    return [[self allKeys] objectEnumerator];
+}
+
+
+#pragma mark NSDictionary overrides
+
+- (NSArray*)allKeys
+{
+    NSMutableArray* keys = [NSMutableArray arrayWithCapacity:_count];
+    for (NSDictionary* stripe in _stripes) [keys addObjectsFromArray:[stripe allKeys]];
+
+    return keys;
+}
+
+- (NSArray*)allValues
+{
+    NSMutableArray* values = [NSMutableArray arrayWithCapacity:_count];
+    for (NSDictionary* stripe in _stripes) [values addObjectsFromArray:[stripe allValues]];
+
+    return values;
+}
+
+- (void)enumerateKeysAndObjectsUsingBlock:(void (^)(id key, id object, BOOL* stop))block
+{
+    __block BOOL stop = NO;
+    for (NSDictionary* stripe in _stripes) {
+        [stripe enumerateKeysAndObjectsUsingBlock:^(id key, id object, BOOL* stopStripe) {
+            block(key, object, &stop);
+            *stopStripe = stop;
+        }];
+        if (stop) return;
+    }
+}
+
+- (id)copyWithZone:(NSZone*)zone
+{
+    return self;
+}
+
+@end
+
+
+
+#pragma mark -
+
+@implementation BBConcurrentDictionary
+{
+    pthread_mutex_t* _locks;
+    // Each stripe is a persistent dictionary; writers swap in a new version, readers and snapshots just grab one.
+    // With compactKeys, stripes are BBCompactKeyTable instances instead, modified in place and copied for snapshots.
+    // Roots hold a retained reference; readers load them without locking, from within a reader slot.
+    _Atomic(void*)* _stripes;
+    _Atomic BOOL _compactKeys;
+    BBConcurrentDictionaryReaderSlot _readers[kBBConcurrentDictionaryReaderSlotCount];
+    BBConcurrentDictionaryRetireList* _retireLists;
+}
+
+
+#pragma mark Creation
+
+- (instancetype)init
+{
+    return [self initWithStripeCount:kBBConcurrentDictionaryDefaultStripeCount];
+}
+
+- (instancetype)initWithCapacity:(NSUInteger)numItems
+{
+    return [self initWithStripeCount:kBBConcurrentDictionaryDefaultStripeCount];
+}
+
+- (instancetype)initWithObjects:(const id[])objects forKeys:(const id<NSCopying>[])keys count:(NSUInteger)count
+{
+    self = [self initWithStripeCount:kBBConcurrentDictionaryDefaultStripeCount];
+    if (self != nil) {
+        for (NSUInteger i = 0; i < count; i++) [self setObject:objects[i] forKey:keys[i]];
+    }
+
+    return self;
+}
+
+- (instancetype)initWithStripeCount:(NSUInteger)stripeCount
+{
+    self = [super init];
+    if (self != nil) {
+        _stripeCount = MAX(stripeCount, (NSUInteger)1);
+        _locks = calloc(_stripeCount, sizeof(pthread_mutex_t));
+        _stripes = calloc(_stripeCount, sizeof(_Atomic(void*)));
+        _retireLists = calloc(_stripeCount, sizeof(BBConcurrentDictionaryRetireList));
+        for (NSUInteger i = 0; i < kBBConcurrentDictionaryReaderSlotCount; i++) atomic_init(&_readers[i].count, 0);
+
+        pthread_mutexattr_t attributes;
+        pthread_mutexattr_init(&attributes);
+        pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+
+        for (NSUInteger i = 0; i < _stripeCount; i++) {
+            pthread_mutex_init(&_locks[i], &attributes);
+            atomic_init(&_stripes[i], (__bridge_retained void*)[self emptyStripe]);
+        }
+        pthread_mutexattr_destroy(&attributes);
+    }
+
+    return self;
+}
+
+- (void)dealloc
+{
+    for (NSUInteger i = 0; i < _stripeCount; i++) {
+        pthread_mutex_destroy(&_locks[i]);
+        CFBridgingRelease(atomic_load(&_stripes[i]));
+
+        // Nobody can be reading anymore
+        for (NSUInteger j = 0; j < _retireLists[i].count; j++) CFBridgingRelease(_retireLists[i].entries[j].stripe);
+        free(_retireLists[i].entries);
+    }
+    free(_locks);
+    free(_stripes);
+    free(_retireLists);
+}
+
+
+#pragma mark Interface
+
+- (void)lockKey:(id)key
+{
+    pthread_mutex_lock(&_locks[BBConcurrentDictionaryStripeForKey(key, _stripeCount)]);
+}
+
+- (void)unlockKey:(id)key
+{
+    pthread_mutex_unlock(&_locks[BBConcurrentDictionaryStripeForKey(key, _stripeCount)]);
+}
+
+- (BOOL)tryLockKey:(id)key
+{
+    return pthread_mutex_trylock(&_locks[BBConcurrentDictionaryStripeForKey(key, _stripeCount)]) == 0;
+}
+
+- (void)replaceContentsWithDictionary:(NSDictionary*)dictionary
+{
+    NSMutableArray* stripeKeys = [NSMutableArray arrayWithCapacity:_stripeCount];
+    NSMutableArray* stripeObjects = [NSMutableArray arrayWithCapacity:_stripeCount];
+    for (NSUInteger i = 0; i < _stripeCount; i++) {
+        [stripeKeys addObject:[NSMutableArray array]];
+        [stripeObjects addObject:[NSMutableArray array]];
+    }
+
+    [dictionary enumerateKeysAndObjectsUsingBlock:^(id key, id object, BOOL* stop) {
+        NSUInteger stripe = BBConcurrentDictionaryStripeForKey(key, _stripeCount);
+        [stripeKeys[stripe] addObject:key];
+        [stripeObjects[stripe] addObject:object];
+    }];
+
+    // Build the new stripes before taking any lock; swapping them in is then just a matter of assigning pointers
+    NSMutableArray* stripes = [NSMutableArray arrayWithCapacity:_stripeCount];
+    for (NSUInteger i = 0; i < _stripeCount; i++) {
+        Class stripeClass = _compactKeys ? [BBCompactKeyTable class] : [BBPersistentDictionary class];
+        [stripes addObject:[[stripeClass alloc] initWithObjects:stripeObjects[i] forKeys:stripeKeys[i]]];
+    }
+
+    // Take every lock, in order, so nobody sees a mix of old and new contents
+    for (NSUInteger i = 0; i < _stripeCount; i++) pthread_mutex_lock(&_locks[i]);
+    for (NSUInteger i = 0; i < _stripeCount; i++) [self replaceStripeAtIndex:i withStripe:stripes[i]];
+    for (NSUInteger i = _stripeCount; i > 0; i--) pthread_mutex_unlock(&_locks[i - 1]);
+}
+
+- (NSDictionary*)snapshot
+{
+    NSMutableArray* stripes = [NSMutableArray arrayWithCapacity:_stripeCount];
+    for (NSUInteger i = 0; i < _stripeCount; i++) [stripes addObject:[self stripeAtIndex:i]];
+
+    return [[BBConcurrentDictionarySnapshot alloc] initWithStripes:stripes];
+}
+
+
+#pragma mark Properties
+
+- (BOOL)compactKeys
+{
+    return atomic_load(&_compactKeys);
+}
+
+- (void)setCompactKeys:(BOOL)compactKeys
+{
+    for (NSUInteger i = 0; i < _stripeCount; i++) pthread_mutex_lock(&_locks[i]);
+    if (_compactKeys != compactKeys) {
+        // Lock-free readers must be gone from the persistent stripes before they start changing in place, and must not
+        // come back until they're persistent again; until then, readers fall back to the locks we're holding.
+        if (compactKeys) {
+            atomic_store(&_compactKeys, YES);
+            [self waitForReaders];
+            for (NSUInteger i = 0; i < _stripeCount; i++) [self reclaimRetiredStripesAtIndex:i emptySlots:UINT32_MAX];
+        }
+
+        Class stripeClass = compactKeys ? [BBCompactKeyTable class] : [BBPersistentDictionary class];
+        for (NSUInteger i = 0; i < _stripeCount; i++) {
+            [self replaceStripeAtIndex:i withStripe:[[stripeClass alloc] initWithDictionary:[self stripeRoot:i]]];
+        }
+
+        if (!compactKeys) atomic_store(&_compactKeys, NO);
+    }
+    for (NSUInteger i = _stripeCount; i > 0; i--) pthread_mutex_unlock(&_locks[i - 1]);
+}
+
+
+#pragma mark NSDictionary primitives
+
+- (NSUInteger)count
+{
+    NSUInteger count = 0;
+    _Atomic NSUInteger* readers = [self enterReaderSlot];
+    if (!_compactKeys) {
+        for (NSUInteger i = 0; i < _stripeCount; i++) count += [[self stripeRoot:i] count];
+        atomic_fetch_sub(readers, 1);
+
+        return count;
+    }
+    atomic_fetch_sub(readers, 1);
+
+    for (NSUInteger i = 0; i < _stripeCount; i++) {
+        pthread_mutex_lock(&_locks[i]);
+        count += [[self stripeRoot:i] count];
+        pthread_mutex_unlock(&_locks[i]);
+    }
+
+    return count;
+}
+
+- (id)objectForKey:(id)key
+{
+    if (key == nil) return nil;
+
+    NSUInteger stripe = BBConcurrentDictionaryStripeForKey(key, _stripeCount);
+    _Atomic NSUInteger* readers = [self enterReaderSlot];
+    if (!_compactKeys) {
+        // Retained by ARC before leaving the slot, so it outlives the stripe version it came from
+        id object = [[self stripeRoot:stripe] objectForKey:key];
+        atomic_fetch_sub(readers, 1);
+
+        return object;
+    }
+    atomic_fetch_sub(readers, 1);
+
+    pthread_mutex_lock(&_locks[stripe]);
+    id object = [[self stripeRoot:stripe] objectForKey:key];
+    pthread_mutex_unlock(&_locks[stripe]);
+
+    return object;
+}
+
+- (NSEnumerator*)keyEnumerator
+{
+    return [[self allKeys] objectEnumerator];
+}
+
+
+#pragma mark NSMutableDictionary primitives
+
+- (void)setObject:(id)object forKey:(id<NSCopying>)key
+{
+    NSUInteger stripe = BBConcurrentDictionaryStripeForKey(key, _stripeCount);
+    pthread_mutex_lock(&_locks[stripe]);
+    if (_compactKeys) {
+        [(BBCompactKeyTable*)[self stripeRoot:stripe] setObject:object forKey:key];
+    } else {
+        BBPersistentDictionary* current = (BBPersistentDictionary*)[self stripeRoot:stripe];
+        [self replaceStripeAtIndex:stripe withStripe:[current dictionaryBySettingObject:object forKey:key]];
+    }
+    pthread_mutex_unlock(&_locks[stripe]);
+}
+
+- (void)removeObjectForKey:(id)key
+{
+    if (key == nil) return;
+
+    NSUInteger stripe = BBConcurrentDictionaryStripeForKey(key, _stripeCount);
+    pthread_mutex_lock(&_locks[stripe]);
+    if (_compactKeys) {
+        [(BBCompactKeyTable*)[self stripeRoot:stripe] removeObjectForKey:key];
+    } else {
+        BBPersistentDictionary* current = (BBPersistentDictionary*)[self stripeRoot:stripe];
+        BBPersistentDictionary* updated = [current dictionaryByRemovingObjectForKey:key];
+        if (updated != current) [self replaceStripeAtIndex:stripe withStripe:updated];
+    }
+    pthread_mutex_unlock(&_locks[stripe]);
+}
+
+
+#pragma mark NSDictionary overrides
+
+- (NSArray*)allKeys
+{
+    return [[self snapshot] allKeys];
+}
+
+- (NSArray*)allValues
+{
+    return [[self snapshot] allValues];
+}
+
+- (void)enumerateKeysAndObjectsUsingBlock:(void (^)(id key, id object, BOOL* stop))block
+{
+    // The snapshot is detached from the stripes, so the block runs with no lock held and may freely modify this dictionary
+    [[self snapshot] enumerateKeysAndObjectsUsingBlock:block];
+}
+
+- (void)enumerateKeysAndObjectsWithOptions:(NSEnumerationOptions)options
+                                usingBlock:(void (^)(id key, id object, BOOL* stop))block
+{
+    [self enumerateKeysAndObjectsUsingBlock:block];
+}
+
+- (id)copyWithZone:(NSZone*)zone
+{
+    return [self snapshot];
+}
+
+- (id)mutableCopyWithZone:(NSZone*)zone
+{
+    // The copying happens off the snapshot, without holding up writers
+    return [[NSMutableDictionary alloc] initWithDictionary:[self snapshot]];
+}
+
+
+#pragma mark NSMutableDictionary overrides
+
+- (void)removeAllObjects
+{
+    for (NSUInteger i = 0; i < _stripeCount; i++) {
+        pthread_mutex_lock(&_locks[i]);
+        [self replaceStripeAtIndex:i withStripe:[self emptyStripe]];
+        pthread_mutex_unlock(&_locks[i]);
+    }
+}
+
+
+#pragma mark Private helpers
+
+- (NSDictionary*)emptyStripe
+{
+    return _compactKeys ? [[BBCompactKeyTable alloc] init] : [[BBPersistentDictionary alloc] init];
+}
+
+- (NSDictionary*)stripeRoot:(NSUInteger)index
+{
+    // Only safe to use while holding the stripe's lock or a reader slot, and only for as long as that lasts
+    return (__bridge NSDictionary*)atomic_load(&_stripes[index]);
+}
+
+- (void)replaceStripeAtIndex:(NSUInteger)index withStripe:(NSDictionary*)stripe
+{
+    // Must be called with the stripe's lock held
+    void* previous = atomic_exchange(&_stripes[index], (__bridge_retained void*)stripe);
+
+    // Compact stripes are only ever read with the lock held, so nobody else can be holding the previous one
+    if (_compactKeys) {
+        CFBridgingRelease(previous);
+        return;
+    }
+
+    // Lock-free readers may still be in the previous version. Rather than waiting for them, set it aside until every
+    // slot that had readers in it at the time of the swap has been seen empty, on this or a later write to the stripe.
+    uint32_t occupiedSlots = 0;
+    for (NSUInteger i = 0; i < kBBConcurrentDictionaryReaderSlotCount; i++) {
+        if (atomic_load(&_readers[i].count) != 0) occupiedSlots |= (1U << i);
+    }
+
+    BBConcurrentDictionaryRetireList* list = &_retireLists[index];
+    if (list->count == list->capacity) {
+        list->capacity = MAX(list->capacity * 2, (NSUInteger)4);
+        list->entries = realloc(list->entries, list->capacity * sizeof(BBConcurrentDictionaryRetiredStripe));
+    }
+    list->entries[list->count].stripe = previous;
+    list->entries[list->count].pendingReaderSlots = occupiedSlots;
+    list->count++;
+
+    [self reclaimRetiredStripesAtIndex:index emptySlots:~occupiedSlots];
+}
+
+- (void)reclaimRetiredStripesAtIndex:(NSUInteger)index emptySlots:(uint32_t)emptySlots
+{
+    // Must be called with the stripe's lock held. Readers that entered a slot after it was seen empty loaded a newer
+    // version, so each version only needs every slot it's waiting on to be seen empty once.
+    BBConcurrentDictionaryRetireList* list = &_retireLists[index];
+    NSUInteger kept = 0;
+    for (NSUInteger i = 0; i < list->count; i++) {
+        BBConcurrentDictionaryRetiredStripe entry = list->entries[i];
+        entry.pendingReaderSlots &= ~emptySlots;
+        if (entry.pendingReaderSlots == 0) CFBridgingRelease(entry.stripe);
+        else list->entries[kept++] = entry;
+    }
+    list->count = kept;
+}
+
+- (_Atomic NSUInteger*)enterReaderSlot
+{
+    _Atomic NSUInteger* readers = &_readers[BBConcurrentDictionaryReaderSlotForCurrentThread()].count;
+    atomic_fetch_add(readers, 1);
+
+    return readers;
+}
+
+- (void)waitForReaders
+{
+    // Only used when switching to compact stripes, with every lock held; writes never wait for readers
+    // Readers that may have loaded a root we just replaced entered their slot before the swap; once a slot has been
+    // seen empty, whoever enters it from then on loads the new root.
+    for (NSUInteger i = 0; i < kBBConcurrentDictionaryReaderSlotCount; i++) {
+        while (atomic_load(&_readers[i].count) != 0) sched_yield();
+    }
+}
+
+- (NSDictionary*)stripeAtIndex:(NSUInteger)index
+{
+    // Persistent stripes never change and can be handed out as they are; compact ones are copied, arrays and all
+    _Atomic NSUInteger* readers = [self enterReaderSlot];
+    if (!_compactKeys) {
+        NSDictionary* stripe = [self stripeRoot:index];
+        atomic_fetch_sub(readers, 1);
+
+        return stripe;
+    }
+    atomic_fetch_sub(readers, 1);
+
+    pthread_mutex_lock(&_locks[index]);
+    NSDictionary* stripe = [[self stripeRoot:index] copy];
+    pthread_mutex_unlock(&_locks[index]);
+
+    return stripe;
+}
+
+@end
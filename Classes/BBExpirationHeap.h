@@ -0,0 +1,60 @@
+//
+// Copyright 2013 BiasedBit
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+//
+//  Created by Bruno de Carvalho (@biasedbit, http://biasedbit.com)
+//  Copyright (c) 2013 BiasedBit. All rights reserved.
+//
+
+#pragma mark -
+
+/**
+ Binary min-heap of keys ordered by expiration timestamp.
+
+ The heap doesn't support removing or updating arbitrary keys; callers are expected to push a key again whenever its
+ expiration changes and to discard entries that no longer match when popping them (lazy revalidation). Adding and
+ popping are O(log n).
+
+ Not thread-safe.
+ */
+@interface BBExpirationHeap : NSObject
+
+
+#pragma mark Properties
+
+/** Number of entries in the heap, including ones that callers may consider stale. */
+@property(assign, nonatomic, readonly) NSUInteger count;
+
+
+#pragma mark Interface
+
+- (void)addKey:(NSString*)key expirationTimestamp:(NSTimeInterval)expirationTimestamp;
+
+/**
+ Returns the key with the earliest expiration timestamp, without removing it.
+
+ @param expirationTimestamp Set to the expiration timestamp the key was added with, if not `NULL`.
+
+ @return The key, or `nil` if the heap is empty.
+ */
+- (NSString*)peekKeyWithExpirationTimestamp:(NSTimeInterval*)expirationTimestamp;
+
+/** Same as `peekKeyWithExpirationTimestamp:`, but removes the key from the heap. */
+- (NSString*)popKeyWithExpirationTimestamp:(NSTimeInterval*)expirationTimestamp;
+
+- (void)removeAllKeys;
+
+@end
@@ -0,0 +1,146 @@
+//
+// Copyright 2013 BiasedBit
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+//
+//  Created by Bruno de Carvalho (@biasedbit, http://biasedbit.com)
+//  Copyright (c) 2013 BiasedBit. All rights reserved.
+//
+
+#import "BBExpirationHeap.h"
+
+
+
+#pragma mark -
+
+@implementation BBExpirationHeap
+{
+    // Keys and timestamps are kept in parallel, so that timestamps can live in a plain C array
+    NSMutableArray* _keys;
+    NSTimeInterval* _timestamps;
+    NSUInteger _capacity;
+}
+
+
+#pragma mark Creation
+
+- (instancetype)init
+{
+    self = [super init];
+    if (self != nil) {
+        _keys = [NSMutableArray array];
+        _capacity = 64;
+        _timestamps = malloc(_capacity * sizeof(NSTimeInterval));
+    }
+
+    return self;
+}
+
+- (void)dealloc
+{
+    free(_timestamps);
+}
+
+
+#pragma mark Properties
+
+- (NSUInteger)count
+{
+    return [_keys count];
+}
+
+
+#pragma mark Interface
+
+- (void)addKey:(NSString*)key expirationTimestamp:(NSTimeInterval)expirationTimestamp
+{
+    NSUInteger index = [_keys count];
+    if (index == _capacity) {
+        _capacity *= 2;
+        _timestamps = realloc(_timestamps, _capacity * sizeof(NSTimeInterval));
+    }
+
+    [_keys addObject:key];
+    _timestamps[index] = expirationTimestamp;
+    [self siftUpFromIndex:index];
+}
+
+- (NSString*)peekKeyWithExpirationTimestamp:(NSTimeInterval*)expirationTimestamp
+{
+    if ([_keys count] == 0) return nil;
+
+    if (expirationTimestamp != NULL) *expirationTimestamp = _timestamps[0];
+    return _keys[0];
+}
+
+- (NSString*)popKeyWithExpirationTimestamp:(NSTimeInterval*)expirationTimestamp
+{
+    NSString* key = [self peekKeyWithExpirationTimestamp:expirationTimestamp];
+    if (key == nil) return nil;
+
+    NSUInteger last = [_keys count] - 1;
+    [self swapIndex:0 withIndex:last];
+    [_keys removeLastObject];
+    if (last > 0) [self siftDownFromIndex:0];
+
+    return key;
+}
+
+- (void)removeAllKeys
+{
+    [_keys removeAllObjects];
+}
+
+
+#pragma mark Private helpers
+
+- (void)siftUpFromIndex:(NSUInteger)index
+{
+    while (index > 0) {
+        NSUInteger parent = (index - 1) / 2;
+        if (_timestamps[parent] <= _timestamps[index]) return;
+
+        [self swapIndex:index withIndex:parent];
+        index = parent;
+    }
+}
+
+- (void)siftDownFromIndex:(NSUInteger)index
+{
+    NSUInteger count = [_keys count];
+    for (;;) {
+        NSUInteger smallest = index;
+        NSUInteger left = (2 * index) + 1;
+        NSUInteger right = left + 1;
+        if ((left < count) && (_timestamps[left] < _timestamps[smallest])) smallest = left;
+        if ((right < count) && (_timestamps[right] < _timestamps[smallest])) smallest = right;
+        if (smallest == index) return;
+
+        [self swapIndex:index withIndex:smallest];
+        index = smallest;
+    }
+}
+
+- (void)swapIndex:(NSUInteger)a withIndex:(NSUInteger)b
+{
+    if (a == b) return;
+
+    [_keys exchangeObjectAtIndex:a withObjectAtIndex:b];
+    NSTimeInterval timestamp = _timestamps[a];
+    _timestamps[a] = _timestamps[b];
+    _timestamps[b] = timestamp;
+}
+
+@end
@@ -0,0 +1,46 @@
+//
+// Copyright 2013 BiasedBit
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+//
+//  Created by Bruno de Carvalho (@biasedbit, http://biasedbit.com)
+//  Copyright (c) 2013 BiasedBit. All rights reserved.
+//
+
+#pragma mark -
+
+/**
+ Immutable dictionary that can be "modified" cheaply by deriving new dictionaries from it, which share most of their
+ structure with the original.
+
+ Entries are stored in a hash array mapped trie: a tree of nodes with up to 32 children each, indexed by successive 5
+ bit slices of the key's hash. Deriving a dictionary with one more, one less or one different entry only copies the
+ nodes on the path to that entry, O(log32 n), and leaves the original untouched. Taking a snapshot is thus free: keep a
+ reference to the dictionary.
+
+ Being immutable, instances are safe to read from any number of threads.
+ */
+@interface BBPersistentDictionary : NSDictionary
+
+
+#pragma mark Interface
+
+/** Returns a dictionary with the same entries as this one, plus (or replacing) the given one. */
+- (instancetype)dictionaryBySettingObject:(id)object forKey:(id<NSCopying>)key;
+
+/** Returns a dictionary with the same entries as this one, minus the given one. */
+- (instancetype)dictionaryByRemovingObjectForKey:(id)key;
+
+@end
@@ -0,0 +1,456 @@
+//
+// Copyright 2013 BiasedBit
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+//
+//  Created by Bruno de Carvalho (@biasedbit, http://biasedbit.com)
+//  Copyright (c) 2013 BiasedBit. All rights reserved.
+//
+
+#import "BBPersistentDictionary.h"
+
+
+
+#pragma mark - Constants
+
+static NSUInteger const kBBPersistentDictionaryBitsPerLevel = 5;
+static NSUInteger const kBBPersistentDictionaryLevelMask = 31;
+// Once every bit of the hash has been used, keys that still collide share a node that's searched linearly
+static NSUInteger const kBBPersistentDictionaryHashBits = sizeof(NSUInteger) * 8;
+
+
+
+#pragma mark - Utility functions
+
+static NSUInteger BBPersistentDictionaryHash(id key)
+{
+    // Spread the bits around; NSString hashes for keys sharing a long prefix tend to only differ in the low bits
+    NSUInteger hash = [key hash];
+    hash ^= (hash >> 16);
+    hash *= 0x45d9f3b;
+    hash ^= (hash >> 16);
+
+    return hash;
+}
+
+
+
+#pragma mark -
+
+@interface BBPersistentDictionaryEntry : NSObject
+{
+@public
+    id _key;
+    id _object;
+    NSUInteger _hash;
+}
+
+@end
+
+@implementation BBPersistentDictionaryEntry
+@end
+
+
+
+#pragma mark -
+
+/**
+ A node either maps hash slices to entries and child nodes through a bitmap, with one slot per bit set, or, past the
+ last slice of the hash, holds entries whose hashes collide entirely.
+
+ Nodes are never modified once reachable from a dictionary. The one exception is bulk construction, where every node
+ created is stamped with a fresh edit token and modified in place while the dictionary is being built. Nodes retain
+ their token, so it can't be reused by a later build; once the build is over nobody else holds it and it's never
+ passed in again.
+ */
+@interface BBPersistentDictionaryNode : NSObject
+{
+@public
+    uint32_t _bitmap;
+    BOOL _collision;
+    NSMutableArray* _slots;
+    id _edit;
+}
+
+@end
+
+@implementation BBPersistentDictionaryNode
+
+
+#pragma mark Creation
+
+- (instancetype)initWithBitmap:(uint32_t)bitmap collision:(BOOL)collision slots:(NSMutableArray*)slots edit:(id)edit
+{
+    self = [super init];
+    if (self != nil) {
+        _bitmap = bitmap;
+        _collision = collision;
+        _slots = slots;
+        _edit = edit;
+    }
+
+    return self;
+}
+
++ (instancetype)nodeWithEntry:(BBPersistentDictionaryEntry*)entry otherEntry:(BBPersistentDictionaryEntry*)otherEntry
+                        shift:(NSUInteger)shift edit:(id)edit
+{
+    if (shift >= kBBPersistentDictionaryHashBits) {
+        return [[self alloc] initWithBitmap:0 collision:YES slots:[NSMutableArray arrayWithObjects:entry, otherEntry, nil]
+                                       edit:edit];
+    }
+
+    NSUInteger index = (entry->_hash >> shift) & kBBPersistentDictionaryLevelMask;
+    NSUInteger otherIndex = (otherEntry->_hash >> shift) & kBBPersistentDictionaryLevelMask;
+    if (index == otherIndex) {
+        id child = [self nodeWithEntry:entry otherEntry:otherEntry shift:(shift + kBBPersistentDictionaryBitsPerLevel)
+                                  edit:edit];
+        return [[self alloc] initWithBitmap:(1U << index) collision:NO slots:[NSMutableArray arrayWithObject:child]
+                                       edit:edit];
+    }
+
+    NSMutableArray* slots = (index < otherIndex) ?
+                            [NSMutableArray arrayWithObjects:entry, otherEntry, nil] :
+                            [NSMutableArray arrayWithObjects:otherEntry, entry, nil];
+    return [[self alloc] initWithBitmap:((1U << index) | (1U << otherIndex)) collision:NO slots:slots edit:edit];
+}
+
+
+#pragma mark Interface
+
+- (id)objectForKey:(id)key hash:(NSUInteger)hash
+{
+    BBPersistentDictionaryNode* node = self;
+    NSUInteger shift = 0;
+    while (node != nil) {
+        if (node->_collision) {
+            for (BBPersistentDictionaryEntry* entry in node->_slots) {
+                if ([entry->_key isEqual:key]) return entry->_object;
+            }
+            return nil;
+        }
+
+        uint32_t bit = 1U << ((hash >> shift) & kBBPersistentDictionaryLevelMask);
+        if ((node->_bitmap & bit) == 0) return nil;
+
+        id slot = node->_slots[__builtin_popcount(node->_bitmap & (bit - 1))];
+        if ([slot isKindOfClass:[BBPersistentDictionaryEntry class]]) {
+            BBPersistentDictionaryEntry* entry = slot;
+            return ((entry->_hash == hash) && [entry->_key isEqual:key]) ? entry->_object : nil;
+        }
+
+        node = slot;
+        shift += kBBPersistentDictionaryBitsPerLevel;
+    }
+
+    return nil;
+}
+
+- (BBPersistentDictionaryNode*)nodeBySettingEntry:(BBPersistentDictionaryEntry*)entry shift:(NSUInteger)shift
+                                             edit:(id)edit added:(BOOL*)added
+{
+    if (_collision) {
+        NSUInteger count = [_slots count];
+        for (NSUInteger i = 0; i < count; i++) {
+            BBPersistentDictionaryEntry* existing = _slots[i];
+            if (![existing->_key isEqual:entry->_key]) continue;
+            if (existing->_object == entry->_object) return self;
+
+            BBPersistentDictionaryNode* node = [self editableNodeForEdit:edit];
+            node->_slots[i] = entry;
+            return node;
+        }
+
+        BBPersistentDictionaryNode* node = [self editableNodeForEdit:edit];
+        [node->_slots addObject:entry];
+        *added = YES;
+        return node;
+    }
+
+    uint32_t bit = 1U << ((entry->_hash >> shift) & kBBPersistentDictionaryLevelMask);
+    NSUInteger position = __builtin_popcount(_bitmap & (bit - 1));
+    if ((_bitmap & bit) == 0) {
+        BBPersistentDictionaryNode* node = [self editableNodeForEdit:edit];
+        node->_bitmap |= bit;
+        [node->_slots insertObject:entry atIndex:position];
+        *added = YES;
+        return node;
+    }
+
+    id slot = _slots[position];
+    id newSlot = nil;
+    if ([slot isKindOfClass:[BBPersistentDictionaryNode class]]) {
+        newSlot = [slot nodeBySettingEntry:entry shift:(shift + kBBPersistentDictionaryBitsPerLevel) edit:edit
+                                     added:added];
+        if (newSlot == slot) return self;
+    } else {
+        BBPersistentDictionaryEntry* existing = slot;
+        if ((existing->_hash == entry->_hash) && [existing->_key isEqual:entry->_key]) {
+            if (existing->_object == entry->_object) return self;
+            newSlot = entry;
+        } else {
+            // Two keys sharing a slice of their hashes; push both down a level
+            newSlot = [BBPersistentDictionaryNode nodeWithEntry:existing otherEntry:entry
+                                                          shift:(shift + kBBPersistentDictionaryBitsPerLevel)
+                                                           edit:edit];
+            *added = YES;
+        }
+    }
+
+    BBPersistentDictionaryNode* node = [self editableNodeForEdit:edit];
+    node->_slots[position] = newSlot;
+    return node;
+}
+
+- (BBPersistentDictionaryNode*)nodeByRemovingKey:(id)key hash:(NSUInteger)hash shift:(NSUInteger)shift
+                                         removed:(BOOL*)removed
+{
+    if (_collision) {
+        NSUInteger count = [_slots count];
+        for (NSUInteger i = 0; i < count; i++) {
+            BBPersistentDictionaryEntry* existing = _slots[i];
+            if (![existing->_key isEqual:key]) continue;
+
+            *removed = YES;
+            if (count == 1) return nil;
+
+            BBPersistentDictionaryNode* node = [self editableNodeForEdit:nil];
+            [node->_slots removeObjectAtIndex:i];
+            return node;
+        }
+
+        return self;
+    }
+
+    uint32_t bit = 1U << ((hash >> shift) & kBBPersistentDictionaryLevelMask);
+    if ((_bitmap & bit) == 0) return self;
+
+    NSUInteger position = __builtin_popcount(_bitmap & (bit - 1));
+    id slot = _slots[position];
+    if ([slot isKindOfClass:[BBPersistentDictionaryNode class]]) {
+        BBPersistentDictionaryNode* child = [slot nodeByRemovingKey:key hash:hash
+                                                              shift:(shift + kBBPersistentDictionaryBitsPerLevel)
+                                                            removed:removed];
+        if (child == slot) return self;
+
+        if (child != nil) {
+            // A child left with a single entry is pulled up, so the trie never gets deeper than it needs to be
+            BBPersistentDictionaryEntry* singleEntry = [child singleEntry];
+            BBPersistentDictionaryNode* node = [self editableNodeForEdit:nil];
+            node->_slots[position] = (singleEntry != nil) ? singleEntry : child;
+            return node;
+        }
+    } else {
+        BBPersistentDictionaryEntry* existing = slot;
+        if ((existing->_hash != hash) || ![existing->_key isEqual:key]) return self;
+
+        *removed = YES;
+    }
+
+    if ([_slots count] == 1) return nil;
+
+    BBPersistentDictionaryNode* node = [self editableNodeForEdit:nil];
+    node->_bitmap &= ~bit;
+    [node->_slots removeObjectAtIndex:position];
+    return node;
+}
+
+- (BBPersistentDictionaryEntry*)singleEntry
+{
+    if ([_slots count] != 1) return nil;
+
+    id slot = _slots[0];
+    return [slot isKindOfClass:[BBPersistentDictionaryEntry class]] ? slot : nil;
+}
+
+- (void)enumerateEntriesUsingBlock:(void (^)(BBPersistentDictionaryEntry* entry, BOOL* stop))block stop:(BOOL*)stop
+{
+    for (id slot in _slots) {
+        if ([slot isKindOfClass:[BBPersistentDictionaryEntry class]]) block(slot, stop);
+        else [slot enumerateEntriesUsingBlock:block stop:stop];
+
+        if (*stop) return;
+    }
+}
+
+
+#pragma mark Private helpers
+
+- (BBPersistentDictionaryNode*)editableNodeForEdit:(id)edit
+{
+    if ((edit != nil) && (_edit == edit)) return self;
+
+    return [[BBPersistentDictionaryNode alloc] initWithBitmap:_bitmap collision:_collision
+                                                        slots:[_slots mutableCopy] edit:edit];
+}
+
+@end
+
+
+
+#pragma mark -
+
+@implementation BBPersistentDictionary
+{
+    BBPersistentDictionaryNode* _root;
+    NSUInteger _count;
+}
+
+
+#pragma mark Creation
+
+- (instancetype)init
+{
+    return [self initWithRoot:nil count:0];
+}
+
+- (instancetype)initWithObjects:(const id[])objects forKeys:(const id<NSCopying>[])keys count:(NSUInteger)count
+{
+    // Build it in place; nobody else can see these nodes until we're done, so there's no point in copying them
+    id edit = [[NSObject alloc] init];
+    BBPersistentDictionaryNode* root = [self emptyRootWithEdit:edit];
+    NSUInteger entryCount = 0;
+    for (NSUInteger i = 0; i < count; i++) {
+        if ((objects[i] == nil) || (keys[i] == nil)) continue;
+
+        BOOL added = NO;
+        root = [root nodeBySettingEntry:[self entryWithObject:objects[i] forKey:keys[i]] shift:0 edit:edit
+                                  added:&added];
+        if (added) entryCount++;
+    }
+
+    return [self initWithRoot:root count:entryCount];
+}
+
+- (instancetype)initWithRoot:(BBPersistentDictionaryNode*)root count:(NSUInteger)count
+{
+    self = [super init];
+    if (self != nil) {
+        _root = (root != nil) ? root : [self emptyRootWithEdit:nil];
+        _count = count;
+    }
+
+    return self;
+}
+
+
+#pragma mark Interface
+
+- (instancetype)dictionaryBySettingObject:(id)object forKey:(id<NSCopying>)key
+{
+    if ((object == nil) || (key == nil)) return self;
+
+    BOOL added = NO;
+    BBPersistentDictionaryNode* root = [_root nodeBySettingEntry:[self entryWithObject:object forKey:key] shift:0
+                                                            edit:nil added:&added];
+    if (root == _root) return self;
+
+    return [[[self class] alloc] initWithRoot:root count:(added ? (_count + 1) : _count)];
+}
+
+- (instancetype)dictionaryByRemovingObjectForKey:(id)key
+{
+    if (key == nil) return self;
+
+    BOOL removed = NO;
+    BBPersistentDictionaryNode* root = [_root nodeByRemovingKey:key hash:BBPersistentDictionaryHash(key) shift:0
+                                                        removed:&removed];
+    if (!removed) return self;
+
+    return [[[self class] alloc] initWithRoot:root count:(_count - 1)];
+}
+
+
+#pragma mark NSDictionary primitives
+
+- (NSUInteger)count
+{
+    return _count;
+}
+
+- (id)objectForKey:(id)key
+{
+    if (key == nil) return nil;
+
+    return [_root objectForKey:key hash:BBPersistentDictionaryHash(key)];
+}
+
+- (NSEnumerator*)keyEnumerator
+{
+    return [[self allKeys] objectEnumerator];
+}
+
+
+#pragma mark NSDictionary overrides
+
+- (NSArray*)allKeys
+{
+    NSMutableArray* keys = [NSMutableArray arrayWithCapacity:_count];
+    [self enumerateKeysAndObjectsUsingBlock:^(id key, id object, BOOL* stop) {
+        [keys addObject:key];
+    }];
+
+    return keys;
+}
+
+- (NSArray*)allValues
+{
+    NSMutableArray* values = [NSMutableArray arrayWithCapacity:_count];
+    [self enumerateKeysAndObjectsUsingBlock:^(id key, id object, BOOL* stop) {
+        [values addObject:object];
+    }];
+
+    return values;
+}
+
+- (void)enumerateKeysAndObjectsUsingBlock:(void (^)(id key, id object, BOOL* stop))block
+{
+    BOOL stop = NO;
+    [_root enumerateEntriesUsingBlock:^(BBPersistentDictionaryEntry* entry, BOOL* stopEntries) {
+        block(entry->_key, entry->_object, stopEntries);
+    } stop:&stop];
+}
+
+- (void)enumerateKeysAndObjectsWithOptions:(NSEnumerationOptions)options
+                                usingBlock:(void (^)(id key, id object, BOOL* stop))block
+{
+    [self enumerateKeysAndObjectsUsingBlock:block];
+}
+
+- (id)copyWithZone:(NSZone*)zone
+{
+    // Immutable, so a copy may as well be the same instance
+    return self;
+}
+
+
+#pragma mark Private helpers
+
+- (BBPersistentDictionaryNode*)emptyRootWithEdit:(id)edit
+{
+    return [[BBPersistentDictionaryNode alloc] initWithBitmap:0 collision:NO slots:[NSMutableArray array] edit:edit];
+}
+
+- (BBPersistentDictionaryEntry*)entryWithObject:(id)object forKey:(id<NSCopying>)key
+{
+    BBPersistentDictionaryEntry* entry = [[BBPersistentDictionaryEntry alloc] init];
+    entry->_key = [(id)key copyWithZone:nil];
+    entry->_object = object;
+    entry->_hash = BBPersistentDictionaryHash(entry->_key);
+
+    return entry;
+}
+
+@end
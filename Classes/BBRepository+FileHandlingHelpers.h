@@ -21,10 +21,34 @@
 
 #import "BBRepository.h"
 
+#import "BBRepositoryBlobStore.h"
+
 
 
 #pragma mark -
 
+/**
+ Helpers for subclasses that keep data in companion files rather than in the items themselves.
+
+ ## Blobs
+
+ Rather than managing companion files by hand, subclasses can hand large fields to the repository's blob store with
+ `storeBlob:error:`, keep the returned identifier in the item and override `blobIdentifiersForItem:` to report it.
+
+ The repository then retains the blobs of every item it adds and releases those of every item it replaces or removes;
+ blobs no item references anymore are deleted in the background. Blobs are stored under `<repositoryName>-Blobs`, next
+ to the index file, and go away with the rest of the repository on `destroy`.
+
+    - (NSArray*)blobIdentifiersForItem:(Photo*)photo
+    {
+        return (photo.imageBlob != nil) ? @[photo.imageBlob] : nil;
+    }
+
+    photo.imageBlob = [repository storeBlob:UIImagePNGRepresentation(image) error:&error];
+    [repository addItem:photo];
+
+    UIImage* image = [UIImage imageWithData:[repository blobWithIdentifier:photo.imageBlob]];
+ */
 @interface BBRepository (FileHandlingHelpers)
 
 
@@ -33,6 +57,53 @@
 - (NSString*)relativePathForFile:(NSString*)file;
 - (NSString*)fullPathForFile:(NSString*)file;
 - (NSString*)convertRelativeToFullPath:(NSString*)relativePath;
+
+/**
+ Deletes the file (or directory) at the given path in the background.
+
+ Deletions from every repository go through a single serial `BBRepositoryDeletionQueue`, which coalesces them into
+ batches, so calling this for thousands of files in a row is cheap.
+ */
 - (void)deleteFileInBackground:(NSString*)fullPathToFile;
+- (void)deleteFilesInBackground:(NSArray*)fullPathsToFiles;
+
+/** Blocks until every deletion requested so far has been carried out. Useful on shutdown. */
+- (void)waitForBackgroundDeletions;
+
+
+#pragma mark Blobs
+
+/** The repository's blob store, created on first use. */
+- (BBRepositoryBlobStore*)blobStore;
+
+/**
+ Writes the data to the blob store, or finds the blob that already holds the same data.
+
+ The blob is safe from collection until an item referencing it is added, or for the blob store's `pinDuration` if none
+ ever is; add it right after storing the blob.
+
+ @return An identifier to keep in the item that references the blob, or `nil` if writing failed.
+ */
+- (NSString*)storeBlob:(NSData*)data error:(NSError**)error;
+
+/** Memory maps the blob with the given identifier, or returns `nil` if there's no such blob. */
+- (NSData*)blobWithIdentifier:(NSString*)identifier;
+
+/**
+ Identifiers of the blobs referenced by an item. Default implementation returns `nil`.
+
+ Must always return the same identifiers for the same item; the repository calls this when adding the item and again
+ when removing it.
+ */
+- (NSArray*)blobIdentifiersForItem:(id<BBRepositoryItem>)item;
+
+/** Called by the repository whenever it adds an item. */
+- (void)retainBlobsOfItem:(id<BBRepositoryItem>)item;
+
+/** Called by the repository whenever it replaces or removes an item. */
+- (void)releaseBlobsOfItem:(id<BBRepositoryItem>)item;
+
+/** Deletes every blob that no item references, in the background. Useful after a `reload`. */
+- (void)collectUnreferencedBlobsInBackground;
 
 @end
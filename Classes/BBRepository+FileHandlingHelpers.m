@@ -21,6 +21,18 @@
 
 #import "BBRepository+FileHandlingHelpers.h"
 
+#import <objc/runtime.h>
+#import <pthread.h>
+
+#import "BBRepositoryDeletionQueue.h"
+
+
+
+#pragma mark - Constants
+
+static char kBBRepositoryBlobStoreKey;
+static pthread_mutex_t kBBRepositoryBlobStoreCreationLock = PTHREAD_MUTEX_INITIALIZER;
+
 
 
 #pragma mark -
@@ -48,18 +60,86 @@
 
 - (void)deleteFileInBackground:(NSString*)fullPathToFile
 {
-    if (fullPathToFile == nil) return;
-
-    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0), ^{
-        NSError* error = nil;
-        if ([[NSFileManager defaultManager] removeItemAtPath:fullPathToFile error:&error]) {
-            LogTrace(@"[%@] Deleted file at '%@'.", self.repositoryName, fullPathToFile);
-        } else {
-            // Never fails unless file doesn't exist...
-            LogError(@"[%@] Could not delete file at '%@': %@",
-                     self.repositoryName, fullPathToFile, [error description]);
-        }
-    });
+    [[BBRepositoryDeletionQueue sharedQueue] deleteFileAtPath:fullPathToFile];
+}
+
+- (void)deleteFilesInBackground:(NSArray*)fullPathsToFiles
+{
+    [[BBRepositoryDeletionQueue sharedQueue] deleteFilesAtPaths:fullPathsToFiles];
+}
+
+- (void)waitForBackgroundDeletions
+{
+    [[BBRepositoryDeletionQueue sharedQueue] drain];
+}
+
+
+#pragma mark Blobs
+
+- (BBRepositoryBlobStore*)blobStore
+{
+    BBRepositoryBlobStore* blobStore = objc_getAssociatedObject(self, &kBBRepositoryBlobStoreKey);
+    if (blobStore != nil) return blobStore;
+
+    // Categories can't add ivars, so the store hangs off the repository as an associated object
+    pthread_mutex_lock(&kBBRepositoryBlobStoreCreationLock);
+    blobStore = objc_getAssociatedObject(self, &kBBRepositoryBlobStoreKey);
+    if (blobStore == nil) {
+        NSString* directory = [NSString stringWithFormat:@"%@-Blobs", [self repositoryName]];
+        blobStore = [[BBRepositoryBlobStore alloc] initWithPath:[self fullPathForFile:directory]];
+
+        __weak BBRepository* weakSelf = self;
+        blobStore.referencedIdentifiersBlock = ^NSSet* {
+            BBRepository* repository = weakSelf;
+            if (repository == nil) return nil;
+
+            NSMutableSet* identifiers = [NSMutableSet set];
+            [repository enumerateItemsUsingBlock:^(id item, BOOL* stop) {
+                NSArray* itemIdentifiers = [repository blobIdentifiersForItem:item];
+                if (itemIdentifiers != nil) [identifiers addObjectsFromArray:itemIdentifiers];
+            }];
+
+            return identifiers;
+        };
+
+        objc_setAssociatedObject(self, &kBBRepositoryBlobStoreKey, blobStore, OBJC_ASSOCIATION_RETAIN_NONATOMIC);
+    }
+    pthread_mutex_unlock(&kBBRepositoryBlobStoreCreationLock);
+
+    return blobStore;
+}
+
+- (NSString*)storeBlob:(NSData*)data error:(NSError**)error
+{
+    return [[self blobStore] storeData:data error:error];
+}
+
+- (NSData*)blobWithIdentifier:(NSString*)identifier
+{
+    return [[self blobStore] dataForIdentifier:identifier];
+}
+
+- (NSArray*)blobIdentifiersForItem:(id<BBRepositoryItem>)item
+{
+    return nil;
+}
+
+- (void)retainBlobsOfItem:(id<BBRepositoryItem>)item
+{
+    // Don't bother creating a store for repositories whose items never reference blobs
+    NSArray* identifiers = [self blobIdentifiersForItem:item];
+    if ([identifiers count] > 0) [[self blobStore] retainIdentifiers:identifiers];
+}
+
+- (void)releaseBlobsOfItem:(id<BBRepositoryItem>)item
+{
+    NSArray* identifiers = [self blobIdentifiersForItem:item];
+    if ([identifiers count] > 0) [[self blobStore] releaseIdentifiers:identifiers];
+}
+
+- (void)collectUnreferencedBlobsInBackground
+{
+    [[self blobStore] collectGarbageInBackground];
 }
 
 @end
@@ -20,15 +20,24 @@
 //
 
 #import "BBRepositoryItem.h"
+#import "BBRepositorySecondaryIndex.h"
+#import "BBRepositoryStatistics.h"
 
 
 
 #pragma mark - Macros
 
+#ifndef LogTrace
+    #if BBREPOSITORY_TRACE
+        #define LogTrace(fmt, ...)  NSLog((@"TRACE | " fmt), ##__VA_ARGS__);
+    #else
+        #define LogTrace(fmt, ...)
+    #endif
+#endif
 #ifndef LogDebug
     #if DEBUG
         #define LogDebug(fmt, ...)  NSLog((@"DEBUG | " fmt), ##__VA_ARGS__);
-    #elif
+    #else
         #define LogDebug(fmt, ...)
     #endif
 #endif
@@ -46,6 +55,46 @@
 /** Default repository identifier */
 extern NSString* const kBBRepositoryDefaultIdentifier;
 
+/** Domain of the errors passed to completion blocks. Codes are `BBRepositoryErrorCode` values. */
+extern NSString* const kBBRepositoryErrorDomain;
+
+
+
+#pragma mark - Enums
+
+/** Format in which `flush` writes the index files. `reload` detects the format of existing files automatically. */
+typedef NS_ENUM(NSUInteger, BBRepositoryIndexFormat) {
+    /** The whole index is a single binary property list, wrapping a dictionary of every entry. */
+    BBRepositoryIndexFormatPropertyList = 0,
+    /** Each entry is an independent binary property list, located through a key table. See `loadsItemsLazily`. */
+    BBRepositoryIndexFormatRecords,
+    /**
+     Same as `BBRepositoryIndexFormatPropertyList`, block compressed. Smaller files, at the cost of some CPU time on
+     `flush` and `reload`. See `BBRepositoryCompressedIndex`.
+     */
+    BBRepositoryIndexFormatCompressedPropertyList
+};
+
+typedef NS_ENUM(NSInteger, BBRepositoryErrorCode) {
+    /** `reload` failed. The cause is logged. */
+    BBRepositoryErrorReloadFailed = 1,
+    /** `flush` failed. The cause is logged; the changes are kept in memory, to be written on the next one. */
+    BBRepositoryErrorFlushFailed
+};
+
+
+
+#pragma mark - Types
+
+/**
+ Called when an asynchronous operation completes.
+
+ @param succeeded Whether the operation succeeded.
+ @param error `nil` if it succeeded, otherwise an error in `kBBRepositoryErrorDomain`.
+ @param duration Time, in seconds, the operation took to run, not counting any time waiting to start.
+ */
+typedef void (^BBRepositoryCompletionBlock)(BOOL succeeded, NSError* error, NSTimeInterval duration);
+
 
 
 #pragma mark -
@@ -90,29 +139,37 @@ extern NSString* const kBBRepositoryDefaultIdentifier;
  
  ## Indexing other fields
  
- If you wish to index your records based on other fields, the best way to do it is to override `reloadComplete` and
- populate your own `NSDictionary` there.
+ If you wish to index your records based on other fields, register a secondary index with
+ `addIndexWithName:unique:keyBlock:`. The repository keeps it up to date as items are added, replaced and removed, and
+ rebuilds it on `reload`.
  
  For instance, if you were to index a given record based on a combination of `name` and `source` fields, you could do:
  
-    - (void)reloadComplete
-    {
-        // Assumes existence of _otherIndex NSMutableDictionary
-        _otherIndex = [NSMutableDictionary dictionary];
+    [repository addIndexWithName:@"nameAndSource" unique:YES keyBlock:^id<NSCopying>(Record* record) {
+        return [NSString stringWithFormat:@"%@:%@", record.name, record.source];
+    }];
 
-        for (id record in _entries) {
-            NSString* key = [NSString stringWithFormat:@"%@:%@", record.name, record.source];
-            [_otherIndex setObject:record forKey:key];
-        }
-     }
- 
- Of course that in doing so, you'd also have to update this secondary index on record insertion and removal.
+    Record* record = [repository itemForIndex:@"nameAndSource" key:@"foo:bar"];
+
+
+ ## Thread safety
+
+ All methods can be called from any thread. Entries are kept in a `BBConcurrentDictionary`, which splits them across
+ a number of independently locked stripes, so operations on different keys rarely contend with each other.
+
+ `addItem:` and `removeItemWithKey:` hold the lock for the item's key while calling the will/did hooks, so hooks for a
+ given key are never interleaved with hooks for that same key. Since the lock is shared by all keys in the same stripe,
+ hooks must not add or remove items with other keys, or they risk deadlocking with another thread doing the opposite.
+ Use `performWithLockForKey:block:` to make other compound operations on a single key atomic.
+
+ `reload`, `flush`, `checkpoint` and `destroy` are serialized with each other, but not with reads and writes.
 
 
  ## Performance considerations
  
  This class (and subclasses) are not meant to handle very large data sets. Use it only if you're sure that you will be
- handling at most a couple thousand entries.
+ handling at most a couple thousand entries, or enable the tiered mode (see `maximumResidentItemCount`), which keeps
+ only a bounded working set of items in memory.
  
  ### Properties of managed objects
 
@@ -147,8 +204,12 @@ extern NSString* const kBBRepositoryDefaultIdentifier;
  
  An image cache is a perfect example of this use case.
 
+ The blob store in `BBRepository+FileHandlingHelpers` does all of the above for you: it writes each distinct piece of
+ data once, tracks which items reference it as they're added, replaced and removed, and reads it back memory mapped.
+
  @see BBRepositoryItem
  @see BBCache
+ @see [BBRepository storeBlob:error:]
  */
 @interface BBRepository : NSObject
 {
@@ -156,6 +217,7 @@ extern NSString* const kBBRepositoryDefaultIdentifier;
     NSString* _identifier;
     NSString* _repositoryDirectory;
     NSString* _repositoryIndex;
+    NSString* _repositoryJournal;
     NSMutableDictionary* _entries;
 }
 
@@ -231,6 +293,17 @@ extern NSString* const kBBRepositoryDefaultIdentifier;
  It will also be used to create the index file:
  
      <base storage path>/<repository name>/<repository name>-<<identifier>>-Index.plist
+
+ Or, when the index is split in `indexShardCount` shards, the index shard files:
+
+     <base storage path>/<repository name>/<repository name>-<<identifier>>-Index-<shard count>-<shard>.plist
+
+ Index files in the `BBRepositoryIndexFormatRecords` format use the `records` extension instead of `plist`, and those in
+ the `BBRepositoryIndexFormatCompressedPropertyList` format use `compressed`.
+
+ And the journal file, if the repository is `journaled`:
+
+     <base storage path>/<repository name>/<repository name>-<<identifier>>-Journal.log
  
   Subclasses may override this method to provide a different return value.
  
@@ -258,6 +331,9 @@ extern NSString* const kBBRepositoryDefaultIdentifier;
 /**
  Reload data from disk
 
+ If an index file exists but can't be read, nothing is loaded and the index files are left untouched: every `flush`,
+ journaled or not, fails until a later `reload` succeeds or the repository is `destroy`ed.
+
  @return `YES` if entries were successfully reloaded from disk, `NO` otherwise.
  */
 - (BOOL)reload;
@@ -273,15 +349,170 @@ extern NSString* const kBBRepositoryDefaultIdentifier;
 /**
  Serialize and flush all entries in memory to disk.
 
+ When the repository is `journaled`, this only appends the changes made since the last flush to the journal, unless
+ the journal has grown past `journalCheckpointThreshold` records, in which case a `checkpoint` is performed instead.
+
  @return `YES` if entries were successfully flushed to disk, `NO` otherwise.
  */
 - (BOOL)flush;
 
+/**
+ Serialize all entries in memory, rewrite the index file and discard the journal.
+
+ For repositories that are not `journaled` this is the same as calling `flush`.
+
+ @return `YES` if entries were successfully written to the index file, `NO` otherwise.
+ */
+- (BOOL)checkpoint;
+
+/**
+ Schedules a `flush` on a background queue owned by the repository.
+
+ Requests are coalesced: however many are made before the flush runs, it runs once. Unless `immediately` is `YES`, the
+ flush waits for `backgroundFlushLeeway` seconds without requests, stretched when writes are steady or when flushing
+ takes long, but never for more than `maximumFlushLatency` seconds after the first request it covers. Background
+ flushes of the same repository never run concurrently, and an explicit `flush` or `checkpoint` takes the place of a
+ pending one. A pending flush keeps the repository alive until it has run, so releasing it doesn't lose changes.
+
+ Relies on GCD only, so it works without a run loop, e.g. in daemons or command line tools.
+ */
 - (void)flushInBackground;
 - (void)flushInBackground:(BOOL)immediately;
 
+/**
+ Same as `flushInBackground:`, calling `completion` on the `completionQueue` once the flush that covers this request is
+ done, be it the background one or an explicit `flush` or `checkpoint` that took its place.
+ */
+- (void)flushInBackground:(BOOL)immediately completion:(BBRepositoryCompletionBlock)completion;
+
+/** Minimum quiet time, in seconds, before a background flush runs. Defaults to 1. */
 @property(assign, nonatomic) NSTimeInterval backgroundFlushLeeway;
 
+/**
+ Maximum time, in seconds, between the first `flushInBackground` call and the flush that makes its changes durable,
+ however steadily writes keep coming. Defaults to 10.
+ */
+@property(assign, nonatomic) NSTimeInterval maximumFlushLatency;
+
+/**
+ Whether changes are recorded in an append-only journal, stored next to the index file.
+
+ When enabled, every `addItem:` and `removeItemWithKey:` appends a compact record to an in-memory journal buffer and
+ `flush` simply appends those records to the journal file. The index file is only rewritten on `checkpoint`, which
+ `flush` triggers automatically once the journal holds `journalCheckpointThreshold` records.
+
+ Changes made to items without going through `addItem:` (such as `BBCache` touching expiration dates) are only
+ persisted on the next checkpoint.
+
+ `reload` always replays an existing journal on top of the index file, regardless of this setting, so it is safe to
+ turn journaling off at any time. Each index file stores the journal generation it was written at alongside its
+ entries, never as one of them, so records it already covers aren't replayed if the journal outlived a checkpoint.
+ Defaults to `NO`.
+ */
+@property(assign, nonatomic, getter = isJournaled) BOOL journaled;
+
+/**
+ Number of journal records after which `flush` folds the journal back into the index file. Defaults to 1000.
+ */
+@property(assign, nonatomic) NSUInteger journalCheckpointThreshold;
+
+/**
+ Number of index files the entries are spread across, by hash of their key. Defaults to 1 (a single index file).
+
+ With more than one shard, `addItem:` and `removeItemWithKey:` mark the shard holding the key as dirty and `flush` only
+ rewrites dirty shards, while `reload` decodes all shards concurrently. Items changed in place without going through
+ `addItem:` will only be persisted once something else dirties their shard.
+
+ Must be set before calling `reload`. If the index files on disk were written with a different number of shards
+ (including the single index file written by default) `reload` reads them instead and the next `flush` rewrites every
+ shard in the new layout, deleting the old files once it succeeds.
+ */
+@property(assign, nonatomic) NSUInteger indexShardCount;
+
+/**
+ Format of the index files written by `flush`. Defaults to `BBRepositoryIndexFormatPropertyList`.
+
+ Changing the format is handled like changing `indexShardCount`: existing files are read on `reload` and replaced on
+ the next `flush`.
+ */
+@property(assign, nonatomic) BBRepositoryIndexFormat indexFormat;
+
+/**
+ Whether `reload` defers creating items until they're first needed. Defaults to `NO`.
+
+ Only applies to index files in the `BBRepositoryIndexFormatRecords` format. These are memory mapped and `reload` only
+ reads their key table, so its cost no longer depends on the size of the entries. Each entry is decoded and passed to
+ `createItemFromDictionary:` the first time it's retrieved through `itemForKey:`, replaced, removed or enumerated
+ through `allItems`. Entries that are never loaded are copied over to the new index file on `flush` without being
+ decoded.
+
+ Subclasses accessing `_entries` directly must be aware that it only contains the items loaded so far.
+ */
+@property(assign, nonatomic) BOOL loadsItemsLazily;
+
+/**
+ Maximum number of items kept in memory. Defaults to `0`, meaning no limit.
+
+ Setting this or `maximumResidentResourceUsage` enables the tiered mode: once over the limit, the least recently used
+ items (as approximated by the CLOCK algorithm) are encoded and evicted to a cold store file next to the index, from
+ which they're paged back in by `itemForKey:`. Evicting an item doesn't call any hooks; as far as the repository's
+ users are concerned, it's still there. `itemCount`, `hasItemWithKey:`, `allItems` and the enumeration methods cover
+ both tiers.
+
+ In tiered mode, `reload` never loads more than the limit into memory, behaving as if `loadsItemsLazily` was enabled.
+
+ Note that `allItems`, as well as registering secondary indexes, needs every item in memory at once.
+ */
+@property(assign, nonatomic) NSUInteger maximumResidentItemCount;
+
+/**
+ Maximum sum of the `resourceUsage` (as per `metadataForItem:`) of the items kept in memory. Defaults to `0`, meaning
+ no limit.
+
+ @see maximumResidentItemCount
+ */
+@property(assign, nonatomic) double maximumResidentResourceUsage;
+
+/**
+ Whether `reload` converts entries into items on all available cores. Defaults to `NO`.
+
+ Entries are split in chunks which are converted concurrently and merged once they're all done. `reloadComplete` is
+ still called exactly once, on the thread that called `reload`, after the merge.
+
+ When enabling this, `createItemFromDictionary:` (and, by extension, the items' `initWithRepositoryDictionary:`) must be
+ thread-safe, as it will be called from multiple threads at once. It must not access `_entries` or call back into the
+ repository. No other hooks are affected.
+ */
+@property(assign, nonatomic) BOOL reloadsConcurrently;
+
+/**
+ Whether `flush` converts items on all available cores when writing index files in the
+ `BBRepositoryIndexFormatRecords` format. Defaults to `NO`.
+
+ Index files in that format are always streamed to a temporary file, in batches, and then atomically renamed over the
+ previous one; the whole index is never held in memory. With this option, each batch is split into chunks converted
+ and encoded concurrently, one per core.
+
+ When enabling this, `convertItemToDictionary:` (and, by extension, the items' `convertToRepositoryDictionary`) and
+ `metadataForItem:` must be thread-safe, as they will be called from multiple threads at once.
+ */
+@property(assign, nonatomic) BOOL flushesConcurrently;
+
+/**
+ Whether the in-memory index keeps keys in compact open-addressing tables. Defaults to `NO`.
+
+ Keys are stored as UTF-8 bytes packed in a single buffer rather than as `NSString` objects, and `itemForKey:` probes
+ the table straight from the given key's characters without allocating anything. Worth it for repositories with
+ millions of short keys, where the per-key object and dictionary overhead dominates memory usage.
+
+ The flip side is that taking a snapshot of the entries, as `flush`, `allItems` and the enumeration methods do, copies
+ the tables instead of being O(1), and that lookups briefly hold the lock of the key's stripe. Changing this converts
+ the whole index in place.
+
+ @see BBCompactKeyTable
+ */
+@property(assign, nonatomic) BOOL usesCompactKeyIndex;
+
 
 #pragma mark Querying
 
@@ -290,7 +521,7 @@ extern NSString* const kBBRepositoryDefaultIdentifier;
 ///---------------
 
 /**
- Number of managed entries (in-memory) by this repository.
+ Number of managed entries by this repository, including those not loaded yet when `loadsItemsLazily` is enabled.
 
  @return Number of entries.
  */
@@ -299,6 +530,8 @@ extern NSString* const kBBRepositoryDefaultIdentifier;
 /**
  Returns a snapshot of all the items present in the repository at the time of calling of this method.
 
+ When `loadsItemsLazily` is enabled, this loads every item that hasn't been loaded yet.
+
  @return The current repository items.
  */
 - (NSArray*)allItems;
@@ -312,6 +545,24 @@ extern NSString* const kBBRepositoryDefaultIdentifier;
  */
 - (BOOL)hasItemWithKey:(NSString*)key;
 
+/**
+ Whether the repository keeps a Bloom filter over every key, to reject lookups for missing keys early. Defaults to `NO`.
+
+ With this enabled, `hasItemWithKey:` and `itemForKey:` answer most misses after hashing the key once, without going
+ through the entries or taking any lock; the filter itself is read lock-free. It saves no I/O, since every key, loaded
+ or not, is kept in memory either way; it pays off when misses are common. The filter is saved next to the index file
+ whenever it's written, read back on `reload` when nothing was journaled since, and rebuilt otherwise. It's also
+ rebuilt whenever it fills up, and on every index write, so that removed keys don't linger.
+ */
+@property(assign, nonatomic) BOOL usesKeyFilter;
+
+/**
+ Estimated probability of the key filter letting through a lookup for a key that's not in the repository.
+
+ @see usesKeyFilter
+ */
+@property(assign, nonatomic, readonly) double keyFilterFalsePositiveRate;
+
 /**
  Retrieve an item based on its index key
  
@@ -321,6 +572,125 @@ extern NSString* const kBBRepositoryDefaultIdentifier;
  */
 - (id)itemForKey:(NSString*)key;
 
+/**
+ Enumerates every item in the repository, without loading items that haven't been loaded yet.
+
+ Items not loaded yet are decoded just for the block and aren't kept in memory afterwards, so they're not the same
+ instances `itemForKey:` returns. An item loaded or evicted while the enumeration is running may be visited twice.
+
+ @param block The block to call for each item.
+ */
+- (void)enumerateItemsUsingBlock:(void (^)(id item, BOOL* stop))block;
+
+/**
+ Enumerates the metadata of every item in the repository, without loading items that haven't been loaded yet.
+
+ For loaded items, the metadata is computed with `metadataForItem:`. For items not loaded yet, it's read from the
+ metadata section of the index file they came from; only items coming from an index file written before the metadata
+ section existed are loaded to compute it.
+
+ As with every other enumeration in this repository, the block is not called with any lock held, and may thus modify
+ the repository.
+
+ @param block The block to call for each item.
+ */
+- (void)enumerateItemMetadataUsingBlock:(void (^)(NSString* key, BBRepositoryItemMetadata metadata, BOOL* stop))block;
+
+
+#pragma mark Secondary indexes
+
+///-------------------------
+/// @name Secondary indexes
+///-------------------------
+
+/**
+ Registers a secondary index, built from every item currently in the repository.
+
+ The index is then maintained by `addItem:`, `removeItemWithKey:` and their batch counterparts, including when an item
+ is replaced, and rebuilt on every `reload`, concurrently with the other indexes.
+
+ Indexes are best registered right after creating the repository, before calling `reload`. Note that indexes need
+ every item to be loaded, so registering any defeats `loadsItemsLazily`.
+
+ @param name Name of the index, used to query it. Replaces any index previously registered with the same name.
+ @param unique Whether the index maps each key to at most one item. If more than one item shares a key, the one added
+ last wins.
+ @param keyBlock Block that extracts the key under which an item is indexed.
+
+ @return The newly registered index.
+ */
+- (BBRepositorySecondaryIndex*)addIndexWithName:(NSString*)name unique:(BOOL)unique
+                                        keyBlock:(BBRepositorySecondaryIndexKeyBlock)keyBlock;
+
+/** Stops maintaining the secondary index with the given name. */
+- (void)removeIndexWithName:(NSString*)name;
+
+/**
+ Retrieves an item through a unique secondary index.
+
+ @param name Name of the index.
+ @param key Key the item is indexed under.
+
+ @return The item indexed under the given key, or `nil` if there's none (or no such index).
+ */
+- (id)itemForIndex:(NSString*)name key:(id<NSCopying>)key;
+
+/**
+ Retrieves every item indexed under a key of a secondary index.
+
+ @param name Name of the index.
+ @param key Key the items are indexed under.
+
+ @return The items, in no particular order.
+ */
+- (NSArray*)itemsForIndex:(NSString*)name key:(id<NSCopying>)key;
+
+
+#pragma mark Ordered queries
+
+///-----------------------
+/// @name Ordered queries
+///-----------------------
+
+/**
+ Whether the repository keeps its keys sorted, next to the entries. Defaults to `NO`.
+
+ With this enabled, prefix and range queries and ordered enumeration are O(log n + k), k being the number of items they
+ return, instead of having to go through (and sort) every key. Keys are compared literally, by UTF-16 code unit.
+
+ The ordered keys are kept in sync by `addItem:`, `removeItemWithKey:` and their batch counterparts, and rebuilt on
+ `reload`.
+ */
+@property(assign, nonatomic) BOOL maintainsKeyOrder;
+
+/**
+ Every item whose key starts with the given prefix, ordered by key.
+
+ @param prefix The prefix, e.g. `@"user:123:"`.
+
+ @return The matching items.
+ */
+- (NSArray*)itemsWithKeyPrefix:(NSString*)prefix;
+
+/**
+ Every item whose key is in the range [`startKey`, `endKey`), ordered by key.
+
+ @param startKey First key of the range, inclusive. `nil` to start from the first key.
+ @param endKey Last key of the range, exclusive. `nil` to go until the last key.
+
+ @return The matching items.
+ */
+- (NSArray*)itemsWithKeysFromKey:(NSString*)startKey toKey:(NSString*)endKey;
+
+/**
+ Enumerates every item in the repository, ordered by key.
+
+ Works off a snapshot of the keys, so the block may modify the repository; items removed in the meantime are skipped.
+
+ @param block The block to call for each item.
+ */
+- (void)enumerateItemsInKeyOrderUsingBlock:(void (^)(id item, BOOL* stop))block;
+
 
 #pragma mark Modifications
 
@@ -352,6 +722,132 @@ extern NSString* const kBBRepositoryDefaultIdentifier;
  */
 - (id)removeItemWithKey:(NSString*)key;
 
+/**
+ Adds a batch of items to the repository in a single pass.
+
+ Each item goes through the same steps as in `addItem:`, including the per-item hooks, but the whole batch is also
+ wrapped by a single call to `willAddItems:` and `didAddItems:`.
+
+ Note that this method does **not** call `addItem:`. Subclasses that override `addItem:` to roll in extra logic should
+ override this method as well, or better yet, move that logic to the hooks.
+
+ @param items Items to add to the repository.
+
+ @return Number of items that were added or replaced.
+ */
+- (NSUInteger)addItems:(NSArray*)items;
+
+/**
+ Removes a batch of items from the repository in a single pass.
+
+ Like `addItems:`, this method calls the per-item hooks and wraps the batch with `willRemoveItemsWithKeys:` and
+ `didRemoveItems:`, without calling `removeItemWithKey:`.
+
+ @param keys Keys for the items to remove from the repository.
+
+ @return The removed items.
+ */
+- (NSArray*)removeItemsWithKeys:(NSArray*)keys;
+
+/**
+ Whether `addItems:` and `removeItemsWithKeys:` schedule a `flushInBackground` once they're done, if they changed
+ anything. Defaults to `NO`.
+ */
+@property(assign, nonatomic) BOOL flushesAfterBatchUpdates;
+
+
+#pragma mark Synchronization
+
+///----------------------
+/// @name Synchronization
+///----------------------
+
+/**
+ Runs a block while holding the lock that serializes `addItem:`, `removeItemWithKey:` and their hooks for a key.
+
+ The lock is recursive, so the block can safely call back into the repository for the same key.
+
+ @param key The key to lock.
+ @param block The block to run.
+ */
+- (void)performWithLockForKey:(NSString*)key block:(void (^)(void))block;
+
+
+#pragma mark Asynchronous operations
+
+///-------------------------------
+/// @name Asynchronous operations
+///-------------------------------
+
+/**
+ Queue the asynchronous variants of `reload`, `flush` and `itemForKey:`, as well as prefetches, run on. Defaults to the
+ default priority global queue.
+
+ Set a serial queue to have them run one at a time, in the order they were requested. Must not be `nil`.
+ */
+@property(strong, nonatomic) dispatch_queue_t asynchronousQueue;
+
+/** Queue completion blocks are called on. Defaults to the main queue. Must not be `nil`. */
+@property(strong, nonatomic) dispatch_queue_t completionQueue;
+
+/** Runs `reload` on the `asynchronousQueue`, calling `completion` (if not `nil`) once it's done. */
+- (void)reloadWithCompletion:(BBRepositoryCompletionBlock)completion;
+
+/** Runs `flush` on the `asynchronousQueue`, calling `completion` (if not `nil`) once it's done. */
+- (void)flushWithCompletion:(BBRepositoryCompletionBlock)completion;
+
+/**
+ Runs `itemForKey:` on the `asynchronousQueue`, so that loading an item lazily or from the cold store doesn't block the
+ calling thread.
+
+ @param key The item's key.
+ @param completion Called on the `completionQueue` with the item, or `nil` if there's none.
+ */
+- (void)itemForKey:(NSString*)key completion:(void (^)(id item))completion;
+
+/**
+ Loads the items with the given keys into memory on the `asynchronousQueue`, so that subsequent `itemForKey:` calls
+ for them don't wait on disk I/O or decoding.
+
+ Only makes a difference when `loadsItemsLazily` is enabled or the repository is tiered; items that are already
+ loaded, as well as keys without an item, are skipped. When `reloadsConcurrently` is enabled, items are decoded on all
+ available cores. In tiered mode, prefetching more items than the residency limits allow evicts the least recently used
+ ones, possibly including some of the prefetched items.
+ */
+- (void)prefetchItemsForKeys:(NSArray*)keys;
+
+/** Same as `prefetchItemsForKeys:`, calling `completion` (if not `nil`) once every item is loaded. */
+- (void)prefetchItemsForKeys:(NSArray*)keys completion:(BBRepositoryCompletionBlock)completion;
+
+
+#pragma mark Statistics
+
+///-----------------
+/// @name Statistics
+///-----------------
+
+/**
+ Takes a snapshot of the counters and latency histograms this repository keeps as it's used.
+
+ Counters are always on; they're relaxed atomic increments, cheap enough to leave running in production. Subclasses
+ that track more than the base class knows about (e.g. `BBCappedCache` and its resource usage) override this method to
+ fill in the rest of the snapshot.
+
+ @return A new snapshot; it doesn't change as the repository keeps being used.
+ */
+- (BBRepositoryStatistics*)statistics;
+
+/** Zeroes every counter and histogram. */
+- (void)resetStatistics;
+
+/**
+ Adds to one of the counters. Meant for subclasses, to record the events only they know about, such as expirations.
+
+ @param statistic The counter to add to.
+ @param count The amount to add.
+ */
+- (void)recordStatistic:(BBRepositoryStatistic)statistic count:(uint64_t)count;
+
 
 #pragma mark Item (de-)serialization
 
@@ -373,6 +869,8 @@ extern NSString* const kBBRepositoryDefaultIdentifier;
      }
  
  When subclassing, make sure you change the return type, to improve type safety.
+
+ If `reloadsConcurrently` is enabled, this method must be thread-safe.
  
  @param dictionary `NSDictionary` instance that contains the serialized fields for an object.
  
@@ -394,12 +892,30 @@ extern NSString* const kBBRepositoryDefaultIdentifier;
  
  If you subclass this method, make sure you change the input parameter type, in order to add type safety.
 
+ If `flushesConcurrently` is enabled, this method must be thread-safe.
+
  @param item The item to convert.
 
  @return the `NSDictionary` representation of the item.
  */
 - (NSDictionary*)convertItemToDictionary:(id<BBRepositoryItem>)item;
 
+/**
+ Computes the metadata of an item.
+
+ Metadata is stored in a section of its own in index files written in the `BBRepositoryIndexFormatRecords` format, so
+ that `enumerateItemMetadataUsingBlock:` can be used for compaction, eviction and accounting without loading items.
+
+ The default implementation returns all zeroes. Subclasses that make use of metadata should override it.
+
+ If `flushesConcurrently` is enabled, this method must be thread-safe.
+
+ @param item The item.
+
+ @return The item's metadata.
+ */
+- (BBRepositoryItemMetadata)metadataForItem:(id<BBRepositoryItem>)item;
+
 
 #pragma mark Hooks
 
@@ -470,6 +986,34 @@ extern NSString* const kBBRepositoryDefaultIdentifier;
  */
 - (void)didRemoveItem:(id)item;
 
+/**
+ Called once before the items in a batch passed to `addItems:` are added, before any of the per-item hooks.
+
+ @param items The items about to be added or replaced.
+ */
+- (void)willAddItems:(NSArray*)items;
+
+/**
+ Called once after all the items in a batch passed to `addItems:` have been added.
+
+ @param items The items that were actually added or replaced, i.e. those for which the per-item hooks didn't veto.
+ */
+- (void)didAddItems:(NSArray*)items;
+
+/**
+ Called once before the items in a batch passed to `removeItemsWithKeys:` are removed.
+
+ @param keys The keys of the items about to be removed; some of them may not be present in the repository.
+ */
+- (void)willRemoveItemsWithKeys:(NSArray*)keys;
+
+/**
+ Called once after all the items in a batch passed to `removeItemsWithKeys:` have been removed.
+
+ @param items The items that were removed.
+ */
+- (void)didRemoveItems:(NSArray*)items;
+
 - (void)willFlush;
 - (void)didFinishFlushing;
 
@@ -21,11 +21,55 @@
 
 #import "BBRepository.h"
 
+#import <pthread.h>
+#import <stdatomic.h>
+
+#import "BBBloomFilter.h"
+#import "BBRepository+FileHandlingHelpers.h"
+#import "BBRepositoryCompressedIndex.h"
+#import "BBConcurrentDictionary.h"
+#import "BBRepositoryColdStore.h"
+#import "BBRepositoryIndexFile.h"
+#import "BBRepositoryJournal.h"
+#import "BBRepositoryResidentSet.h"
+#import "BBSortedKeySet.h"
+
 
 
 #pragma mark - Constants
 
 NSString* const kBBRepositoryDefaultIdentifier = @"Default";
+NSString* const kBBRepositoryErrorDomain = @"com.biasedbit.BBRepository";
+
+// Reserved entry of every index file, holding the journal generation it was written at
+
+static NSUInteger const kBBRepositoryReloadChunkSize = 256;
+static NSUInteger const kBBRepositoryFlushChunkSize = 256;
+
+
+
+#pragma mark - Utility functions
+
+static NSUInteger BBRepositoryShardForKey(NSString* key, NSUInteger shardCount)
+{
+    if (shardCount <= 1) return 0;
+
+    // FNV-1a over the UTF-16 characters; unlike -[NSString hash], it's guaranteed to be stable across OS releases,
+    // which matters since it determines the file each entry lives in.
+    uint64_t hash = 14695981039346656037ULL;
+    unichar buffer[64];
+    NSUInteger length = [key length];
+    for (NSUInteger location = 0; location < length; location += 64) {
+        NSRange range = NSMakeRange(location, MIN((NSUInteger)64, length - location));
+        [key getCharacters:buffer range:range];
+        for (NSUInteger i = 0; i < range.length; i++) {
+            hash ^= buffer[i];
+            hash *= 1099511628211ULL;
+        }
+    }
+
+    return (NSUInteger)(hash % shardCount);
+}
 
 
 
@@ -35,6 +79,36 @@ NSString* const kBBRepositoryDefaultIdentifier = @"Default";
 {
     dispatch_once_t _repositoryNameOnceToken;
     NSString* _repositoryName;
+    BBRepositoryJournal* _journal;
+    pthread_mutex_t _storageLock;
+    pthread_mutex_t _dirtyShardsLock;
+    NSMutableIndexSet* _dirtyShards;
+    NSArray* _staleIndexFiles;
+    // Set when reload found index files it couldn't read; rewriting them from memory would erase what they hold
+    BOOL _indexFilesUnreadable;
+    BBConcurrentDictionary* _lazyEntries;
+    pthread_mutex_t _secondaryIndexesLock;
+    NSDictionary* _secondaryIndexes;
+    BBSortedKeySet* _orderedKeys;
+    BBRepositoryColdStore* _coldStore;
+    BBRepositoryResidentSet* _residentSet;
+    pthread_mutex_t _evictionLock;
+    BBBloomFilter* _keyFilter;
+    NSString* _keyFilterPath;
+    _Atomic uint64_t _statistics[BBRepositoryStatisticCount];
+    BBRepositoryLatencyHistogram* _flushLatencies;
+    BBRepositoryLatencyHistogram* _reloadLatencies;
+    pthread_mutex_t _flushSchedulerLock;
+    dispatch_queue_t _flushQueue;
+    dispatch_source_t _flushTimer;
+    CFAbsoluteTime _firstFlushRequestTime;
+    CFAbsoluteTime _lastFlushRequestTime;
+    CFAbsoluteTime _scheduledFlushTime;
+    NSTimeInterval _averageFlushRequestInterval;
+    NSTimeInterval _lastFlushDuration;
+    NSMutableArray* _pendingFlushCompletions;
+    // Strong reference to self while a background flush is pending, so releasing the repository doesn't lose changes
+    id _retainedUntilFlushed;
 }
 
 
@@ -46,13 +120,52 @@ NSString* const kBBRepositoryDefaultIdentifier = @"Default";
     if (self != nil) {
         _identifier = identifier;
         _backgroundFlushLeeway = 1;
+        _maximumFlushLatency = 10;
+        _journalCheckpointThreshold = 1000;
+        _indexShardCount = 1;
+        _dirtyShards = [NSMutableIndexSet indexSetWithIndex:0];
+        _entries = [[BBConcurrentDictionary alloc] init];
+        _lazyEntries = [[BBConcurrentDictionary alloc] init];
+
+        // Recursive, so subclasses can flush from within reloadComplete or the flush hooks
+        pthread_mutexattr_t attributes;
+        pthread_mutexattr_init(&attributes);
+        pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+        pthread_mutex_init(&_storageLock, &attributes);
+        pthread_mutexattr_destroy(&attributes);
+        pthread_mutex_init(&_dirtyShardsLock, NULL);
+        pthread_mutex_init(&_secondaryIndexesLock, NULL);
+        _secondaryIndexes = @{};
+        _orderedKeys = [[BBSortedKeySet alloc] init];
+        _residentSet = [[BBRepositoryResidentSet alloc] init];
+        _keyFilter = [[BBBloomFilter alloc] initWithCapacity:0];
+        pthread_mutex_init(&_evictionLock, NULL);
+        for (NSUInteger i = 0; i < BBRepositoryStatisticCount; i++) atomic_init(&_statistics[i], 0);
+        _flushLatencies = [[BBRepositoryLatencyHistogram alloc] init];
+        _reloadLatencies = [[BBRepositoryLatencyHistogram alloc] init];
+        pthread_mutex_init(&_flushSchedulerLock, NULL);
+        _averageFlushRequestInterval = -1;
+        _pendingFlushCompletions = [NSMutableArray array];
+        [self setupFlushScheduler];
+        _asynchronousQueue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+        _completionQueue = dispatch_get_main_queue();
 
         NSString* basePath = [self baseStoragePath];
         NSString* repositoryName = [self repositoryName];
         NSString* indexFilename = [NSString stringWithFormat:@"%@-Index.plist", repositoryName];
+        NSString* journalFilename = [NSString stringWithFormat:@"%@-Journal.log", repositoryName];
 
         _repositoryDirectory = [basePath stringByAppendingPathComponent:repositoryName];
         _repositoryIndex = [_repositoryDirectory stringByAppendingPathComponent:indexFilename];
+        _repositoryJournal = [_repositoryDirectory stringByAppendingPathComponent:journalFilename];
+        _journal = [[BBRepositoryJournal alloc] initWithPath:_repositoryJournal];
+
+        NSString* coldStoreFilename = [NSString stringWithFormat:@"%@-Cold.data", repositoryName];
+        _coldStore = [[BBRepositoryColdStore alloc]
+                      initWithPath:[_repositoryDirectory stringByAppendingPathComponent:coldStoreFilename]];
+
+        NSString* keyFilterFilename = [NSString stringWithFormat:@"%@-Keys.bloom", repositoryName];
+        _keyFilterPath = [_repositoryDirectory stringByAppendingPathComponent:keyFilterFilename];
     }
 
     return self;
@@ -63,9 +176,36 @@ NSString* const kBBRepositoryDefaultIdentifier = @"Default";
     return [self initWithIdentifier:kBBRepositoryDefaultIdentifier];
 }
 
+- (void)dealloc
+{
+    pthread_mutex_destroy(&_storageLock);
+    pthread_mutex_destroy(&_dirtyShardsLock);
+    pthread_mutex_destroy(&_secondaryIndexesLock);
+    pthread_mutex_destroy(&_evictionLock);
+    pthread_mutex_destroy(&_flushSchedulerLock);
+    dispatch_source_cancel(_flushTimer);
+}
+
 
 #pragma mark Repository properties
 
+- (void)setIndexShardCount:(NSUInteger)indexShardCount
+{
+    pthread_mutex_lock(&_dirtyShardsLock);
+    _indexShardCount = MAX(indexShardCount, (NSUInteger)1);
+    _dirtyShards = [NSMutableIndexSet indexSetWithIndexesInRange:NSMakeRange(0, _indexShardCount)];
+    pthread_mutex_unlock(&_dirtyShardsLock);
+}
+
+- (void)setUsesCompactKeyIndex:(BOOL)usesCompactKeyIndex
+{
+    pthread_mutex_lock(&_storageLock);
+    _usesCompactKeyIndex = usesCompactKeyIndex;
+    [(BBConcurrentDictionary*)_entries setCompactKeys:usesCompactKeyIndex];
+    [_lazyEntries setCompactKeys:usesCompactKeyIndex];
+    pthread_mutex_unlock(&_storageLock);
+}
+
 - (NSString*)baseStoragePath
 {
     return [NSSearchPathForDirectoriesInDomains(NSApplicationSupportDirectory, NSUserDomainMask, YES) objectAtIndex:0];
@@ -86,13 +226,40 @@ NSString* const kBBRepositoryDefaultIdentifier = @"Default";
 
 - (BOOL)destroy
 {
-    _entries = [NSMutableDictionary dictionary];
+    pthread_mutex_lock(&_storageLock);
+    [_entries removeAllObjects];
+    [_lazyEntries removeAllObjects];
+    [self markAllShardsDirty];
+    _staleIndexFiles = nil;
+    _indexFilesUnreadable = NO;
+    [_journal reset];
+    for (BBRepositorySecondaryIndex* index in [[self secondaryIndexes] allValues]) [index rebuildWithItems:@[]];
+    [_orderedKeys removeAllKeys];
+    [_residentSet removeAllKeys];
+    [_coldStore reset];
+    [[self blobStore] reset];
+    [_keyFilter rebuildWithKeysFromBlock:^NSArray* {
+        return @[];
+    }];
     [[NSFileManager defaultManager] removeItemAtPath:_repositoryDirectory error:nil];
+    pthread_mutex_unlock(&_storageLock);
 
     return YES;
 }
 
 - (BOOL)reload
+{
+    pthread_mutex_lock(&_storageLock);
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    BOOL reloaded = [self reloadFromDisk];
+    [_reloadLatencies recordDuration:(CFAbsoluteTimeGetCurrent() - start)];
+    [self recordStatistic:BBRepositoryStatisticReloads count:1];
+    pthread_mutex_unlock(&_storageLock);
+
+    return reloaded;
+}
+
+- (BOOL)reloadFromDisk
 {
     NSError* error = nil;
 
@@ -101,46 +268,119 @@ NSString* const kBBRepositoryDefaultIdentifier = @"Default";
           createDirectoryAtPath:_repositoryDirectory withIntermediateDirectories:YES attributes:nil error:&error]) {
         LogError(@"[%@] Failed to ensure repository directory exists: %@",
                  [self repositoryName], [error localizedDescription]);
-        if (_entries == nil) _entries = [NSMutableDictionary dictionary];
         return NO;
     }
 
-    // Load the file as NSData
-    NSData* dictionaryData = [NSData dataWithContentsOfFile:_repositoryIndex];
-    if (dictionaryData == nil) {
-        LogDebug(@"[%@] Could not read index file; creating empty repository.", [self repositoryName]);
-        if (_entries == nil) _entries = [NSMutableDictionary dictionary];
-        return YES;
+    // Figure out which index files to read; if none were written with the current layout, migrate from older ones
+    NSArray* indexFiles = [self indexFilePathsForShardCount:_indexShardCount];
+    NSArray* staleIndexFiles = [self staleIndexFilePaths];
+    NSMutableArray* existingIndexFiles = [NSMutableArray arrayWithCapacity:[indexFiles count]];
+    for (NSString* path in indexFiles) {
+        if ([[NSFileManager defaultManager] fileExistsAtPath:path]) [existingIndexFiles addObject:path];
     }
 
-    // Deserialize the contents of the file to an NSDictionary
-    NSString* errorDescription = nil;
-    NSDictionary* entriesAsDictionaries = [NSPropertyListSerialization
-                                           propertyListFromData:dictionaryData
-                                           mutabilityOption:NSPropertyListImmutable
-                                           format:NULL errorDescription:&errorDescription];
+    BOOL migrating = ([existingIndexFiles count] == 0) && ([staleIndexFiles count] > 0);
+    if (migrating) {
+        LogInfo(@"[%@] Migrating %u index files to current layout (%u shards).",
+                [self repositoryName], [staleIndexFiles count], _indexShardCount);
+        existingIndexFiles = [staleIndexFiles mutableCopy];
+    }
 
-    if (errorDescription != nil) {
-        LogError(@"[%@] Data read from index file but de-serialization failed: %@", [self repositoryName], error);
-        if (_entries == nil) _entries = [NSMutableDictionary dictionary];
+    // Whatever shard we don't read from disk needs to be written on the next flush
+    [self markAllShardsDirty];
+    _staleIndexFiles = staleIndexFiles;
+    _indexFilesUnreadable = NO;
+
+    BOOL hasJournal = [[NSFileManager defaultManager] fileExistsAtPath:_repositoryJournal];
+    NSDictionary* entriesAsDictionaries = nil;
+    NSArray* checkpoints = nil;
+    if ([existingIndexFiles count] > 0) {
+        entriesAsDictionaries = [self readIndexFiles:existingIndexFiles checkpoints:&checkpoints];
+        if (entriesAsDictionaries == nil) {
+            // Leave every file as it is, readable or not, until a reload succeeds or the repository is destroyed
+            LogError(@"[%@] Failed to read index files; they won't be written until reloaded.", [self repositoryName]);
+            [self takeDirtyShards];
+            _staleIndexFiles = nil;
+            _indexFilesUnreadable = YES;
+            return NO;
+        }
+
+        if (!migrating && ([existingIndexFiles count] == [indexFiles count])) [self takeDirtyShards];
+    } else if (hasJournal) {
+        // Everything written so far may still live in a journal that was never checkpointed
+        entriesAsDictionaries = [NSDictionary dictionary];
+    } else {
+        LogDebug(@"[%@] Could not read index file; creating empty repository.", [self repositoryName]);
         return YES;
     }
 
+    // New records must never look older than any index file
+    NSMutableDictionary* checkpointsByPath = [NSMutableDictionary dictionaryWithCapacity:[checkpoints count]];
+    uint64_t oldestCheckpoint = UINT64_MAX;
+    for (NSUInteger i = 0; i < [checkpoints count]; i++) {
+        checkpointsByPath[existingIndexFiles[i]] = checkpoints[i];
+        oldestCheckpoint = MIN(oldestCheckpoint, [checkpoints[i] unsignedLongLongValue]);
+        [_journal setGeneration:[checkpoints[i] unsignedLongLongValue]];
+    }
+    if ([checkpoints count] == 0) oldestCheckpoint = 0;
+
+    // Apply whatever changes were journaled after the index file was last written
+    NSUInteger replayedRecords = 0;
+    if (hasJournal) {
+        NSDictionary* journalAttributes = [[NSFileManager defaultManager] attributesOfItemAtPath:_repositoryJournal
+                                                                                           error:nil];
+        [self recordStatistic:BBRepositoryStatisticBytesRead count:[journalAttributes fileSize]];
+
+        NSMutableDictionary* journaledEntries = [entriesAsDictionaries mutableCopy];
+        // Records older than a key's index file are already in it. Files from a stale layout hold keys by a different
+        // shard count, so settle for the oldest of them.
+        NSUInteger shardCount = _indexShardCount;
+        replayedRecords = [_journal replayOntoEntries:journaledEntries checkpointForKey:^uint64_t(NSString* key) {
+            if (migrating) return oldestCheckpoint;
+
+            return [checkpointsByPath[indexFiles[BBRepositoryShardForKey(key, shardCount)]] unsignedLongLongValue];
+        }];
+        entriesAsDictionaries = journaledEntries;
+
+        // Journaled changes may touch any shard and the journal is discarded on the next index write
+        if (replayedRecords > 0) [self markAllShardsDirty];
+
+        LogDebug(@"[%@] Replayed %u journal records on top of index file.", [self repositoryName], replayedRecords);
+    }
+
     NSMutableDictionary* entries = [NSMutableDictionary dictionaryWithCapacity:[entriesAsDictionaries count]];
-    // Convert each key-value pair (NSString, NSDictionary) into entries
-    [entriesAsDictionaries enumerateKeysAndObjectsUsingBlock:^(NSString* key, NSDictionary* dictionary, BOOL* stop) {
-        id<BBRepositoryItem> item = [self createItemFromDictionary:dictionary];
-        if (item != nil) [entries setObject:item forKey:[item key]];
-    }];
+    NSMutableDictionary* lazyEntries = [NSMutableDictionary dictionary];
+    // Convert each key-value pair (NSString, NSDictionary or still encoded record) into entries
+    if (_reloadsConcurrently) {
+        [self concurrentlyConvertEntries:entriesAsDictionaries toItems:entries lazyEntries:lazyEntries];
+    } else {
+        [entriesAsDictionaries enumerateKeysAndObjectsUsingBlock:^(NSString* key, id dictionary, BOOL* stop) {
+            [self convertEntry:dictionary withKey:key toItems:entries lazyEntries:lazyEntries];
+        }];
+    }
+
+    // The filter saved on the last index write is only good if the index files are still all there is
+    if (_usesKeyFilter) {
+        BOOL indexFilesAreCurrent = !migrating && (replayedRecords == 0) && ([existingIndexFiles count] == [indexFiles count]);
+        [self reloadKeyFilterWithKeys:[[entries allKeys] arrayByAddingObjectsFromArray:[lazyEntries allKeys]]
+                              canRead:indexFilesAreCurrent];
+    }
 
     // "atomic" change
-    _entries = entries;
+    [_lazyEntries replaceContentsWithDictionary:lazyEntries];
+    [_entries replaceContentsWithDictionary:entries];
+
+    // Whatever was evicted before is either in the index files or the journal by now
+    [_coldStore reset];
+    [self rebuildResidentSet];
+    [self rebuildSecondaryIndexes];
+    if (_maintainsKeyOrder) [_orderedKeys setKeys:[[entries allKeys] arrayByAddingObjectsFromArray:[lazyEntries allKeys]]];
 
     // Allow subclasses to perform some logic right after we've finished reloading data from disk
     [self reloadComplete];
 
-    LogDebug(@"[%@] Deserialized %u items from %u entries index file.",
-             [self repositoryName], [_entries count], [entriesAsDictionaries count]);
+    LogDebug(@"[%@] Deserialized %u items (%u left to load lazily) from %u entries index file.",
+             [self repositoryName], [_entries count], [_lazyEntries count], [entriesAsDictionaries count]);
 
     return YES;
 }
@@ -152,80 +392,106 @@ NSString* const kBBRepositoryDefaultIdentifier = @"Default";
 
 - (BOOL)flush
 {
-    [NSObject cancelPreviousPerformRequestsWithTarget:self selector:@selector(backgroundFlush) object:nil];
+    // A background flush that was still waiting is now taken care of by this one, and so are its completion blocks
+    NSArray* completions = [self cancelScheduledFlush];
 
-    [self willFlush];
-    // Grab a snapshot to avoid the need for synchronization
-    NSDictionary* snapshot = [NSDictionary dictionaryWithDictionary:_entries];
+    pthread_mutex_lock(&_storageLock);
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    BOOL flushed = (_journaled && ([_journal recordCount] < _journalCheckpointThreshold)) ?
+                   [self commitJournal] : [self writeIndex];
+    [self recordFlushSince:start succeeded:flushed];
+    pthread_mutex_unlock(&_storageLock);
 
-    NSError* error = nil;
-    NSMutableDictionary* itemsAsDictionaries = [NSMutableDictionary dictionaryWithCapacity:[snapshot count]];
-    [snapshot enumerateKeysAndObjectsUsingBlock:^(NSString* key, id<BBRepositoryItem> item, BOOL* stop) {
-        NSDictionary* itemAsDictionary = [self convertItemToDictionary:item];
-        if (itemAsDictionary != nil) [itemsAsDictionaries setObject:itemAsDictionary forKey:key];
-    }];
+    [self callCompletionBlocks:completions succeeded:flushed errorCode:BBRepositoryErrorFlushFailed since:start];
 
-    // Create NSData from the dictionary created above, by serializing using binary property lists.
-    NSData* dictionaryData = [NSPropertyListSerialization
-                              dataWithPropertyList:itemsAsDictionaries
-                              format:NSPropertyListBinaryFormat_v1_0
-                              options:0 error:&error];
-    if (error != nil) {
-        LogError(@"[%@] Failed to serialize index to binary format: %@",
-                 [self repositoryName], [error localizedDescription]);
-        return NO;
-    }
+    return flushed;
+}
 
-    if (![dictionaryData writeToFile:_repositoryIndex options:NSDataWritingAtomic error:&error]) {
-        LogError(@"[%@] Failed to write index file to disk while flushing: %@",
-                 [self repositoryName], [error localizedDescription]);
-        return NO;
-    }
+- (BOOL)checkpoint
+{
+    NSArray* completions = [self cancelScheduledFlush];
 
-    [self didFinishFlushing];
-    LogDebug(@"[%@] Serialized %u entries to %u binary format and wrote to disk.",
-             [self repositoryName], [snapshot count], [itemsAsDictionaries count]);
+    pthread_mutex_lock(&_storageLock);
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    BOOL flushed = [self writeIndex];
+    [self recordFlushSince:start succeeded:flushed];
+    pthread_mutex_unlock(&_storageLock);
 
-    return YES;
+    [self callCompletionBlocks:completions succeeded:flushed errorCode:BBRepositoryErrorFlushFailed since:start];
+
+    return flushed;
 }
 
 - (void)flushInBackground
 {
-    [self flushInBackground:NO];
+    [self flushInBackground:NO completion:nil];
 }
 
 - (void)flushInBackground:(BOOL)immediately
 {
-    // Make sure we run on the main queue, which has a NSRunLoop and lets us do the delayed selector tricks.
-    // The backgroundFlush implementation runs the -flush call on a background thread, anyway.
-    dispatch_async(dispatch_get_main_queue(), ^{
-        [NSObject cancelPreviousPerformRequestsWithTarget:self selector:@selector(backgroundFlush) object:nil];
-        if (immediately) [self backgroundFlush];
-        else [self performSelector:@selector(backgroundFlush) withObject:nil afterDelay:_backgroundFlushLeeway];
-    });
+    [self flushInBackground:immediately completion:nil];
 }
 
+- (void)flushInBackground:(BOOL)immediately completion:(BBRepositoryCompletionBlock)completion
+{
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+
+    pthread_mutex_lock(&_flushSchedulerLock);
+    if (completion != nil) [_pendingFlushCompletions addObject:[completion copy]];
+    BOOL pending = (_firstFlushRequestTime > 0);
+    if (pending) [self recordStatistic:BBRepositoryStatisticCoalescedFlushes count:1];
+    else _firstFlushRequestTime = now;
+    _retainedUntilFlushed = self;
+
+    // Smooth out the time between requests, to tell steady writes apart from the occasional change
+    if (_lastFlushRequestTime > 0) {
+        NSTimeInterval interval = now - _lastFlushRequestTime;
+        _averageFlushRequestInterval = (_averageFlushRequestInterval < 0) ?
+                                       interval : ((_averageFlushRequestInterval * 0.75) + (interval * 0.25));
+    }
+    _lastFlushRequestTime = now;
+
+    // Wait at least the leeway, and long enough for flushing not to take more than a fraction of the time. If writes
+    // are steady, wait for a couple of the usual gaps without any, so they're all folded into a single flush...
+    NSTimeInterval delay = MAX(_backgroundFlushLeeway, _lastFlushDuration * 4);
+    if ((_averageFlushRequestInterval >= 0) && ((_averageFlushRequestInterval * 2) < _maximumFlushLatency)) {
+        delay = MAX(delay, _averageFlushRequestInterval * 2);
+    }
+
+    // ... but never longer than the maximum latency, counting from the first request that hasn't been flushed yet.
+    CFAbsoluteTime flushTime = immediately ? now : MIN(now + delay, _firstFlushRequestTime + _maximumFlushLatency);
+    [self scheduleFlushAt:flushTime now:now];
+    pthread_mutex_unlock(&_flushSchedulerLock);
+}
 
 #pragma mark Querying
 
 - (NSUInteger)itemCount
 {
-    return [_entries count];
+    return [_entries count] + [_lazyEntries count];
 }
 
 - (NSArray*)allItems
 {
+    [self loadAllItems];
+
     return [_entries allValues];
 }
 
 - (BOOL)hasItemWithKey:(NSString*)key
 {
-    return _entries[key] != nil;
+    if (_usesKeyFilter && ![_keyFilter mightContainKey:key]) return NO;
+
+    return (_entries[key] != nil) || (_lazyEntries[key] != nil);
 }
 
 - (id)itemForKey:(NSString*)key
 {
-    return _entries[key];
+    id item = [self loadedItemForKey:key];
+    [self recordStatistic:((item != nil) ? BBRepositoryStatisticHits : BBRepositoryStatisticMisses) count:1];
+    [self evictItemsIfNeeded];
+
+    return item;
 }
 
 - (id)objectForKeyedSubscript:(NSString*)key
@@ -233,37 +499,353 @@ NSString* const kBBRepositoryDefaultIdentifier = @"Default";
     return [self itemForKey:key];
 }
 
+- (void)enumerateItemsUsingBlock:(void (^)(id item, BOOL* stop))block
+{
+    // Lazy entries first, then loaded ones, then lazy ones again: an entry moving between the two while we're at it
+    // (loaded or evicted) is visited at least once.
+    __block BOOL stop = NO;
+    NSMutableSet* visitedKeys = [NSMutableSet set];
+    void (^visitRecord)(NSString*, BBRepositoryIndexRecord*, BOOL*) =
+        ^(NSString* key, BBRepositoryIndexRecord* record, BOOL* stopLazy) {
+            if ([visitedKeys containsObject:key]) return;
+            [visitedKeys addObject:key];
+
+            @autoreleasepool {
+                NSDictionary* dictionary = [record dictionary];
+                id item = (dictionary != nil) ? [self createItemFromDictionary:dictionary] : nil;
+                if (item != nil) block(item, &stop);
+            }
+            *stopLazy = stop;
+        };
+
+    [_lazyEntries enumerateKeysAndObjectsUsingBlock:visitRecord];
+    if (stop) return;
+
+    [_entries enumerateKeysAndObjectsUsingBlock:^(NSString* key, id item, BOOL* stopEntries) {
+        [visitedKeys addObject:key];
+        block(item, &stop);
+        *stopEntries = stop;
+    }];
+    if (stop) return;
 
-#pragma mark Modifications
+    [_lazyEntries enumerateKeysAndObjectsUsingBlock:visitRecord];
+}
 
-- (BOOL)addItem:(id<BBRepositoryItem>)item
+- (void)enumerateItemMetadataUsingBlock:(void (^)(NSString* key, BBRepositoryItemMetadata metadata, BOOL* stop))block
+{
+    __block BOOL stop = NO;
+    [_entries enumerateKeysAndObjectsUsingBlock:^(NSString* key, id item, BOOL* stopEntries) {
+        block(key, [self metadataForItem:item], &stop);
+        *stopEntries = stop;
+    }];
+
+    [_lazyEntries enumerateKeysAndObjectsUsingBlock:^(NSString* key, BBRepositoryIndexRecord* record, BOOL* stopLazy) {
+        if ([record hasMetadata]) {
+            block(key, [record metadata], &stop);
+        } else {
+            // Came from an index file without metadata, so there's no way around loading it
+            id item = [self loadedItemForKey:key];
+            if (item != nil) block(key, [self metadataForItem:item], &stop);
+        }
+        *stopLazy = stop;
+    }];
+}
+
+- (void)setUsesKeyFilter:(BOOL)usesKeyFilter
+{
+    pthread_mutex_lock(&_storageLock);
+    // Build it before turning it on, so that it never rejects a key that's there
+    if (usesKeyFilter && !_usesKeyFilter) {
+        [_keyFilter rebuildWithKeysFromBlock:^NSArray* {
+            return [self allKeys];
+        }];
+    }
+    _usesKeyFilter = usesKeyFilter;
+    pthread_mutex_unlock(&_storageLock);
+}
+
+- (double)keyFilterFalsePositiveRate
+{
+    return _usesKeyFilter ? [_keyFilter estimatedFalsePositiveRate] : 1;
+}
+
+
+#pragma mark Secondary indexes
+
+- (BBRepositorySecondaryIndex*)addIndexWithName:(NSString*)name unique:(BOOL)unique
+                                        keyBlock:(BBRepositorySecondaryIndexKeyBlock)keyBlock
 {
-    id<BBRepositoryItem> existing = [_entries objectForKey:[item key]];
+    BBRepositorySecondaryIndex* index = [[BBRepositorySecondaryIndex alloc] initWithName:name unique:unique
+                                                                                keyBlock:keyBlock];
+
+    // Register it first so that nothing added while it's being built is missed
+    pthread_mutex_lock(&_secondaryIndexesLock);
+    NSMutableDictionary* indexes = [_secondaryIndexes mutableCopy];
+    indexes[name] = index;
+    _secondaryIndexes = indexes;
+    pthread_mutex_unlock(&_secondaryIndexesLock);
+
+    [index rebuildWithItems:[self allItems]];
+
+    return index;
+}
 
-    if (existing != nil) {
-        if (![self willReplaceItem:existing withNewItem:item]) return NO;
+- (void)removeIndexWithName:(NSString*)name
+{
+    pthread_mutex_lock(&_secondaryIndexesLock);
+    NSMutableDictionary* indexes = [_secondaryIndexes mutableCopy];
+    [indexes removeObjectForKey:name];
+    _secondaryIndexes = indexes;
+    pthread_mutex_unlock(&_secondaryIndexesLock);
+}
+
+- (id)itemForIndex:(NSString*)name key:(id<NSCopying>)key
+{
+    return [[self itemsForIndex:name key:key] lastObject];
+}
+
+- (NSArray*)itemsForIndex:(NSString*)name key:(id<NSCopying>)key
+{
+    BBRepositorySecondaryIndex* index = [self secondaryIndexes][name];
+    if (index == nil) return @[];
+
+    return [self itemsForKeys:[index itemKeysForKey:key]];
+}
+
+
+#pragma mark Tiering
+
+- (void)setMaximumResidentItemCount:(NSUInteger)maximumResidentItemCount
+{
+    pthread_mutex_lock(&_storageLock);
+    _maximumResidentItemCount = maximumResidentItemCount;
+    [self rebuildResidentSet];
+    pthread_mutex_unlock(&_storageLock);
+}
+
+- (void)setMaximumResidentResourceUsage:(double)maximumResidentResourceUsage
+{
+    pthread_mutex_lock(&_storageLock);
+    _maximumResidentResourceUsage = MAX(maximumResidentResourceUsage, (double)0);
+    [self rebuildResidentSet];
+    pthread_mutex_unlock(&_storageLock);
+}
+
+
+#pragma mark Ordered queries
+
+- (void)setMaintainsKeyOrder:(BOOL)maintainsKeyOrder
+{
+    pthread_mutex_lock(&_storageLock);
+    _maintainsKeyOrder = maintainsKeyOrder;
+    if (maintainsKeyOrder) [_orderedKeys setKeys:[self allKeys]];
+    else [_orderedKeys removeAllKeys];
+    pthread_mutex_unlock(&_storageLock);
+}
+
+- (NSArray*)itemsWithKeyPrefix:(NSString*)prefix
+{
+    NSArray* keys = nil;
+    if (_maintainsKeyOrder) {
+        keys = [_orderedKeys keysWithPrefix:prefix];
     } else {
-        if (![self willAddNewItem:item]) return NO;
+        keys = [[self sortedKeys] filteredArrayUsingPredicate:
+                [NSPredicate predicateWithBlock:^BOOL(NSString* key, NSDictionary* bindings) {
+                    return ([prefix length] == 0) || [key hasPrefix:prefix];
+                }]];
     }
 
-    _entries[[item key]] = item;
+    return [self itemsForKeys:keys];
+}
 
-    if (existing != nil) [self didReplaceItem:existing withNewItem:item];
-    else [self didAddNewItem:item];
+- (NSArray*)itemsWithKeysFromKey:(NSString*)startKey toKey:(NSString*)endKey
+{
+    NSArray* keys = nil;
+    if (_maintainsKeyOrder) {
+        keys = [_orderedKeys keysFromKey:startKey toKey:endKey];
+    } else {
+        keys = [[self sortedKeys] filteredArrayUsingPredicate:
+                [NSPredicate predicateWithBlock:^BOOL(NSString* key, NSDictionary* bindings) {
+                    if ((startKey != nil) && ([key compare:startKey options:NSLiteralSearch] == NSOrderedAscending)) {
+                        return NO;
+                    }
+                    return (endKey == nil) || ([key compare:endKey options:NSLiteralSearch] == NSOrderedAscending);
+                }]];
+    }
 
-    return YES;
+    return [self itemsForKeys:keys];
+}
+
+- (void)enumerateItemsInKeyOrderUsingBlock:(void (^)(id item, BOOL* stop))block
+{
+    NSArray* keys = _maintainsKeyOrder ? [_orderedKeys allKeys] : [self sortedKeys];
+
+    BOOL stop = NO;
+    for (NSString* key in keys) {
+        id item = [self itemForKey:key];
+        if (item != nil) block(item, &stop);
+        if (stop) break;
+    }
+}
+
+
+#pragma mark Modifications
+
+- (BOOL)addItem:(id<BBRepositoryItem>)item
+{
+    return [self storeItem:item];
 }
 
 - (id)removeItemWithKey:(NSString*)key
 {
-    id<BBRepositoryItem> item = _entries[key];
-    if (item == nil) return nil;
+    return [self deleteItemWithKey:key];
+}
 
-    [self willRemoveItem:item];
-    [_entries removeObjectForKey:key];
-    [self didRemoveItem:item];
+- (NSUInteger)addItems:(NSArray*)items
+{
+    if ([items count] == 0) return 0;
 
-    return item;
+    [self willAddItems:items];
+
+    NSMutableArray* storedItems = [NSMutableArray arrayWithCapacity:[items count]];
+    for (id<BBRepositoryItem> item in items) {
+        if ([self storeItem:item]) [storedItems addObject:item];
+    }
+
+    [self didAddItems:storedItems];
+    if (_flushesAfterBatchUpdates && ([storedItems count] > 0)) [self flushInBackground];
+
+    return [storedItems count];
+}
+
+- (NSArray*)removeItemsWithKeys:(NSArray*)keys
+{
+    if ([keys count] == 0) return @[];
+
+    [self willRemoveItemsWithKeys:keys];
+
+    NSMutableArray* removedItems = [NSMutableArray arrayWithCapacity:[keys count]];
+    for (NSString* key in keys) {
+        id item = [self deleteItemWithKey:key];
+        if (item != nil) [removedItems addObject:item];
+    }
+
+    [self didRemoveItems:removedItems];
+    if (_flushesAfterBatchUpdates && ([removedItems count] > 0)) [self flushInBackground];
+
+    return removedItems;
+}
+
+#pragma mark Synchronization
+
+- (void)performWithLockForKey:(NSString*)key block:(void (^)(void))block
+{
+    [self lockKey:key];
+    block();
+    [self unlockKey:key];
+}
+
+
+#pragma mark Asynchronous operations
+
+- (void)reloadWithCompletion:(BBRepositoryCompletionBlock)completion
+{
+    dispatch_async(_asynchronousQueue, ^{
+        CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+        BOOL reloaded = [self reload];
+        if (completion == nil) return;
+
+        [self callCompletionBlocks:@[completion] succeeded:reloaded errorCode:BBRepositoryErrorReloadFailed
+                             since:start];
+    });
+}
+
+- (void)flushWithCompletion:(BBRepositoryCompletionBlock)completion
+{
+    dispatch_async(_asynchronousQueue, ^{
+        CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+        BOOL flushed = [self flush];
+        if (completion == nil) return;
+
+        [self callCompletionBlocks:@[completion] succeeded:flushed errorCode:BBRepositoryErrorFlushFailed since:start];
+    });
+}
+
+- (void)itemForKey:(NSString*)key completion:(void (^)(id item))completion
+{
+    dispatch_async(_asynchronousQueue, ^{
+        id item = [self itemForKey:key];
+        if (completion == nil) return;
+
+        dispatch_async(_completionQueue, ^{
+            completion(item);
+        });
+    });
+}
+
+- (void)prefetchItemsForKeys:(NSArray*)keys
+{
+    [self prefetchItemsForKeys:keys completion:nil];
+}
+
+- (void)prefetchItemsForKeys:(NSArray*)keys completion:(BBRepositoryCompletionBlock)completion
+{
+    NSArray* keysToLoad = [keys copy];
+    dispatch_async(_asynchronousQueue, ^{
+        CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+
+        // Decoding items concurrently has the same requirements as reloading concurrently does
+        if (_reloadsConcurrently) {
+            dispatch_apply([keysToLoad count], dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t i) {
+                [self loadedItemForKey:keysToLoad[i]];
+            });
+        } else {
+            for (NSString* key in keysToLoad) [self loadedItemForKey:key];
+        }
+        [self evictItemsIfNeeded];
+
+        LogTrace(@"[%@] Prefetched %u items in %.3fs.",
+                 [self repositoryName], [keysToLoad count], CFAbsoluteTimeGetCurrent() - start);
+        if (completion != nil) {
+            [self callCompletionBlocks:@[completion] succeeded:YES errorCode:0 since:start];
+        }
+    });
+}
+
+
+#pragma mark Statistics
+
+- (BBRepositoryStatistics*)statistics
+{
+    uint64_t counts[BBRepositoryStatisticCount];
+    for (NSUInteger i = 0; i < BBRepositoryStatisticCount; i++) {
+        counts[i] = atomic_load_explicit(&_statistics[i], memory_order_relaxed);
+    }
+
+    BBRepositoryStatistics* statistics = [[BBRepositoryStatistics alloc] initWithCounts:counts
+                                                                         flushLatencies:_flushLatencies
+                                                                        reloadLatencies:_reloadLatencies];
+    statistics.itemCount = [self itemCount];
+    if (_usesKeyFilter) statistics.keyFilterFalsePositiveRate = [self keyFilterFalsePositiveRate];
+
+    return statistics;
+}
+
+- (void)resetStatistics
+{
+    for (NSUInteger i = 0; i < BBRepositoryStatisticCount; i++) {
+        atomic_store_explicit(&_statistics[i], 0, memory_order_relaxed);
+    }
+    [_flushLatencies reset];
+    [_reloadLatencies reset];
+}
+
+- (void)recordStatistic:(BBRepositoryStatistic)statistic count:(uint64_t)count
+{
+    if ((statistic >= BBRepositoryStatisticCount) || (count == 0)) return;
+
+    // Relaxed is enough; nothing is ever synchronized on these, they only need to add up eventually
+    atomic_fetch_add_explicit(&_statistics[statistic], count, memory_order_relaxed);
 }
 
 
@@ -281,6 +863,12 @@ NSString* const kBBRepositoryDefaultIdentifier = @"Default";
     return [item convertToRepositoryDictionary];
 }
 
+- (BBRepositoryItemMetadata)metadataForItem:(id<BBRepositoryItem>)item
+{
+    BBRepositoryItemMetadata metadata = {0, 0};
+    return metadata;
+}
+
 
 #pragma mark Hooks
 
@@ -314,6 +902,26 @@ NSString* const kBBRepositoryDefaultIdentifier = @"Default";
     // no-op
 }
 
+- (void)willAddItems:(NSArray*)items
+{
+    // no-op
+}
+
+- (void)didAddItems:(NSArray*)items
+{
+    // no-op
+}
+
+- (void)willRemoveItemsWithKeys:(NSArray*)keys
+{
+    // no-op
+}
+
+- (void)didRemoveItems:(NSArray*)items
+{
+    // no-op
+}
+
 - (void)willFlush
 {
     // no-op
@@ -327,11 +935,883 @@ NSString* const kBBRepositoryDefaultIdentifier = @"Default";
 
 #pragma mark Private helpers
 
-- (void)backgroundFlush
+- (BOOL)storeItem:(id<BBRepositoryItem>)item
+{
+    NSString* key = [item key];
+    if (key == nil) return NO;
+
+    // Hold the key's lock throughout so hooks for the same key never interleave
+    [self lockKey:key];
+    id<BBRepositoryItem> existing = [self loadedItemForKey:key];
+
+    BOOL proceed = (existing != nil) ? [self willReplaceItem:existing withNewItem:item] : [self willAddNewItem:item];
+    if (!proceed) {
+        [self unlockKey:key];
+        return NO;
+    }
+
+    _entries[key] = item;
+    // Only once it's in the entries, so that a concurrent rebuild of the filter can't miss it
+    if (_usesKeyFilter && (existing == nil)) [_keyFilter addKey:key];
+    if ([self isTiered]) [_residentSet addKey:key cost:[self residentCostOfItem:item]];
+    if (_maintainsKeyOrder && (existing == nil)) [_orderedKeys addKey:key];
+    for (BBRepositorySecondaryIndex* index in [[self secondaryIndexes] allValues]) {
+        if (existing != nil) [index removeItem:existing];
+        [index addItem:item];
+    }
+    if (_journaled) [self journalItem:item];
+    [self markShardDirtyForKey:key];
+    // Retain first, so blobs shared by both versions never look unreferenced
+    [self retainBlobsOfItem:item];
+    if (existing != nil) [self releaseBlobsOfItem:existing];
+
+    if (existing != nil) [self didReplaceItem:existing withNewItem:item];
+    else [self didAddNewItem:item];
+    [self unlockKey:key];
+
+    [self recordStatistic:((existing != nil) ? BBRepositoryStatisticReplaces : BBRepositoryStatisticAdds) count:1];
+
+    [self evictItemsIfNeeded];
+    if (_usesKeyFilter && ([_keyFilter keyCount] > [_keyFilter capacity])) [self rebuildKeyFilter];
+
+    return YES;
+}
+
+- (id)deleteItemWithKey:(NSString*)key
+{
+    if (key == nil) return nil;
+
+    [self lockKey:key];
+    id<BBRepositoryItem> item = [self loadedItemForKey:key];
+    if (item == nil) {
+        [self unlockKey:key];
+        return nil;
+    }
+
+    [self willRemoveItem:item];
+    [_entries removeObjectForKey:key];
+    [_residentSet removeKey:key];
+    if (_maintainsKeyOrder) [_orderedKeys removeKey:key];
+    for (BBRepositorySecondaryIndex* index in [[self secondaryIndexes] allValues]) [index removeItem:item];
+    if (_journaled) [_journal appendRemovalForKey:key];
+    [self markShardDirtyForKey:key];
+    [self releaseBlobsOfItem:item];
+    [self didRemoveItem:item];
+    [self unlockKey:key];
+
+    [self recordStatistic:BBRepositoryStatisticRemoves count:1];
+
+    return item;
+}
+
+
+- (void)recordFlushSince:(CFAbsoluteTime)start succeeded:(BOOL)succeeded
+{
+    NSTimeInterval duration = CFAbsoluteTimeGetCurrent() - start;
+    [_flushLatencies recordDuration:duration];
+    if (succeeded) [self recordStatistic:BBRepositoryStatisticFlushes count:1];
+
+    pthread_mutex_lock(&_flushSchedulerLock);
+    _lastFlushDuration = duration;
+    pthread_mutex_unlock(&_flushSchedulerLock);
+}
+
+- (void)setupFlushScheduler
+{
+    // Flushes requested with flushInBackground: all run on this queue, so they never pile up on top of each other
+    _flushQueue = dispatch_queue_create("com.biasedbit.BBRepository.flush", DISPATCH_QUEUE_SERIAL);
+    dispatch_set_target_queue(_flushQueue, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0));
+
+    _flushTimer = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, _flushQueue);
+    dispatch_source_set_timer(_flushTimer, DISPATCH_TIME_FOREVER, DISPATCH_TIME_FOREVER, 0);
+    // The timer itself must not keep the repository alive; a pending flush does, through _retainedUntilFlushed, and the
+    // strong reference taken here outlives it being cleared by scheduledFlush.
+    __weak BBRepository* weakSelf = self;
+    dispatch_source_set_event_handler(_flushTimer, ^{
+        BBRepository* strongSelf = weakSelf;
+        [strongSelf scheduledFlush];
+    });
+    dispatch_resume(_flushTimer);
+}
+
+- (void)scheduleFlushAt:(CFAbsoluteTime)flushTime now:(CFAbsoluteTime)now
+{
+    // Re-arming the timer for every write would be a waste; only do it if it moves by more than its own leeway
+    NSTimeInterval timerLeeway = MAX(_backgroundFlushLeeway / 10, 0.01);
+    if ((_scheduledFlushTime > 0) && (fabs(flushTime - _scheduledFlushTime) < timerLeeway)) return;
+
+    _scheduledFlushTime = flushTime;
+    int64_t delay = (int64_t)(MAX(flushTime - now, 0) * NSEC_PER_SEC);
+    dispatch_source_set_timer(_flushTimer, dispatch_time(DISPATCH_TIME_NOW, delay), DISPATCH_TIME_FOREVER,
+                              (uint64_t)(timerLeeway * NSEC_PER_SEC));
+}
+
+- (NSArray*)cancelScheduledFlush
 {
-    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0), ^{
-        [self flush];
+    pthread_mutex_lock(&_flushSchedulerLock);
+    if (_firstFlushRequestTime > 0) {
+        [self recordStatistic:BBRepositoryStatisticCoalescedFlushes count:1];
+        _firstFlushRequestTime = 0;
+        _scheduledFlushTime = 0;
+        dispatch_source_set_timer(_flushTimer, DISPATCH_TIME_FOREVER, DISPATCH_TIME_FOREVER, 0);
+    }
+    // Callers hold their own reference for as long as they're flushing
+    _retainedUntilFlushed = nil;
+
+    // Whoever is about to flush answers for every request made so far, whether it was still pending or already running
+    NSArray* completions = [_pendingFlushCompletions copy];
+    [_pendingFlushCompletions removeAllObjects];
+    pthread_mutex_unlock(&_flushSchedulerLock);
+
+    return completions;
+}
+
+- (void)callCompletionBlocks:(NSArray*)completions succeeded:(BOOL)succeeded errorCode:(BBRepositoryErrorCode)errorCode
+                       since:(CFAbsoluteTime)start
+{
+    if ([completions count] == 0) return;
+
+    NSTimeInterval duration = CFAbsoluteTimeGetCurrent() - start;
+    NSError* error = nil;
+    if (!succeeded) {
+        NSString* operation = (errorCode == BBRepositoryErrorReloadFailed) ? @"reload" : @"flush";
+        NSString* description = [NSString stringWithFormat:@"Failed to %@ %@", operation, [self repositoryName]];
+        error = [NSError errorWithDomain:kBBRepositoryErrorDomain code:errorCode
+                                userInfo:@{NSLocalizedDescriptionKey: description}];
+    }
+
+    dispatch_async(_completionQueue, ^{
+        for (BBRepositoryCompletionBlock completion in completions) completion(succeeded, error, duration);
     });
 }
 
+- (void)scheduledFlush
+{
+    pthread_mutex_lock(&_flushSchedulerLock);
+    // An explicit flush may have beaten us to it
+    BOOL pending = (_firstFlushRequestTime > 0);
+    _firstFlushRequestTime = 0;
+    _scheduledFlushTime = 0;
+    _retainedUntilFlushed = nil;
+    pthread_mutex_unlock(&_flushSchedulerLock);
+
+    if (pending) [self flush];
+}
+
+- (BOOL)writeIndex
+{
+    if (![self canFlush]) return NO;
+
+    [self willFlush];
+
+    // Anything journaled from here on may not make it into the snapshot and must survive the checkpoint. Likewise,
+    // shards dirtied after this point must be written again on the next flush.
+    uint64_t checkpoint = [_journal beginCheckpoint];
+    NSUInteger shardCount = _indexShardCount;
+    NSIndexSet* dirtyShards = [self takeDirtyShards];
+
+    // A single index file is always rewritten in full; it's the only way to persist items changed in place.
+    if (shardCount == 1) dirtyShards = [NSIndexSet indexSetWithIndex:0];
+
+    // Grab a snapshot to avoid the need for synchronization; items not yet loaded are written back still encoded.
+    // Both copies are O(stripes) and never hold up writers; merging them happens off the snapshots.
+    NSDictionary* lazySnapshot = [_lazyEntries copy];
+    NSDictionary* loadedSnapshot = [_entries copy];
+    NSMutableDictionary* snapshot = [lazySnapshot mutableCopy];
+    [snapshot addEntriesFromDictionary:loadedSnapshot];
+
+    NSMutableArray* shards = [NSMutableArray arrayWithCapacity:shardCount];
+    for (NSUInteger i = 0; i < shardCount; i++) [shards addObject:[NSMutableDictionary dictionary]];
+
+    [snapshot enumerateKeysAndObjectsUsingBlock:^(NSString* key, id item, BOOL* stop) {
+        NSUInteger shard = BBRepositoryShardForKey(key, shardCount);
+        if ([dirtyShards containsIndex:shard]) [shards[shard] setObject:item forKey:key];
+    }];
+
+    NSUInteger serializedCount = 0;
+    NSArray* indexFiles = [self indexFilePathsForShardCount:shardCount];
+    for (NSUInteger shard = [dirtyShards firstIndex]; shard != NSNotFound; shard = [dirtyShards indexGreaterThanIndex:shard]) {
+        NSUInteger shardSerializedCount = [self writeEntries:shards[shard] toIndexFile:indexFiles[shard]
+                                                  checkpoint:checkpoint];
+        if (shardSerializedCount == NSNotFound) {
+            // Try this and every other shard we didn't get to again next time
+            NSMutableIndexSet* unwrittenShards = [NSMutableIndexSet indexSet];
+            [unwrittenShards addIndexesInRange:NSMakeRange(shard, shardCount - shard)];
+            [self markShardsDirty:[unwrittenShards indexesPassingTest:^BOOL(NSUInteger index, BOOL* stop) {
+                return [dirtyShards containsIndex:index];
+            }]];
+
+            return NO;
+        }
+
+        serializedCount += shardSerializedCount;
+    }
+
+    // Files from a previous layout have been fully superseded by now
+    for (NSString* path in _staleIndexFiles) [[NSFileManager defaultManager] removeItemAtPath:path error:nil];
+    _staleIndexFiles = nil;
+
+    // The index now holds every change that had been journaled before the snapshot was taken
+    [_journal completeCheckpoint];
+
+    // Good time to get rid of removed keys. Written after the index and covering every key in it, even those removed
+    // since, so that it's never missing a key the index has.
+    if (_usesKeyFilter) {
+        NSArray* writtenKeys = [snapshot allKeys];
+        [_keyFilter rebuildWithKeysFromBlock:^NSArray* {
+            NSMutableSet* keys = [NSMutableSet setWithArray:writtenKeys];
+            [keys addObjectsFromArray:[self allKeys]];
+            return [keys allObjects];
+        }];
+        NSError* error = nil;
+        if (![_keyFilter writeToFile:_keyFilterPath error:&error]) {
+            LogError(@"[%@] Failed to write key filter: %@", [self repositoryName], [error localizedDescription]);
+        }
+    }
+
+    [self didFinishFlushing];
+    LogDebug(@"[%@] Serialized %u entries to %u binary format and wrote %u index files to disk.",
+             [self repositoryName], [snapshot count], serializedCount, [dirtyShards count]);
+
+    return YES;
+}
+
+- (NSUInteger)writeEntries:(NSDictionary*)entries toIndexFile:(NSString*)path checkpoint:(uint64_t)checkpoint
+{
+    NSError* error = nil;
+
+    if (_indexFormat == BBRepositoryIndexFormatRecords) {
+        return [self streamEntries:entries toIndexFile:path checkpoint:checkpoint];
+    }
+
+    NSMutableDictionary* itemsAsDictionaries = [NSMutableDictionary dictionaryWithCapacity:[entries count]];
+    __block NSString* unreadableKey = nil;
+    [entries enumerateKeysAndObjectsUsingBlock:^(NSString* key, id item, BOOL* stop) {
+        BOOL isRecord = [item isKindOfClass:[BBRepositoryIndexRecord class]];
+        NSDictionary* itemAsDictionary = isRecord ? [item dictionary] : [self convertItemToDictionary:item];
+        if (itemAsDictionary != nil) {
+            [itemsAsDictionaries setObject:itemAsDictionary forKey:key];
+        } else if (isRecord) {
+            unreadableKey = key;
+            *stop = YES;
+        }
+    }];
+
+    // Items that can't be converted are left out on purpose; records that can't be read back would just be lost
+    if (unreadableKey != nil) {
+        LogError(@"[%@] Failed to read entry with key '%@' while flushing.", [self repositoryName], unreadableKey);
+        return NSNotFound;
+    }
+
+    // Create NSData from the dictionary created above, by serializing using binary property lists. The generation
+    // goes next to the entries rather than among them, so it can't clash with any key.
+    NSData* dictionaryData = [NSPropertyListSerialization
+                              dataWithPropertyList:@[@(checkpoint), itemsAsDictionaries]
+                              format:NSPropertyListBinaryFormat_v1_0
+                              options:0 error:&error];
+    if (error != nil) {
+        LogError(@"[%@] Failed to serialize index to binary format: %@",
+                 [self repositoryName], [error localizedDescription]);
+        return NSNotFound;
+    }
+
+    if (_indexFormat == BBRepositoryIndexFormatCompressedPropertyList) {
+        dictionaryData = [BBRepositoryCompressedIndex compressData:dictionaryData];
+    }
+
+    if (![dictionaryData writeToFile:path options:NSDataWritingAtomic error:&error]) {
+        LogError(@"[%@] Failed to write index file to disk while flushing: %@",
+                 [self repositoryName], [error localizedDescription]);
+        return NSNotFound;
+    }
+    [self recordStatistic:BBRepositoryStatisticBytesWritten count:[dictionaryData length]];
+
+    return [itemsAsDictionaries count];
+}
+
+- (NSUInteger)streamEntries:(NSDictionary*)entries toIndexFile:(NSString*)path checkpoint:(uint64_t)checkpoint
+{
+    NSArray* keys = [entries allKeys];
+    NSUInteger keyCount = [keys count];
+    NSUInteger chunkSize = kBBRepositoryFlushChunkSize;
+    NSUInteger chunksPerBatch = _flushesConcurrently ? [[NSProcessInfo processInfo] activeProcessorCount] : 1;
+    NSUInteger batchSize = chunkSize * chunksPerBatch;
+    dispatch_queue_t queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+
+    NSError* error = nil;
+    BBRepositoryIndexFileWriter* writer = [[BBRepositoryIndexFileWriter alloc] initWithPath:path];
+    [writer setCheckpointGeneration:checkpoint];
+
+    // Encode one batch at a time and write it out before moving on to the next, so that no more than batchSize
+    // encoded records are ever held in memory, regardless of how many entries there are.
+    for (NSUInteger batchStart = 0; (batchStart < keyCount) && (error == nil); batchStart += batchSize) {
+        NSUInteger batchEnd = MIN(batchStart + batchSize, keyCount);
+        NSUInteger chunkCount = (batchEnd - batchStart + chunkSize - 1) / chunkSize;
+
+        NSMutableArray* chunks = [NSMutableArray arrayWithCapacity:chunkCount];
+        for (NSUInteger i = 0; i < chunkCount; i++) [chunks addObject:[NSMutableArray arrayWithCapacity:chunkSize]];
+        BBRepositoryItemMetadata* metadata = calloc(batchEnd - batchStart, sizeof(BBRepositoryItemMetadata));
+
+        void (^encodeChunk)(size_t) = ^(size_t chunk) {
+            NSUInteger start = batchStart + (chunk * chunkSize);
+            NSUInteger end = MIN(start + chunkSize, batchEnd);
+            for (NSUInteger i = start; i < end; i++) {
+                id entry = entries[keys[i]];
+                NSData* record = [self encodedRecordForEntry:entry];
+                [chunks[chunk] addObject:(record != nil) ? record : [NSNull null]];
+                if (record != nil) metadata[i - batchStart] = [self metadataForEntry:entry];
+            }
+        };
+
+        if (chunkCount > 1) dispatch_apply(chunkCount, queue, encodeChunk);
+        else if (chunkCount == 1) encodeChunk(0);
+
+        // Appending is sequential, but that's just a buffered write; encoding is where the time goes
+        for (NSUInteger chunk = 0; (chunk < chunkCount) && (error == nil); chunk++) {
+            NSArray* records = chunks[chunk];
+            NSUInteger start = batchStart + (chunk * chunkSize);
+            for (NSUInteger i = 0; (i < [records count]) && (error == nil); i++) {
+                id record = records[i];
+                if (record == [NSNull null]) {
+                    // Items that can't be converted are left out on purpose; records that can't be read would be lost
+                    NSString* key = keys[start + i];
+                    if ([entries[key] isKindOfClass:[BBRepositoryIndexRecord class]]) {
+                        error = [self unreadableEntryErrorForKey:key];
+                    }
+                    continue;
+                }
+
+                [writer appendRecord:record forKey:keys[start + i] metadata:metadata[start + i - batchStart]
+                               error:&error];
+            }
+        }
+
+        free(metadata);
+    }
+
+    if ((error != nil) || ![writer finish:&error]) {
+        LogError(@"[%@] Failed to write index file to disk while flushing: %@",
+                 [self repositoryName], [error localizedDescription]);
+        return NSNotFound;
+    }
+    [self recordStatistic:BBRepositoryStatisticBytesWritten count:[writer length]];
+
+    return [writer recordCount];
+}
+
+- (NSError*)unreadableEntryErrorForKey:(NSString*)key
+{
+    NSString* description = [NSString stringWithFormat:@"Failed to read entry with key '%@'", key];
+
+    return [NSError errorWithDomain:NSCocoaErrorDomain code:NSFileReadUnknownError
+                           userInfo:@{NSLocalizedDescriptionKey: description}];
+}
+
+- (NSData*)encodedRecordForEntry:(id)item
+{
+    // Records that were never loaded are copied over as-is, without decoding them
+    if ([item isKindOfClass:[BBRepositoryIndexRecord class]]) return [item data];
+
+    NSDictionary* itemAsDictionary = [self convertItemToDictionary:item];
+    if (itemAsDictionary == nil) return nil;
+
+    return [NSPropertyListSerialization dataWithPropertyList:itemAsDictionary
+                                                      format:NSPropertyListBinaryFormat_v1_0
+                                                     options:0 error:nil];
+}
+
+- (BBRepositoryItemMetadata)metadataForEntry:(id)item
+{
+    if (![item isKindOfClass:[BBRepositoryIndexRecord class]]) return [self metadataForItem:item];
+    if ([item hasMetadata]) return [item metadata];
+
+    // Record from an index file without metadata; decode it just long enough to compute it, without loading it
+    BBRepositoryItemMetadata metadata = {0, 0};
+    NSDictionary* dictionary = [item dictionary];
+    id<BBRepositoryItem> decodedItem = (dictionary != nil) ? [self createItemFromDictionary:dictionary] : nil;
+    if (decodedItem != nil) metadata = [self metadataForItem:decodedItem];
+
+    return metadata;
+}
+
+- (NSArray*)indexFilePathsForShardCount:(NSUInteger)shardCount
+{
+    NSString* extension = @"plist";
+    if (_indexFormat == BBRepositoryIndexFormatRecords) extension = @"records";
+    else if (_indexFormat == BBRepositoryIndexFormatCompressedPropertyList) extension = @"compressed";
+    if (shardCount == 1) return @[[[_repositoryIndex stringByDeletingPathExtension] stringByAppendingPathExtension:extension]];
+
+    NSMutableArray* paths = [NSMutableArray arrayWithCapacity:shardCount];
+    for (NSUInteger shard = 0; shard < shardCount; shard++) {
+        NSString* filename = [NSString stringWithFormat:@"%@-Index-%lu-%lu.%@", [self repositoryName],
+                              (unsigned long)shardCount, (unsigned long)shard, extension];
+        [paths addObject:[_repositoryDirectory stringByAppendingPathComponent:filename]];
+    }
+
+    return paths;
+}
+
+- (NSArray*)staleIndexFilePaths
+{
+    NSSet* currentPaths = [NSSet setWithArray:[self indexFilePathsForShardCount:_indexShardCount]];
+    NSString* prefix = [NSString stringWithFormat:@"%@-Index", [self repositoryName]];
+
+    NSMutableArray* stalePaths = [NSMutableArray array];
+    for (NSString* filename in [[NSFileManager defaultManager] contentsOfDirectoryAtPath:_repositoryDirectory
+                                                                                   error:nil]) {
+        if (![filename hasPrefix:prefix]) continue;
+        if (![filename hasSuffix:@".plist"] && ![filename hasSuffix:@".records"] &&
+            ![filename hasSuffix:@".compressed"]) continue;
+
+        NSString* path = [_repositoryDirectory stringByAppendingPathComponent:filename];
+        if (![currentPaths containsObject:path]) [stalePaths addObject:path];
+    }
+
+    return stalePaths;
+}
+
+- (NSDictionary*)readIndexFiles:(NSArray*)paths checkpoints:(NSArray**)checkpoints
+{
+    NSUInteger fileCount = [paths count];
+    NSMutableArray* decodedFiles = [NSMutableArray arrayWithCapacity:fileCount];
+    NSMutableArray* fileCheckpoints = [NSMutableArray arrayWithCapacity:fileCount];
+    for (NSUInteger i = 0; i < fileCount; i++) {
+        [decodedFiles addObject:[NSNull null]];
+        // Files written before checkpoints were recorded count as the oldest possible
+        [fileCheckpoints addObject:@0];
+    }
+
+    // Shards are independent, so read and decode them concurrently
+    dispatch_queue_t queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+    dispatch_apply(fileCount, queue, ^(size_t i) {
+        // Files in the records format only have their key table parsed; records are decoded as they're needed
+        BBRepositoryIndexFile* indexFile = [BBRepositoryIndexFile indexFileWithContentsOfFile:paths[i]];
+        if (indexFile != nil) {
+            [self recordStatistic:BBRepositoryStatisticBytesRead count:[indexFile length]];
+            NSMutableDictionary* records = [NSMutableDictionary dictionaryWithCapacity:[indexFile recordCount]];
+            [indexFile enumerateRecordsUsingBlock:^(NSString* key, BBRepositoryIndexRecord* record, BOOL* stop) {
+                records[key] = record;
+            }];
+
+            @synchronized (decodedFiles) {
+                decodedFiles[i] = records;
+                fileCheckpoints[i] = @([indexFile checkpointGeneration]);
+            }
+            return;
+        }
+
+        NSData* dictionaryData = [NSData dataWithContentsOfFile:paths[i]];
+        if (dictionaryData == nil) return;
+        [self recordStatistic:BBRepositoryStatisticBytesRead count:[dictionaryData length]];
+
+        // Told apart by their header rather than their extension, so renaming a file doesn't break anything
+        if ([BBRepositoryCompressedIndex isCompressedData:dictionaryData]) {
+            dictionaryData = [BBRepositoryCompressedIndex decompressData:dictionaryData];
+            if (dictionaryData == nil) {
+                LogError(@"[%@] Index file '%@' is compressed but corrupt.", [self repositoryName],
+                         [paths[i] lastPathComponent]);
+                return;
+            }
+        }
+
+        // Deserialize the contents of the file to an NSDictionary
+        NSString* errorDescription = nil;
+        id propertyList = [NSPropertyListSerialization propertyListFromData:dictionaryData
+                                                           mutabilityOption:NSPropertyListImmutable
+                                                                     format:NULL errorDescription:&errorDescription];
+
+        // Files written before checkpoint generations were recorded hold just the entries
+        NSNumber* checkpoint = @0;
+        NSDictionary* entriesAsDictionaries = propertyList;
+        if ([propertyList isKindOfClass:[NSArray class]] && ([propertyList count] == 2)) {
+            checkpoint = propertyList[0];
+            entriesAsDictionaries = propertyList[1];
+        }
+
+        BOOL isWellFormed = [checkpoint isKindOfClass:[NSNumber class]] &&
+                            [entriesAsDictionaries isKindOfClass:[NSDictionary class]];
+        if ((errorDescription == nil) && !isWellFormed) errorDescription = @"Unexpected contents";
+
+        if (errorDescription != nil) {
+            LogError(@"[%@] Data read from index file '%@' but de-serialization failed: %@",
+                     [self repositoryName], [paths[i] lastPathComponent], errorDescription);
+            return;
+        }
+
+        @synchronized (decodedFiles) {
+            decodedFiles[i] = entriesAsDictionaries;
+            fileCheckpoints[i] = checkpoint;
+        }
+    });
+
+    if ([decodedFiles containsObject:[NSNull null]]) return nil;
+    if (checkpoints != NULL) *checkpoints = fileCheckpoints;
+    if (fileCount == 1) return decodedFiles[0];
+
+    NSMutableDictionary* entriesAsDictionaries = [NSMutableDictionary dictionary];
+    for (NSDictionary* decodedFile in decodedFiles) [entriesAsDictionaries addEntriesFromDictionary:decodedFile];
+
+    return entriesAsDictionaries;
+}
+
+- (void)convertEntry:(id)dictionary withKey:(NSString*)key toItems:(NSMutableDictionary*)entries
+         lazyEntries:(NSMutableDictionary*)lazyEntries
+{
+    if ([dictionary isKindOfClass:[BBRepositoryIndexRecord class]]) {
+        if (_loadsItemsLazily || [self isTiered]) {
+            lazyEntries[key] = dictionary;
+            return;
+        }
+
+        dictionary = [dictionary dictionary];
+        if (dictionary == nil) return;
+    }
+
+    id<BBRepositoryItem> item = [self createItemFromDictionary:dictionary];
+    if (item != nil) [entries setObject:item forKey:[item key]];
+}
+
+- (void)concurrentlyConvertEntries:(NSDictionary*)entriesAsDictionaries toItems:(NSMutableDictionary*)entries
+                       lazyEntries:(NSMutableDictionary*)lazyEntries
+{
+    NSArray* keys = [entriesAsDictionaries allKeys];
+    NSUInteger keyCount = [keys count];
+    NSUInteger chunkCount = (keyCount + kBBRepositoryReloadChunkSize - 1) / kBBRepositoryReloadChunkSize;
+
+    NSMutableArray* chunkEntries = [NSMutableArray arrayWithCapacity:chunkCount];
+    NSMutableArray* chunkLazyEntries = [NSMutableArray arrayWithCapacity:chunkCount];
+    for (NSUInteger i = 0; i < chunkCount; i++) {
+        [chunkEntries addObject:[NSMutableDictionary dictionaryWithCapacity:kBBRepositoryReloadChunkSize]];
+        [chunkLazyEntries addObject:[NSMutableDictionary dictionary]];
+    }
+
+    // Each chunk only ever touches its own dictionaries, so there's nothing to synchronize until the merge below
+    dispatch_queue_t queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+    dispatch_apply(chunkCount, queue, ^(size_t chunk) {
+        NSUInteger end = MIN((chunk + 1) * kBBRepositoryReloadChunkSize, keyCount);
+        for (NSUInteger i = chunk * kBBRepositoryReloadChunkSize; i < end; i++) {
+            NSString* key = keys[i];
+            [self convertEntry:entriesAsDictionaries[key] withKey:key
+                       toItems:chunkEntries[chunk] lazyEntries:chunkLazyEntries[chunk]];
+        }
+    });
+
+    for (NSUInteger i = 0; i < chunkCount; i++) {
+        [entries addEntriesFromDictionary:chunkEntries[i]];
+        [lazyEntries addEntriesFromDictionary:chunkLazyEntries[i]];
+    }
+}
+
+- (id)loadedItemForKey:(NSString*)key
+{
+    if (_usesKeyFilter && ![_keyFilter mightContainKey:key]) return nil;
+
+    id item = _entries[key];
+    if (item != nil) {
+        if ([self isTiered]) [_residentSet touchKey:key];
+        return item;
+    }
+    if (_lazyEntries[key] == nil) return nil;
+
+    [self lockKey:key];
+    // Check again, someone may have loaded it while we waited for the lock
+    item = _entries[key];
+    BBRepositoryIndexRecord* record = (item == nil) ? _lazyEntries[key] : nil;
+    if (record == nil) {
+        [self unlockKey:key];
+        return item;
+    }
+
+    // First time this entry is touched; decode it and move it over to the loaded entries
+    NSDictionary* dictionary = [record dictionary];
+    if ([record isKindOfClass:[BBRepositoryColdRecord class]]) {
+        [self recordStatistic:BBRepositoryStatisticBytesRead count:[record range].length];
+    }
+    if (dictionary != nil) item = [self createItemFromDictionary:dictionary];
+    if (item != nil) _entries[key] = item;
+    else LogError(@"[%@] Failed to load item with key '%@' from index file.", [self repositoryName], key);
+    if ((item != nil) && [self isTiered]) [_residentSet addKey:key cost:[self residentCostOfItem:item]];
+
+    [_lazyEntries removeObjectForKey:key];
+    [self unlockKey:key];
+
+    return item;
+}
+
+- (void)loadAllItems
+{
+    for (NSString* key in [_lazyEntries allKeys]) [self loadedItemForKey:key];
+}
+
+- (void)rebuildKeyFilter
+{
+    // Only grows the filter; if a rebuild is already running, it picks up every key added so far anyway
+    [_keyFilter tryRebuildWithKeysFromBlock:^NSArray* {
+        return [self allKeys];
+    }];
+}
+
+- (void)reloadKeyFilterWithKeys:(NSArray*)keys canRead:(BOOL)canRead
+{
+    BBBloomFilter* savedFilter = canRead ? [BBBloomFilter bloomFilterWithContentsOfFile:_keyFilterPath] : nil;
+
+    // Keys added after the index was written but before the filter was may be in there too, so only bail out if it
+    // has less keys than we have
+    if ((savedFilter != nil) && ([savedFilter keyCount] >= [keys count]) &&
+        ([savedFilter keyCount] <= [savedFilter capacity])) {
+        [_keyFilter replaceContentsWithFilter:savedFilter];
+        return;
+    }
+
+    [_keyFilter rebuildWithKeysFromBlock:^NSArray* {
+        return keys;
+    }];
+}
+
+- (BOOL)isTiered
+{
+    return (_maximumResidentItemCount > 0) || (_maximumResidentResourceUsage > 0);
+}
+
+- (double)residentCostOfItem:(id<BBRepositoryItem>)item
+{
+    return (_maximumResidentResourceUsage > 0) ? [self metadataForItem:item].resourceUsage : 0;
+}
+
+- (BOOL)isOverResidencyLimits
+{
+    if ((_maximumResidentItemCount > 0) && ([_residentSet count] > _maximumResidentItemCount)) return YES;
+
+    return (_maximumResidentResourceUsage > 0) && ([_residentSet totalCost] > _maximumResidentResourceUsage);
+}
+
+- (void)rebuildResidentSet
+{
+    [_residentSet removeAllKeys];
+    if (![self isTiered]) return;
+
+    [_entries enumerateKeysAndObjectsUsingBlock:^(NSString* key, id item, BOOL* stop) {
+        [_residentSet addKey:key cost:[self residentCostOfItem:item]];
+    }];
+
+    [self evictItemsIfNeeded];
+}
+
+- (void)evictItemsIfNeeded
+{
+    if (![self isTiered] || ![self isOverResidencyLimits]) return;
+
+    // One evicting thread is enough; whoever else gets here in the meantime moves on
+    if (pthread_mutex_trylock(&_evictionLock) != 0) return;
+
+    // Items that can't be evicted right now go back in the set; don't go around in circles if that's all that's left
+    NSUInteger attempts = [_residentSet count];
+    NSUInteger evicted = 0;
+    NSString* key = nil;
+    while ((attempts-- > 0) && [self isOverResidencyLimits] && ((key = [_residentSet popVictim]) != nil)) {
+        if ([self evictItemWithKey:key]) evicted++;
+    }
+
+    // Compacting only once dead bytes outnumber live ones keeps its cost proportional to the bytes evicted
+    if ((evicted > 0) && [_coldStore needsCompaction]) [self compactColdStore];
+    pthread_mutex_unlock(&_evictionLock);
+
+    if (evicted > 0) LogDebug(@"[%@] Evicted %u items to cold store.", [self repositoryName], evicted);
+}
+
+- (BOOL)evictItemWithKey:(NSString*)key
+{
+    // Never wait for a key's lock here: the caller may hold the lock of another key in the same stripe and whoever
+    // holds this one may be waiting on it. Busy items just stay in memory for now.
+    BBConcurrentDictionary* entries = (BBConcurrentDictionary*)_entries;
+    if (![entries tryLockKey:key]) {
+        id item = _entries[key];
+        if (item != nil) [_residentSet addKey:key cost:[self residentCostOfItem:item]];
+        return NO;
+    }
+
+    id<BBRepositoryItem> item = _entries[key];
+    NSData* data = (item != nil) ? [self encodedRecordForEntry:item] : nil;
+    if (data == nil) {
+        [entries unlockKey:key];
+        return NO;
+    }
+
+    NSError* error = nil;
+    BBRepositoryColdRecord* record = [_coldStore appendData:data metadata:[self metadataForItem:item] error:&error];
+    if (record != nil) {
+        _lazyEntries[key] = record;
+        [_entries removeObjectForKey:key];
+    } else {
+        LogError(@"[%@] Failed to evict item with key '%@' to cold store: %@",
+                 [self repositoryName], key, [error localizedDescription]);
+    }
+    [entries unlockKey:key];
+
+    return record != nil;
+}
+
+- (void)compactColdStore
+{
+    // Must be called with the eviction lock held. Live records are copied over to a new file; the old one goes away
+    // along with the last record that references it.
+    [_coldStore startNewFile];
+
+    BBConcurrentDictionary* entries = (BBConcurrentDictionary*)_entries;
+    __block NSUInteger movedCount = 0;
+    [_lazyEntries enumerateKeysAndObjectsUsingBlock:^(NSString* key, BBRepositoryIndexRecord* record, BOOL* stop) {
+        if (![record isKindOfClass:[BBRepositoryColdRecord class]]) return;
+        if ([_coldStore isRecordInCurrentFile:(BBRepositoryColdRecord*)record]) return;
+
+        // Same as when evicting, never wait for a key's lock; records that are busy are moved on the next compaction
+        if (![entries tryLockKey:key]) return;
+
+        if (_lazyEntries[key] == record) {
+            NSData* data = [record data];
+            BBRepositoryColdRecord* movedRecord = (data != nil) ?
+                                                  [_coldStore appendData:data metadata:[record metadata] error:nil] : nil;
+            if (movedRecord != nil) {
+                _lazyEntries[key] = movedRecord;
+                movedCount++;
+            }
+        }
+        [entries unlockKey:key];
+    }];
+
+    LogDebug(@"[%@] Compacted cold store, moving %u records to a new file.", [self repositoryName], movedCount);
+}
+
+- (NSArray*)allKeys
+{
+    // An item being loaded may briefly be in both
+    NSMutableSet* keys = [NSMutableSet setWithArray:[_entries allKeys]];
+    [keys addObjectsFromArray:[_lazyEntries allKeys]];
+
+    return [keys allObjects];
+}
+
+- (NSArray*)sortedKeys
+{
+    return [[self allKeys] sortedArrayUsingComparator:^NSComparisonResult(NSString* a, NSString* b) {
+        return [a compare:b options:NSLiteralSearch];
+    }];
+}
+
+- (NSArray*)itemsForKeys:(NSArray*)keys
+{
+    NSMutableArray* items = [NSMutableArray arrayWithCapacity:[keys count]];
+    for (NSString* key in keys) {
+        // May have been removed in between
+        id item = [self itemForKey:key];
+        if (item != nil) [items addObject:item];
+    }
+
+    return items;
+}
+
+- (NSDictionary*)secondaryIndexes
+{
+    pthread_mutex_lock(&_secondaryIndexesLock);
+    NSDictionary* indexes = _secondaryIndexes;
+    pthread_mutex_unlock(&_secondaryIndexesLock);
+
+    return indexes;
+}
+
+- (void)rebuildSecondaryIndexes
+{
+    NSArray* indexes = [[self secondaryIndexes] allValues];
+    if ([indexes count] == 0) return;
+
+    NSArray* items = [self allItems];
+
+    // Indexes are independent of each other, so build them all at once
+    dispatch_queue_t queue = dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0);
+    dispatch_apply([indexes count], queue, ^(size_t i) {
+        [indexes[i] rebuildWithItems:items];
+    });
+}
+
+- (BOOL)canFlush
+{
+    if (!_indexFilesUnreadable) return YES;
+
+    LogError(@"[%@] Not flushing on top of index files that failed to reload.", [self repositoryName]);
+    return NO;
+}
+
+- (BOOL)commitJournal
+{
+    // Records appended since the failed reload aren't tagged against the generation of the index files they follow
+    if (![self canFlush]) return NO;
+
+    [self willFlush];
+
+    NSUInteger pendingRecords = [_journal pendingRecordCount];
+    NSUInteger pendingLength = [_journal pendingLength];
+    NSError* error = nil;
+    if (![_journal commit:&error]) {
+        LogError(@"[%@] Failed to append records to journal while flushing: %@",
+                 [self repositoryName], [error localizedDescription]);
+        return NO;
+    }
+    [self recordStatistic:BBRepositoryStatisticBytesWritten count:pendingLength];
+
+    [self didFinishFlushing];
+    LogDebug(@"[%@] Appended %u records to journal (%u total).",
+             [self repositoryName], pendingRecords, [_journal recordCount]);
+
+    return YES;
+}
+
+- (void)lockKey:(NSString*)key
+{
+    [(BBConcurrentDictionary*)_entries lockKey:key];
+}
+
+- (void)unlockKey:(NSString*)key
+{
+    [(BBConcurrentDictionary*)_entries unlockKey:key];
+}
+
+- (void)markShardDirtyForKey:(NSString*)key
+{
+    pthread_mutex_lock(&_dirtyShardsLock);
+    [_dirtyShards addIndex:BBRepositoryShardForKey(key, _indexShardCount)];
+    pthread_mutex_unlock(&_dirtyShardsLock);
+}
+
+- (void)markShardsDirty:(NSIndexSet*)shards
+{
+    pthread_mutex_lock(&_dirtyShardsLock);
+    [_dirtyShards addIndexes:shards];
+    pthread_mutex_unlock(&_dirtyShardsLock);
+}
+
+- (void)markAllShardsDirty
+{
+    pthread_mutex_lock(&_dirtyShardsLock);
+    [_dirtyShards addIndexesInRange:NSMakeRange(0, _indexShardCount)];
+    pthread_mutex_unlock(&_dirtyShardsLock);
+}
+
+- (NSIndexSet*)takeDirtyShards
+{
+    pthread_mutex_lock(&_dirtyShardsLock);
+    NSIndexSet* dirtyShards = [_dirtyShards copy];
+    [_dirtyShards removeAllIndexes];
+    pthread_mutex_unlock(&_dirtyShardsLock);
+
+    return dirtyShards;
+}
+
+- (void)journalItem:(id<BBRepositoryItem>)item
+{
+    NSDictionary* itemAsDictionary = [self convertItemToDictionary:item];
+
+    // Items that can't be converted are never serialized, so make sure no older version survives a replay either
+    if (itemAsDictionary != nil) [_journal appendUpdateForKey:[item key] dictionary:itemAsDictionary];
+    else [_journal appendRemovalForKey:[item key]];
+}
+
 @end
@@ -0,0 +1,106 @@
+//
+// Copyright 2013 BiasedBit
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+//
+//  Created by Bruno de Carvalho (@biasedbit, http://biasedbit.com)
+//  Copyright (c) 2013 BiasedBit. All rights reserved.
+//
+
+#pragma mark -
+
+/**
+ Directory of immutable, content-addressed files holding data too large to live inside repository items.
+
+ Each blob is named after the SHA-256 digest of its contents, so storing the same bytes twice yields the same identifier
+ and a single file. Blobs are read back as memory mapped `NSData`, so reading one costs no copy and only the pages
+ actually touched are ever brought into memory.
+
+ The store keeps an in-memory count of the items referencing each blob, maintained by the repository as items are
+ added, replaced and removed. Counts only cover items touched since the store was created, so they're used as hints:
+ when one drops to zero a collection is scheduled in the background, and it's the collection that decides, by asking
+ `referencedIdentifiersBlock` for every identifier still in use, which blobs are really gone. Blobs that are
+ referenced, pinned (stored but not yet referenced by an item) or counted are never collected.
+
+ All methods are thread-safe.
+
+ @see [BBRepository storeBlob:error:]
+ */
+@interface BBRepositoryBlobStore : NSObject
+
+
+#pragma mark Creation
+
+- (instancetype)initWithPath:(NSString*)path;
+
+
+#pragma mark Properties
+
+@property(strong, nonatomic, readonly) NSString* path;
+
+/**
+ Returns the identifiers of every blob referenced by any item, loaded or not. Called in the background when collecting.
+
+ No blobs are ever collected while this is `nil`.
+ */
+@property(copy, nonatomic) NSSet* (^referencedIdentifiersBlock)(void);
+
+/** Delay between a blob losing its last known reference and the collection that follows. Defaults to 5 seconds. */
+@property(assign, nonatomic) NSTimeInterval collectionDelay;
+
+/**
+ How long a stored blob stays pinned waiting for an item to reference it. Defaults to 60 seconds.
+
+ Blobs whose pin lapsed are collected like any other unreferenced blob, so storing data for an item that's never added
+ doesn't leak its file.
+ */
+@property(assign, nonatomic) NSTimeInterval pinDuration;
+
+
+#pragma mark Interface
+
+/**
+ Writes the data to its own file, unless a blob with the same contents already exists.
+
+ The blob stays pinned, and thus safe from collection, until an item referencing it is retained or `pinDuration`
+ elapses, whichever comes first. Storing the same data again renews the pin.
+
+ @return The identifier of the blob, or `nil` if writing it failed.
+ */
+- (NSString*)storeData:(NSData*)data error:(NSError**)error;
+
+/** Maps the blob with the given identifier into memory, or returns `nil` if there's no such blob. */
+- (NSData*)dataForIdentifier:(NSString*)identifier;
+
+- (NSString*)pathForIdentifier:(NSString*)identifier;
+
+- (void)retainIdentifiers:(NSArray*)identifiers;
+
+/** Decrements the reference counts, scheduling a collection if any of them reaches zero. */
+- (void)releaseIdentifiers:(NSArray*)identifiers;
+
+- (void)collectGarbageInBackground;
+
+/**
+ Deletes every blob that isn't referenced, pinned or counted.
+
+ @return Number of blobs deleted.
+ */
+- (NSUInteger)collectGarbage;
+
+/** Forgets every count and pin. Doesn't touch the files. */
+- (void)reset;
+
+@end
@@ -0,0 +1,343 @@
+//
+// Copyright 2013 BiasedBit
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+//
+//  Created by Bruno de Carvalho (@biasedbit, http://biasedbit.com)
+//  Copyright (c) 2013 BiasedBit. All rights reserved.
+//
+
+#import "BBRepositoryBlobStore.h"
+
+#import <pthread.h>
+#import <time.h>
+
+#import "BBRepository.h"
+
+
+
+#pragma mark - Constants
+
+static const NSUInteger kBBSHA256DigestLength = 32;
+static const NSUInteger kBBSHA256BlockLength = 64;
+
+static const uint32_t kBBSHA256RoundConstants[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+
+
+#pragma mark - Utility functions
+
+static uint32_t BBSHA256RotateRight(uint32_t value, unsigned int bits)
+{
+    return (value >> bits) | (value << (32 - bits));
+}
+
+static void BBSHA256ProcessBlock(uint32_t state[8], const uint8_t* block)
+{
+    uint32_t schedule[64];
+    for (NSUInteger i = 0; i < 16; i++) {
+        schedule[i] = ((uint32_t)block[i * 4] << 24) | ((uint32_t)block[i * 4 + 1] << 16) |
+                      ((uint32_t)block[i * 4 + 2] << 8) | (uint32_t)block[i * 4 + 3];
+    }
+    for (NSUInteger i = 16; i < 64; i++) {
+        uint32_t s0 = BBSHA256RotateRight(schedule[i - 15], 7) ^ BBSHA256RotateRight(schedule[i - 15], 18) ^
+                      (schedule[i - 15] >> 3);
+        uint32_t s1 = BBSHA256RotateRight(schedule[i - 2], 17) ^ BBSHA256RotateRight(schedule[i - 2], 19) ^
+                      (schedule[i - 2] >> 10);
+        schedule[i] = schedule[i - 16] + s0 + schedule[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (NSUInteger i = 0; i < 64; i++) {
+        uint32_t s1 = BBSHA256RotateRight(e, 6) ^ BBSHA256RotateRight(e, 11) ^ BBSHA256RotateRight(e, 25);
+        uint32_t choice = (e & f) ^ (~e & g);
+        uint32_t t1 = h + s1 + choice + kBBSHA256RoundConstants[i] + schedule[i];
+        uint32_t s0 = BBSHA256RotateRight(a, 2) ^ BBSHA256RotateRight(a, 13) ^ BBSHA256RotateRight(a, 22);
+        uint32_t majority = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2 = s0 + majority;
+
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+
+    state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+    state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+}
+
+/** Plain SHA-256 (FIPS 180-4), so that blob identifiers don't depend on a platform crypto library. */
+static void BBSHA256(const uint8_t* bytes, NSUInteger length, uint8_t digest[32])
+{
+    uint32_t state[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    NSUInteger offset = 0;
+    for (; (length - offset) >= kBBSHA256BlockLength; offset += kBBSHA256BlockLength) {
+        BBSHA256ProcessBlock(state, bytes + offset);
+    }
+
+    // Pad with a single 1 bit, zeroes, and the message length in bits; that takes one or two more blocks
+    uint8_t tail[128]; // two blocks
+    memset(tail, 0, sizeof(tail));
+    NSUInteger remaining = length - offset;
+    memcpy(tail, bytes + offset, remaining);
+    tail[remaining] = 0x80;
+    NSUInteger tailLength = ((remaining + 9) > kBBSHA256BlockLength) ? sizeof(tail) : kBBSHA256BlockLength;
+    uint64_t bitLength = (uint64_t)length * 8;
+    for (NSUInteger i = 0; i < 8; i++) tail[tailLength - 1 - i] = (uint8_t)(bitLength >> (i * 8));
+
+    for (NSUInteger i = 0; i < tailLength; i += kBBSHA256BlockLength) BBSHA256ProcessBlock(state, tail + i);
+
+    for (NSUInteger i = 0; i < 8; i++) {
+        digest[i * 4] = (uint8_t)(state[i] >> 24);
+        digest[i * 4 + 1] = (uint8_t)(state[i] >> 16);
+        digest[i * 4 + 2] = (uint8_t)(state[i] >> 8);
+        digest[i * 4 + 3] = (uint8_t)state[i];
+    }
+}
+
+static NSString* BBRepositoryBlobIdentifierForData(NSData* data)
+{
+    uint8_t digest[32];
+    BBSHA256([data bytes], [data length], digest);
+
+    NSMutableString* identifier = [NSMutableString stringWithCapacity:(kBBSHA256DigestLength * 2)];
+    for (NSUInteger i = 0; i < kBBSHA256DigestLength; i++) [identifier appendFormat:@"%02x", digest[i]];
+
+    return identifier;
+}
+
+static NSTimeInterval BBRepositoryBlobMonotonicTime(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec + ((NSTimeInterval)now.tv_nsec / NSEC_PER_SEC);
+}
+
+static BOOL BBRepositoryBlobIsValidIdentifier(NSString* identifier)
+{
+    if ([identifier length] != (kBBSHA256DigestLength * 2)) return NO;
+
+    NSCharacterSet* invalid = [[NSCharacterSet characterSetWithCharactersInString:@"0123456789abcdef"] invertedSet];
+    return [identifier rangeOfCharacterFromSet:invalid].location == NSNotFound;
+}
+
+
+
+#pragma mark -
+
+@implementation BBRepositoryBlobStore
+{
+    pthread_mutex_t _lock;
+    NSMutableDictionary* _referenceCounts;
+    NSMutableDictionary* _pinExpirations; // identifier -> monotonic time at which the pin lapses
+    BOOL _collectionScheduled;
+    dispatch_queue_t _collectionQueue;
+}
+
+
+#pragma mark Creation
+
+- (instancetype)initWithPath:(NSString*)path
+{
+    self = [super init];
+    if (self != nil) {
+        pthread_mutex_init(&_lock, NULL);
+        _path = path;
+        _collectionDelay = 5;
+        _pinDuration = 60;
+        _referenceCounts = [NSMutableDictionary dictionary];
+        _pinExpirations = [NSMutableDictionary dictionary];
+        _collectionQueue = dispatch_queue_create("com.biasedbit.BBRepositoryBlobStore.collection",
+                                                 DISPATCH_QUEUE_SERIAL);
+        dispatch_set_target_queue(_collectionQueue, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0));
+    }
+
+    return self;
+}
+
+- (void)dealloc
+{
+    pthread_mutex_destroy(&_lock);
+}
+
+
+#pragma mark Interface
+
+- (NSString*)storeData:(NSData*)data error:(NSError**)error
+{
+    if (data == nil) return nil;
+
+    NSString* identifier = BBRepositoryBlobIdentifierForData(data);
+    NSString* path = [self pathForIdentifier:identifier];
+
+    // Pin it before checking, so a collection running meanwhile either deletes it before we look or leaves it alone
+    pthread_mutex_lock(&_lock);
+    _pinExpirations[identifier] = @(BBRepositoryBlobMonotonicTime() + _pinDuration);
+    BOOL exists = [[NSFileManager defaultManager] fileExistsAtPath:path];
+    pthread_mutex_unlock(&_lock);
+
+    if (exists) return identifier;
+
+    NSError* writeError = nil;
+    BOOL written = [[NSFileManager defaultManager] createDirectoryAtPath:[path stringByDeletingLastPathComponent]
+                                             withIntermediateDirectories:YES attributes:nil error:&writeError] &&
+                   [data writeToFile:path options:NSDataWritingAtomic error:&writeError];
+    if (written) return identifier;
+
+    pthread_mutex_lock(&_lock);
+    [_pinExpirations removeObjectForKey:identifier];
+    pthread_mutex_unlock(&_lock);
+
+    if (error != NULL) *error = writeError;
+
+    return nil;
+}
+
+- (NSData*)dataForIdentifier:(NSString*)identifier
+{
+    if (!BBRepositoryBlobIsValidIdentifier(identifier)) return nil;
+
+    // Files are never modified once written, and unlinking one doesn't invalidate existing mappings
+    return [NSData dataWithContentsOfFile:[self pathForIdentifier:identifier]
+                                  options:NSDataReadingMappedAlways error:nil];
+}
+
+- (NSString*)pathForIdentifier:(NSString*)identifier
+{
+    // Fan out over 256 directories so none of them ends up with an unwieldy number of files
+    NSString* directory = [_path stringByAppendingPathComponent:[identifier substringToIndex:2]];
+    return [directory stringByAppendingPathComponent:identifier];
+}
+
+- (void)retainIdentifiers:(NSArray*)identifiers
+{
+    if ([identifiers count] == 0) return;
+
+    pthread_mutex_lock(&_lock);
+    for (NSString* identifier in identifiers) {
+        _referenceCounts[identifier] = @([_referenceCounts[identifier] unsignedIntegerValue] + 1);
+        [_pinExpirations removeObjectForKey:identifier];
+    }
+    pthread_mutex_unlock(&_lock);
+}
+
+- (void)releaseIdentifiers:(NSArray*)identifiers
+{
+    if ([identifiers count] == 0) return;
+
+    BOOL unreferenced = NO;
+    pthread_mutex_lock(&_lock);
+    for (NSString* identifier in identifiers) {
+        // Items that came from disk were never retained, so a missing count means "unknown", not "zero"
+        NSUInteger count = [_referenceCounts[identifier] unsignedIntegerValue];
+        if (count > 1) {
+            _referenceCounts[identifier] = @(count - 1);
+        } else {
+            [_referenceCounts removeObjectForKey:identifier];
+            unreferenced = YES;
+        }
+    }
+    pthread_mutex_unlock(&_lock);
+
+    if (unreferenced) [self scheduleCollection];
+}
+
+- (void)collectGarbageInBackground
+{
+    dispatch_async(_collectionQueue, ^{
+        [self collectGarbage];
+    });
+}
+
+- (NSUInteger)collectGarbage
+{
+    NSSet* (^referencedIdentifiersBlock)(void) = self.referencedIdentifiersBlock;
+    if (referencedIdentifiersBlock == nil) return 0;
+
+    NSSet* referenced = referencedIdentifiersBlock();
+    if (referenced == nil) return 0;
+
+    // Pins that lapsed belong to blobs stored for items that were never added; forget them so they can go
+    pthread_mutex_lock(&_lock);
+    NSTimeInterval now = BBRepositoryBlobMonotonicTime();
+    NSSet* lapsedPins = [_pinExpirations keysOfEntriesPassingTest:^BOOL(NSString* identifier, NSNumber* expiration,
+                                                                        BOOL* stop) {
+        return [expiration doubleValue] <= now;
+    }];
+    [_pinExpirations removeObjectsForKeys:[lapsedPins allObjects]];
+    pthread_mutex_unlock(&_lock);
+
+    NSUInteger collected = 0;
+    NSFileManager* fileManager = [NSFileManager defaultManager];
+    for (NSString* relativePath in [fileManager enumeratorAtPath:_path]) {
+        NSString* identifier = [relativePath lastPathComponent];
+        if (!BBRepositoryBlobIsValidIdentifier(identifier) || [referenced containsObject:identifier]) continue;
+
+        // Check again with the lock held, it may have been stored or retained since we asked for the references
+        pthread_mutex_lock(&_lock);
+        BOOL inUse = (_pinExpirations[identifier] != nil) || (_referenceCounts[identifier] != nil);
+        if (!inUse && [fileManager removeItemAtPath:[self pathForIdentifier:identifier] error:nil]) collected++;
+        pthread_mutex_unlock(&_lock);
+    }
+
+    if (collected > 0) LogDebug(@"Collected %u unreferenced blobs from '%@'.", collected, _path);
+
+    return collected;
+}
+
+- (void)reset
+{
+    pthread_mutex_lock(&_lock);
+    [_referenceCounts removeAllObjects];
+    [_pinExpirations removeAllObjects];
+    pthread_mutex_unlock(&_lock);
+}
+
+
+#pragma mark Private helpers
+
+- (void)scheduleCollection
+{
+    // Coalesce; a burst of removals only needs one pass over the directory
+    pthread_mutex_lock(&_lock);
+    BOOL alreadyScheduled = _collectionScheduled;
+    _collectionScheduled = YES;
+    pthread_mutex_unlock(&_lock);
+
+    if (alreadyScheduled) return;
+
+    dispatch_time_t when = dispatch_time(DISPATCH_TIME_NOW, (int64_t)(_collectionDelay * NSEC_PER_SEC));
+    dispatch_after(when, _collectionQueue, ^{
+        pthread_mutex_lock(&_lock);
+        _collectionScheduled = NO;
+        pthread_mutex_unlock(&_lock);
+
+        [self collectGarbage];
+    });
+}
+
+@end
@@ -0,0 +1,96 @@
+//
+// Copyright 2013 BiasedBit
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+//
+//  Created by Bruno de Carvalho (@biasedbit, http://biasedbit.com)
+//  Copyright (c) 2013 BiasedBit. All rights reserved.
+//
+
+#import "BBRepositoryIndexFile.h"
+
+@class BBRepositoryColdStore;
+
+
+
+#pragma mark -
+
+/**
+ Reference to an item evicted to a `BBRepositoryColdStore`.
+
+ Behaves just like a record of an index file that hasn't been loaded yet, except its bytes are read from the cold store
+ file whenever they're needed rather than from a mapping. Each record keeps the file it was written to open, so it stays
+ readable after the store moves on to a new file.
+ */
+@interface BBRepositoryColdRecord : BBRepositoryIndexRecord
+@end
+
+
+
+#pragma mark -
+
+/**
+ File where a repository parks the encoded form of items it evicts from memory.
+
+ Records are appended. Evicting an item again after it's been paged back in appends a new copy, leaving the old one
+ dead; the store keeps track of how many of the file's bytes are still referenced by live records. Once dead bytes
+ outnumber live ones (`needsCompaction`), the repository starts a new file and copies the live records it still
+ references over to it. Files are unlinked as soon as they're opened, so a file's space goes back to the system as soon
+ as the last record in it is released, and nothing is left behind after a crash.
+
+ All methods are thread-safe.
+ */
+@interface BBRepositoryColdStore : NSObject
+
+
+#pragma mark Creation
+
+- (instancetype)initWithPath:(NSString*)path;
+
+
+#pragma mark Properties
+
+@property(strong, nonatomic, readonly) NSString* path;
+
+/** Size of the file records are currently appended to, including space taken by records no longer referenced. */
+@property(assign, nonatomic, readonly) unsigned long long length;
+
+/** Bytes of the current file taken by records that are still referenced. */
+@property(assign, nonatomic, readonly) unsigned long long liveLength;
+
+/** Whether enough of the current file is dead for rewriting the live records to be worth it. */
+@property(assign, nonatomic, readonly) BOOL needsCompaction;
+
+
+#pragma mark Interface
+
+/**
+ Appends an encoded item to the current file.
+
+ @return A record through which the data can be read back, or `nil` if writing failed.
+ */
+- (BBRepositoryColdRecord*)appendData:(NSData*)data metadata:(BBRepositoryItemMetadata)metadata
+                                error:(NSError**)error;
+
+/** Whether the record was appended to the current file, i.e. after the last `startNewFile` or `reset`. */
+- (BOOL)isRecordInCurrentFile:(BBRepositoryColdRecord*)record;
+
+/** Makes subsequent appends go to a new file. The old one is closed once no record references it anymore. */
+- (void)startNewFile;
+
+/** Same as `startNewFile`. Repositories call this when every record handed out so far is no longer needed. */
+- (void)reset;
+
+@end
@@ -0,0 +1,291 @@
+//
+// Copyright 2013 BiasedBit
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+//
+//  Created by Bruno de Carvalho (@biasedbit, http://biasedbit.com)
+//  Copyright (c) 2013 BiasedBit. All rights reserved.
+//
+
+#import "BBRepositoryColdStore.h"
+
+#import <fcntl.h>
+#import <pthread.h>
+#import <stdatomic.h>
+#import <unistd.h>
+
+
+
+#pragma mark - Constants
+
+/** Dead bytes below which compacting isn't worth the trouble, however small the live set. */
+static unsigned long long const kBBRepositoryColdStoreMinimumDeadLength = 4 * 1024 * 1024;
+
+
+
+#pragma mark -
+
+/** One generation of a cold store; the descriptor is closed, and the already unlinked file freed, on dealloc. */
+@interface BBRepositoryColdStoreFile : NSObject
+{
+@public
+    int _fd;
+    // Guarded by the store's lock
+    unsigned long long _length;
+    _Atomic unsigned long long _liveLength;
+}
+
+- (instancetype)initWithDescriptor:(int)fd;
+- (NSData*)dataInRange:(NSRange)range;
+
+@end
+
+@implementation BBRepositoryColdStoreFile
+
+- (instancetype)initWithDescriptor:(int)fd
+{
+    self = [super init];
+    if (self != nil) {
+        _fd = fd;
+        atomic_init(&_liveLength, 0);
+    }
+
+    return self;
+}
+
+- (void)dealloc
+{
+    close(_fd);
+}
+
+- (NSData*)dataInRange:(NSRange)range
+{
+    // The descriptor lives as long as this object, and records only ever read what was fully written before they
+    // were created, so there's nothing to lock
+    NSMutableData* data = [NSMutableData dataWithLength:range.length];
+    uint8_t* bytes = [data mutableBytes];
+    NSUInteger read = 0;
+    while (read < range.length) {
+        ssize_t chunk = pread(_fd, bytes + read, range.length - read, (off_t)(range.location + read));
+        if (chunk <= 0) break;
+
+        read += chunk;
+    }
+
+    return (read == range.length) ? data : nil;
+}
+
+@end
+
+
+
+#pragma mark -
+
+@interface BBRepositoryColdRecord ()
+
+- (instancetype)initWithFile:(BBRepositoryColdStoreFile*)file range:(NSRange)range
+                    metadata:(BBRepositoryItemMetadata)metadata;
+- (BBRepositoryColdStoreFile*)file;
+
+@end
+
+@implementation BBRepositoryColdRecord
+{
+    BBRepositoryColdStoreFile* _file;
+}
+
+
+#pragma mark Creation
+
+- (instancetype)initWithFile:(BBRepositoryColdStoreFile*)file range:(NSRange)range
+                    metadata:(BBRepositoryItemMetadata)metadata
+{
+    self = [super initWithIndexFile:nil range:range metadata:metadata];
+    if (self != nil) {
+        _file = file;
+        atomic_fetch_add(&file->_liveLength, range.length);
+    }
+
+    return self;
+}
+
+- (void)dealloc
+{
+    atomic_fetch_sub(&_file->_liveLength, [self range].length);
+}
+
+
+#pragma mark BBRepositoryIndexRecord overrides
+
+- (NSData*)data
+{
+    return [_file dataInRange:[self range]];
+}
+
+- (BOOL)hasMetadata
+{
+    // Always computed right before evicting the item
+    return YES;
+}
+
+
+#pragma mark Private helpers
+
+- (BBRepositoryColdStoreFile*)file
+{
+    return _file;
+}
+
+@end
+
+
+
+#pragma mark -
+
+@implementation BBRepositoryColdStore
+{
+    pthread_mutex_t _lock;
+    BBRepositoryColdStoreFile* _file;
+}
+
+
+#pragma mark Creation
+
+- (instancetype)initWithPath:(NSString*)path
+{
+    self = [super init];
+    if (self != nil) {
+        pthread_mutex_init(&_lock, NULL);
+        _path = path;
+    }
+
+    return self;
+}
+
+- (void)dealloc
+{
+    pthread_mutex_destroy(&_lock);
+}
+
+
+#pragma mark Properties
+
+- (unsigned long long)length
+{
+    pthread_mutex_lock(&_lock);
+    unsigned long long length = (_file != nil) ? _file->_length : 0;
+    pthread_mutex_unlock(&_lock);
+
+    return length;
+}
+
+- (unsigned long long)liveLength
+{
+    pthread_mutex_lock(&_lock);
+    unsigned long long liveLength = (_file != nil) ? atomic_load(&_file->_liveLength) : 0;
+    pthread_mutex_unlock(&_lock);
+
+    return liveLength;
+}
+
+- (BOOL)needsCompaction
+{
+    pthread_mutex_lock(&_lock);
+    BOOL needsCompaction = NO;
+    if (_file != nil) {
+        unsigned long long liveLength = MIN(atomic_load(&_file->_liveLength), _file->_length);
+        unsigned long long deadLength = _file->_length - liveLength;
+        needsCompaction = deadLength > MAX(liveLength, kBBRepositoryColdStoreMinimumDeadLength);
+    }
+    pthread_mutex_unlock(&_lock);
+
+    return needsCompaction;
+}
+
+
+#pragma mark Interface
+
+- (BBRepositoryColdRecord*)appendData:(NSData*)data metadata:(BBRepositoryItemMetadata)metadata
+                                error:(NSError**)error
+{
+    pthread_mutex_lock(&_lock);
+    if ((_file == nil) && ![self openFile:error]) {
+        pthread_mutex_unlock(&_lock);
+        return nil;
+    }
+
+    BBRepositoryColdStoreFile* file = _file;
+    unsigned long long offset = file->_length;
+    const uint8_t* bytes = [data bytes];
+    NSUInteger remaining = [data length];
+    while (remaining > 0) {
+        ssize_t written = pwrite(file->_fd, bytes, remaining, (off_t)(offset + ([data length] - remaining)));
+        if (written < 0) {
+            if (error != NULL) *error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil];
+            pthread_mutex_unlock(&_lock);
+            return nil;
+        }
+
+        bytes += written;
+        remaining -= written;
+    }
+    file->_length += [data length];
+    pthread_mutex_unlock(&_lock);
+
+    NSRange range = NSMakeRange((NSUInteger)offset, [data length]);
+    return [[BBRepositoryColdRecord alloc] initWithFile:file range:range metadata:metadata];
+}
+
+- (BOOL)isRecordInCurrentFile:(BBRepositoryColdRecord*)record
+{
+    pthread_mutex_lock(&_lock);
+    BOOL current = ([record file] == _file);
+    pthread_mutex_unlock(&_lock);
+
+    return current;
+}
+
+- (void)startNewFile
+{
+    pthread_mutex_lock(&_lock);
+    _file = nil;
+    pthread_mutex_unlock(&_lock);
+}
+
+- (void)reset
+{
+    [self startNewFile];
+}
+
+
+#pragma mark Private helpers
+
+- (BOOL)openFile:(NSError**)error
+{
+    // Must be called with the lock held. Whatever was in there belongs to a previous generation or run, and nobody
+    // reads it by path; unlinking right away ties the file's lifetime to the descriptor.
+    int fd = open([_path fileSystemRepresentation], O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        if (error != NULL) *error = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil];
+        return NO;
+    }
+    unlink([_path fileSystemRepresentation]);
+
+    _file = [[BBRepositoryColdStoreFile alloc] initWithDescriptor:fd];
+
+    return YES;
+}
+
+@end
@@ -0,0 +1,66 @@
+//
+// Copyright 2013 BiasedBit
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+//
+//  Created by Bruno de Carvalho (@biasedbit, http://biasedbit.com)
+//  Copyright (c) 2013 BiasedBit. All rights reserved.
+//
+
+#pragma mark - Constants
+
+/** Size of the blocks data is split into before compressing. Matches the window of the codec, 64KB. */
+extern NSUInteger const kBBRepositoryCompressedIndexBlockSize;
+
+
+
+#pragma mark -
+
+/**
+ Block compression for index files written in the `BBRepositoryIndexFormatCompressedPropertyList` format.
+
+ The data is split in fixed size blocks, each compressed on its own with a dependency-free implementation of the LZ4
+ block format, and framed as:
+
+    "BBRZ" <version:4> <block size:4> <block count:4> <uncompressed length:8>
+    <compressed length:4> <block 0> ... <compressed length:4> <block n-1>
+
+ Integers are big-endian. A block whose compressed length has the top bit set is stored as is, which is what happens
+ to blocks that wouldn't get any smaller. Every block but the last is `block size` bytes long once decompressed, so
+ the position of each block's output is known upfront and blocks are compressed and decompressed concurrently; the
+ framing also allows decompressing them one at a time, as they're read.
+
+ LZ4 trades ratio for speed: decompression typically runs at memory bandwidth and compression is a lot cheaper than
+ zlib, while the many repeated keys and field names in an index still shrink considerably.
+ */
+@interface BBRepositoryCompressedIndex : NSObject
+
+
+#pragma mark Interface
+
+/** Tests whether the data starts like a compressed index file. */
++ (BOOL)isCompressedData:(NSData*)data;
+
+/** Compresses the data, using every available core for large inputs. */
++ (NSData*)compressData:(NSData*)data;
+
+/**
+ Decompresses data produced by `compressData:`.
+
+ @return The original data, or `nil` if the input isn't compressed data or is corrupt.
+ */
++ (NSData*)decompressData:(NSData*)data;
+
+@end
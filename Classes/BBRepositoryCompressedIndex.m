@@ -0,0 +1,354 @@
+//
+// Copyright 2013 BiasedBit
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+//
+//  Created by Bruno de Carvalho (@biasedbit, http://biasedbit.com)
+//  Copyright (c) 2013 BiasedBit. All rights reserved.
+//
+
+#import "BBRepositoryCompressedIndex.h"
+
+
+
+#pragma mark - Constants
+
+NSUInteger const kBBRepositoryCompressedIndexBlockSize = 65536;
+
+static const char kBBRepositoryCompressedIndexMagic[4] = {'B', 'B', 'R', 'Z'};
+static const uint32_t kBBRepositoryCompressedIndexVersion = 1;
+static const NSUInteger kBBRepositoryCompressedIndexHeaderLength = 24;
+static const uint32_t kBBRepositoryCompressedIndexStoredFlag = 0x80000000;
+
+// LZ4 block format limits: matches are at least 4 bytes, reach back at most 64KB, and the last 5 bytes of a block are
+// always literals, with the last match starting at least 12 bytes before the end.
+static const NSUInteger kBBLZ4MinMatch = 4;
+static const NSUInteger kBBLZ4MaxOffset = 65535;
+static const NSUInteger kBBLZ4LastLiterals = 5;
+static const NSUInteger kBBLZ4MatchFindLimit = 12;
+static const NSUInteger kBBLZ4HashLog = 12;
+
+
+
+#pragma mark - Utility functions
+
+static uint32_t BBReadUInt32(const uint8_t* bytes)
+{
+    uint32_t value;
+    memcpy(&value, bytes, sizeof(uint32_t));
+    return CFSwapInt32BigToHost(value);
+}
+
+static uint64_t BBReadUInt64(const uint8_t* bytes)
+{
+    uint64_t value;
+    memcpy(&value, bytes, sizeof(uint64_t));
+    return CFSwapInt64BigToHost(value);
+}
+
+static void BBAppendUInt32(NSMutableData* data, uint32_t value)
+{
+    value = CFSwapInt32HostToBig(value);
+    [data appendBytes:&value length:sizeof(uint32_t)];
+}
+
+static void BBAppendUInt64(NSMutableData* data, uint64_t value)
+{
+    value = CFSwapInt64HostToBig(value);
+    [data appendBytes:&value length:sizeof(uint64_t)];
+}
+
+static uint32_t BBLZ4Read32(const uint8_t* bytes)
+{
+    uint32_t value;
+    memcpy(&value, bytes, sizeof(uint32_t));
+    return value;
+}
+
+static NSUInteger BBLZ4Hash(uint32_t sequence)
+{
+    return (sequence * 2654435761U) >> (32 - kBBLZ4HashLog);
+}
+
+static BOOL BBLZ4WriteLength(uint8_t** output, const uint8_t* outputEnd, NSUInteger length)
+{
+    // Lengths of 15 and over spill into extra bytes, 255 at a time
+    for (; length >= 255; length -= 255) {
+        if (*output >= outputEnd) return NO;
+        *(*output)++ = 255;
+    }
+    if (*output >= outputEnd) return NO;
+    *(*output)++ = (uint8_t)length;
+
+    return YES;
+}
+
+static BOOL BBLZ4WriteSequence(uint8_t** output, const uint8_t* outputEnd, const uint8_t* literals,
+                               NSUInteger literalLength, NSUInteger offset, NSUInteger matchLength)
+{
+    if (*output >= outputEnd) return NO;
+
+    // Match length 0 marks the last sequence, which only has literals
+    NSUInteger encodedMatchLength = (matchLength > 0) ? (matchLength - kBBLZ4MinMatch) : 0;
+    uint8_t* token = (*output)++;
+    *token = (uint8_t)((MIN(literalLength, (NSUInteger)15) << 4) | MIN(encodedMatchLength, (NSUInteger)15));
+    if ((literalLength >= 15) && !BBLZ4WriteLength(output, outputEnd, literalLength - 15)) return NO;
+
+    if ((NSUInteger)(outputEnd - *output) < literalLength) return NO;
+    memcpy(*output, literals, literalLength);
+    *output += literalLength;
+
+    if (matchLength == 0) return YES;
+
+    if ((outputEnd - *output) < 2) return NO;
+    *(*output)++ = (uint8_t)(offset & 0xff);
+    *(*output)++ = (uint8_t)(offset >> 8);
+    if ((encodedMatchLength >= 15) && !BBLZ4WriteLength(output, outputEnd, encodedMatchLength - 15)) return NO;
+
+    return YES;
+}
+
+/** Returns the compressed length, or 0 if the block doesn't compress to less than `capacity` bytes. */
+static NSUInteger BBLZ4CompressBlock(const uint8_t* input, NSUInteger inputLength, uint8_t* output, NSUInteger capacity)
+{
+    uint32_t table[1 << kBBLZ4HashLog];
+    memset(table, 0, sizeof(table));
+
+    uint8_t* outputCursor = output;
+    const uint8_t* outputEnd = output + capacity;
+    NSUInteger anchor = 0;
+    NSUInteger position = 0;
+
+    if (inputLength > kBBLZ4MatchFindLimit) {
+        NSUInteger matchStartLimit = inputLength - kBBLZ4MatchFindLimit;
+        NSUInteger matchEndLimit = inputLength - kBBLZ4LastLiterals;
+
+        while (position < matchStartLimit) {
+            uint32_t sequence = BBLZ4Read32(input + position);
+            NSUInteger hash = BBLZ4Hash(sequence);
+            NSUInteger candidate = table[hash];
+            table[hash] = (uint32_t)position;
+
+            if ((candidate >= position) || ((position - candidate) > kBBLZ4MaxOffset) ||
+                (BBLZ4Read32(input + candidate) != sequence)) {
+                position++;
+                continue;
+            }
+
+            NSUInteger matchLength = kBBLZ4MinMatch;
+            while (((position + matchLength) < matchEndLimit) &&
+                   (input[candidate + matchLength] == input[position + matchLength])) matchLength++;
+
+            if (!BBLZ4WriteSequence(&outputCursor, outputEnd, input + anchor, position - anchor,
+                                    position - candidate, matchLength)) return 0;
+
+            position += matchLength;
+            anchor = position;
+        }
+    }
+
+    if (!BBLZ4WriteSequence(&outputCursor, outputEnd, input + anchor, inputLength - anchor, 0, 0)) return 0;
+
+    return (NSUInteger)(outputCursor - output);
+}
+
+static BOOL BBLZ4DecompressBlock(const uint8_t* input, NSUInteger inputLength, uint8_t* output, NSUInteger outputLength)
+{
+    NSUInteger in = 0;
+    NSUInteger out = 0;
+
+    while (in < inputLength) {
+        uint8_t token = input[in++];
+
+        NSUInteger literalLength = token >> 4;
+        if (literalLength == 15) {
+            uint8_t byte;
+            do {
+                if (in >= inputLength) return NO;
+                byte = input[in++];
+                literalLength += byte;
+            } while (byte == 255);
+        }
+
+        if ((literalLength > (inputLength - in)) || (literalLength > (outputLength - out))) return NO;
+        memcpy(output + out, input + in, literalLength);
+        in += literalLength;
+        out += literalLength;
+
+        // The last sequence ends right after its literals
+        if (in == inputLength) break;
+
+        if ((inputLength - in) < 2) return NO;
+        NSUInteger offset = input[in] | ((NSUInteger)input[in + 1] << 8);
+        in += 2;
+        if ((offset == 0) || (offset > out)) return NO;
+
+        NSUInteger matchLength = token & 15;
+        if (matchLength == 15) {
+            uint8_t byte;
+            do {
+                if (in >= inputLength) return NO;
+                byte = input[in++];
+                matchLength += byte;
+            } while (byte == 255);
+        }
+        matchLength += kBBLZ4MinMatch;
+        if (matchLength > (outputLength - out)) return NO;
+
+        // Matches may overlap their own output (that's how runs are encoded), in which case copy byte by byte
+        const uint8_t* match = output + out - offset;
+        if (offset >= matchLength) {
+            memcpy(output + out, match, matchLength);
+        } else {
+            for (NSUInteger i = 0; i < matchLength; i++) output[out + i] = match[i];
+        }
+        out += matchLength;
+    }
+
+    return out == outputLength;
+}
+
+
+
+#pragma mark -
+
+@implementation BBRepositoryCompressedIndex
+
+
+#pragma mark Interface
+
++ (BOOL)isCompressedData:(NSData*)data
+{
+    if ([data length] < kBBRepositoryCompressedIndexHeaderLength) return NO;
+
+    const uint8_t* bytes = [data bytes];
+    return (memcmp(bytes, kBBRepositoryCompressedIndexMagic, 4) == 0) &&
+           (BBReadUInt32(bytes + 4) <= kBBRepositoryCompressedIndexVersion);
+}
+
++ (NSData*)compressData:(NSData*)data
+{
+    const uint8_t* bytes = [data bytes];
+    NSUInteger length = [data length];
+    NSUInteger blockSize = kBBRepositoryCompressedIndexBlockSize;
+    NSUInteger blockCount = (length + blockSize - 1) / blockSize;
+
+    uint8_t* buffers = malloc(MAX(blockCount, (NSUInteger)1) * blockSize);
+    NSUInteger* compressedLengths = calloc(MAX(blockCount, (NSUInteger)1), sizeof(NSUInteger));
+
+    void (^compressBlock)(size_t) = ^(size_t i) {
+        NSUInteger start = i * blockSize;
+        NSUInteger blockLength = MIN(blockSize, length - start);
+        // Anything that doesn't end up smaller is stored instead, so the output never grows past the block size
+        compressedLengths[i] = BBLZ4CompressBlock(bytes + start, blockLength, buffers + start, blockLength - 1);
+    };
+
+    if (blockCount > 1) dispatch_apply(blockCount, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
+                                       compressBlock);
+    else if (blockCount == 1) compressBlock(0);
+
+    NSMutableData* compressed = [NSMutableData dataWithCapacity:(kBBRepositoryCompressedIndexHeaderLength + length)];
+    [compressed appendBytes:kBBRepositoryCompressedIndexMagic length:4];
+    BBAppendUInt32(compressed, kBBRepositoryCompressedIndexVersion);
+    BBAppendUInt32(compressed, (uint32_t)blockSize);
+    BBAppendUInt32(compressed, (uint32_t)blockCount);
+    BBAppendUInt64(compressed, length);
+
+    for (NSUInteger i = 0; i < blockCount; i++) {
+        NSUInteger start = i * blockSize;
+        if (compressedLengths[i] > 0) {
+            BBAppendUInt32(compressed, (uint32_t)compressedLengths[i]);
+            [compressed appendBytes:(buffers + start) length:compressedLengths[i]];
+        } else {
+            NSUInteger blockLength = MIN(blockSize, length - start);
+            BBAppendUInt32(compressed, (uint32_t)blockLength | kBBRepositoryCompressedIndexStoredFlag);
+            [compressed appendBytes:(bytes + start) length:blockLength];
+        }
+    }
+
+    free(buffers);
+    free(compressedLengths);
+
+    return compressed;
+}
+
++ (NSData*)decompressData:(NSData*)data
+{
+    if (![self isCompressedData:data]) return nil;
+
+    const uint8_t* bytes = [data bytes];
+    NSUInteger length = [data length];
+    NSUInteger blockSize = BBReadUInt32(bytes + 8);
+    NSUInteger blockCount = BBReadUInt32(bytes + 12);
+    uint64_t decompressedLength = BBReadUInt64(bytes + 16);
+
+    // Every block has a frame header, so a count that couldn't possibly fit means the file is corrupt
+    BOOL empty = (blockCount == 0) && (decompressedLength == 0);
+    BOOL consistent = (blockSize > 0) && (blockCount > 0) &&
+                      (blockCount <= ((length - kBBRepositoryCompressedIndexHeaderLength) / 4)) &&
+                      (decompressedLength > ((uint64_t)(blockCount - 1) * blockSize)) &&
+                      (decompressedLength <= ((uint64_t)blockCount * blockSize));
+    if (!empty && !consistent) return nil;
+
+    // Walk the frames first; it's cheap and tells us where every block starts, so they can be decoded concurrently
+    NSUInteger* offsets = malloc(MAX(blockCount, (NSUInteger)1) * sizeof(NSUInteger));
+    uint32_t* lengths = malloc(MAX(blockCount, (NSUInteger)1) * sizeof(uint32_t));
+    NSUInteger offset = kBBRepositoryCompressedIndexHeaderLength;
+    BOOL valid = YES;
+    for (NSUInteger i = 0; (i < blockCount) && valid; i++) {
+        if ((length - offset) < 4) {
+            valid = NO;
+            continue;
+        }
+
+        lengths[i] = BBReadUInt32(bytes + offset);
+        offsets[i] = offset + 4;
+        offset = offsets[i] + (lengths[i] & ~kBBRepositoryCompressedIndexStoredFlag);
+        if (offset > length) valid = NO;
+    }
+
+    NSMutableData* decompressed = valid ? [NSMutableData dataWithLength:(NSUInteger)decompressedLength] : nil;
+    uint8_t* output = [decompressed mutableBytes];
+    __block BOOL corrupt = NO;
+
+    void (^decompressBlock)(size_t) = ^(size_t i) {
+        NSUInteger start = i * blockSize;
+        NSUInteger blockLength = MIN(blockSize, (NSUInteger)decompressedLength - start);
+        NSUInteger frameLength = lengths[i] & ~kBBRepositoryCompressedIndexStoredFlag;
+
+        BOOL decoded;
+        if ((lengths[i] & kBBRepositoryCompressedIndexStoredFlag) != 0) {
+            decoded = (frameLength == blockLength);
+            if (decoded) memcpy(output + start, bytes + offsets[i], blockLength);
+        } else {
+            decoded = BBLZ4DecompressBlock(bytes + offsets[i], frameLength, output + start, blockLength);
+        }
+
+        if (!decoded) corrupt = YES;
+    };
+
+    if (valid) {
+        if (blockCount > 1) dispatch_apply(blockCount, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0),
+                                           decompressBlock);
+        else if (blockCount == 1) decompressBlock(0);
+    }
+
+    free(offsets);
+    free(lengths);
+
+    return (valid && !corrupt) ? decompressed : nil;
+}
+
+@end
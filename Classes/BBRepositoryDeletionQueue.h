@@ -0,0 +1,64 @@
+//
+// Copyright 2013 BiasedBit
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+//
+//  Created by Bruno de Carvalho (@biasedbit, http://biasedbit.com)
+//  Copyright (c) 2013 BiasedBit. All rights reserved.
+//
+
+#pragma mark - Constants
+
+/** Maximum number of files deleted in a single pass, before the queue yields to other work on its target queue. */
+extern NSUInteger const kBBRepositoryDeletionQueueBatchSize;
+
+
+
+#pragma mark -
+
+/**
+ Serial queue that deletes files in the background, in batches.
+
+ Paths enqueued while a pass is pending are coalesced into that pass, so a burst of deletions (e.g. a cache evicting
+ thousands of items with companion files) costs a handful of blocks on a single background thread rather than one
+ block per file. Each pass groups its paths by directory and unlinks them relative to an open descriptor of that
+ directory; paths that can't be unlinked that way, such as directories, fall back to `NSFileManager`.
+
+ All methods are thread-safe.
+ */
+@interface BBRepositoryDeletionQueue : NSObject
+
+
+#pragma mark Creation
+
+/** The queue used by `[BBRepository deleteFileInBackground:]`. */
++ (instancetype)sharedQueue;
+
+
+#pragma mark Properties
+
+/** Number of paths enqueued but not yet deleted. */
+@property(assign, nonatomic, readonly) NSUInteger pendingCount;
+
+
+#pragma mark Interface
+
+- (void)deleteFileAtPath:(NSString*)path;
+- (void)deleteFilesAtPaths:(NSArray*)paths;
+
+/** Blocks until every path enqueued before this call has been deleted (or failed to). */
+- (void)drain;
+
+@end
@@ -0,0 +1,209 @@
+//
+// Copyright 2013 BiasedBit
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+//
+//  Created by Bruno de Carvalho (@biasedbit, http://biasedbit.com)
+//  Copyright (c) 2013 BiasedBit. All rights reserved.
+//
+
+#import "BBRepositoryDeletionQueue.h"
+
+#import <fcntl.h>
+#import <pthread.h>
+#import <unistd.h>
+
+#import "BBRepository.h"
+
+
+
+#pragma mark - Constants
+
+NSUInteger const kBBRepositoryDeletionQueueBatchSize = 1024;
+
+
+
+#pragma mark -
+
+@implementation BBRepositoryDeletionQueue
+{
+    pthread_mutex_t _lock;
+    NSMutableOrderedSet* _pendingPaths;
+    BOOL _passScheduled;
+    dispatch_queue_t _queue;
+}
+
+
+#pragma mark Creation
+
++ (instancetype)sharedQueue
+{
+    static BBRepositoryDeletionQueue* sharedQueue;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        sharedQueue = [[self alloc] init];
+    });
+
+    return sharedQueue;
+}
+
+- (instancetype)init
+{
+    self = [super init];
+    if (self != nil) {
+        pthread_mutex_init(&_lock, NULL);
+        _pendingPaths = [NSMutableOrderedSet orderedSet];
+        _queue = dispatch_queue_create("com.biasedbit.BBRepositoryDeletionQueue", DISPATCH_QUEUE_SERIAL);
+        dispatch_set_target_queue(_queue, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_BACKGROUND, 0));
+    }
+
+    return self;
+}
+
+- (void)dealloc
+{
+    pthread_mutex_destroy(&_lock);
+}
+
+
+#pragma mark Properties
+
+- (NSUInteger)pendingCount
+{
+    pthread_mutex_lock(&_lock);
+    NSUInteger pendingCount = [_pendingPaths count];
+    pthread_mutex_unlock(&_lock);
+
+    return pendingCount;
+}
+
+
+#pragma mark Interface
+
+- (void)deleteFileAtPath:(NSString*)path
+{
+    if (path == nil) return;
+
+    [self deleteFilesAtPaths:@[path]];
+}
+
+- (void)deleteFilesAtPaths:(NSArray*)paths
+{
+    if ([paths count] == 0) return;
+
+    pthread_mutex_lock(&_lock);
+    [_pendingPaths addObjectsFromArray:paths];
+    BOOL alreadyScheduled = _passScheduled;
+    _passScheduled = YES;
+    pthread_mutex_unlock(&_lock);
+
+    if (!alreadyScheduled) dispatch_async(_queue, ^{
+        [self performPass];
+    });
+}
+
+- (void)drain
+{
+    // Passes run on the same serial queue, so once this block runs everything enqueued before has been handled
+    dispatch_sync(_queue, ^{
+        while ([self deleteNextBatch]);
+    });
+}
+
+
+#pragma mark Private helpers
+
+- (void)performPass
+{
+    if ([self deleteNextBatch]) {
+        // More left; requeue rather than loop, so a huge backlog doesn't hog the thread
+        dispatch_async(_queue, ^{
+            [self performPass];
+        });
+    }
+}
+
+- (BOOL)deleteNextBatch
+{
+    pthread_mutex_lock(&_lock);
+    NSUInteger batchSize = MIN([_pendingPaths count], kBBRepositoryDeletionQueueBatchSize);
+    NSArray* batch = [[_pendingPaths array] subarrayWithRange:NSMakeRange(0, batchSize)];
+    [_pendingPaths removeObjectsInRange:NSMakeRange(0, batchSize)];
+    BOOL hasMore = ([_pendingPaths count] > 0);
+    if (!hasMore) _passScheduled = NO;
+    pthread_mutex_unlock(&_lock);
+
+    if ([batch count] == 0) return NO;
+
+    @autoreleasepool {
+        NSMutableDictionary* pathsByDirectory = [NSMutableDictionary dictionary];
+        for (NSString* path in batch) {
+            NSString* directory = [path stringByDeletingLastPathComponent];
+            NSMutableArray* names = pathsByDirectory[directory];
+            if (names == nil) {
+                names = [NSMutableArray array];
+                pathsByDirectory[directory] = names;
+            }
+            [names addObject:[path lastPathComponent]];
+        }
+
+        [pathsByDirectory enumerateKeysAndObjectsUsingBlock:^(NSString* directory, NSArray* names, BOOL* stop) {
+            [self deleteFilesNamed:names inDirectory:directory];
+        }];
+    }
+
+    return hasMore;
+}
+
+- (void)deleteFilesNamed:(NSArray*)names inDirectory:(NSString*)directory
+{
+    int directoryDescriptor = open([directory fileSystemRepresentation], O_RDONLY | O_DIRECTORY);
+    if (directoryDescriptor < 0) {
+        // Directory's gone, and the files with it
+        if (errno != ENOENT) LogError(@"Could not open '%@' to delete %lu files: %s", directory,
+                                      (unsigned long)[names count], strerror(errno));
+        return;
+    }
+
+    NSUInteger deleted = 0;
+    NSUInteger failed = 0;
+    NSString* firstFailure = nil;
+    for (NSString* name in names) {
+        if (unlinkat(directoryDescriptor, [name fileSystemRepresentation], 0) == 0) {
+            deleted++;
+            continue;
+        }
+        if (errno == ENOENT) continue;
+
+        // Most likely a directory; let NSFileManager deal with removing it recursively
+        NSError* error = nil;
+        NSString* path = [directory stringByAppendingPathComponent:name];
+        if ([[NSFileManager defaultManager] removeItemAtPath:path error:&error]) {
+            deleted++;
+        } else {
+            failed++;
+            if (firstFailure == nil) firstFailure = [NSString stringWithFormat:@"'%@': %@", path, [error description]];
+        }
+    }
+    close(directoryDescriptor);
+
+    LogTrace(@"Deleted %lu files in '%@'.", (unsigned long)deleted, directory);
+    // One line per directory rather than per file, or a failing burst floods the log
+    if (failed > 0) {
+        LogError(@"Could not delete %lu files in '%@', first was %@", (unsigned long)failed, directory, firstFailure);
+    }
+}
+
+@end
@@ -0,0 +1,154 @@
+//
+// Copyright 2013 BiasedBit
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+//
+//  Created by Bruno de Carvalho (@biasedbit, http://biasedbit.com)
+//  Copyright (c) 2013 BiasedBit. All rights reserved.
+//
+
+#import "BBRepositoryItem.h"
+
+@class BBRepositoryIndexFile;
+
+
+
+#pragma mark -
+
+/**
+ Reference to a single, still encoded, entry of a `BBRepositoryIndexFile`.
+ */
+@interface BBRepositoryIndexRecord : NSObject
+
+- (instancetype)initWithIndexFile:(BBRepositoryIndexFile*)indexFile range:(NSRange)range
+                         metadata:(BBRepositoryItemMetadata)metadata;
+
+@property(strong, nonatomic, readonly) BBRepositoryIndexFile* indexFile;
+@property(assign, nonatomic, readonly) NSRange range;
+
+/** Metadata stored alongside the record; all zeroes if the index file predates the metadata section. */
+@property(assign, nonatomic, readonly) BBRepositoryItemMetadata metadata;
+
+/** Whether `metadata` was actually read from the index file. */
+@property(assign, nonatomic, readonly) BOOL hasMetadata;
+
+/** The encoded binary property list, pointing straight into the mapped index file (no copy). */
+- (NSData*)data;
+
+/** Decodes the record into the `NSDictionary` representation of the item. */
+- (NSDictionary*)dictionary;
+
+@end
+
+
+
+#pragma mark -
+
+/**
+ Read-only, memory mapped view of an index file in the records format.
+
+ Unlike the property list format, where the whole index is a single dictionary, this format stores each entry as an
+ independent binary property list and ends with a table of keys and record offsets, followed by a dense section with
+ the metadata of each record, in the same order as the key table:
+
+    "BBRI" <version:4>
+    <record 0> <record 1> ... <record n-1>
+    n * (<offset:8> <length:4> <key length:4> <UTF-8 key>)
+    n * (<expiration timestamp:8> <resource usage:8>)
+    <table offset:8> <metadata offset:8> <checkpoint generation:8> <n:8> "BBRI"
+
+ Version 1 files lack the metadata section and the metadata offset in the trailer, and version 2 files lack the
+ checkpoint generation; both are still readable.
+
+ Opening a file only parses the key table and metadata; records are decoded on demand, straight from the mapping.
+
+ @see BBRepositoryIndexFileWriter
+ */
+@interface BBRepositoryIndexFile : NSObject
+
+
+#pragma mark Creation
+
+/**
+ Maps the file at the given path.
+
+ @return The index file, or `nil` if the file couldn't be mapped or isn't an index file in the records format.
+ */
++ (instancetype)indexFileWithContentsOfFile:(NSString*)path;
+
+/** Tests whether the data starts like an index file in the records format. */
++ (BOOL)isIndexFileData:(NSData*)data;
+
+
+#pragma mark Properties
+
+@property(strong, nonatomic, readonly) NSString* path;
+@property(assign, nonatomic, readonly) NSUInteger recordCount;
+
+/** Size of the file, in bytes. */
+@property(assign, nonatomic, readonly) NSUInteger length;
+
+/** Whether this file has a metadata section. */
+@property(assign, nonatomic, readonly) BOOL hasMetadata;
+
+/** Journal generation the file was written at; 0 if it predates checkpoint generations. */
+@property(assign, nonatomic, readonly) uint64_t checkpointGeneration;
+
+
+#pragma mark Interface
+
+- (void)enumerateRecordsUsingBlock:(void (^)(NSString* key, BBRepositoryIndexRecord* record, BOOL* stop))block;
+
+@end
+
+
+
+#pragma mark -
+
+/**
+ Streams records to a temporary file next to the destination, then writes the key table and atomically renames it
+ over the destination.
+ */
+@interface BBRepositoryIndexFileWriter : NSObject
+
+
+#pragma mark Creation
+
+- (instancetype)initWithPath:(NSString*)path;
+
+
+#pragma mark Properties
+
+@property(strong, nonatomic, readonly) NSString* path;
+@property(assign, nonatomic, readonly) NSUInteger recordCount;
+
+/** Number of bytes written to the file so far. */
+@property(assign, nonatomic, readonly) unsigned long long length;
+
+/** Journal generation stored in the trailer by `finish:`. Defaults to 0. */
+@property(assign, nonatomic) uint64_t checkpointGeneration;
+
+
+#pragma mark Interface
+
+- (BOOL)appendRecord:(NSData*)record forKey:(NSString*)key error:(NSError**)error;
+- (BOOL)appendRecord:(NSData*)record forKey:(NSString*)key metadata:(BBRepositoryItemMetadata)metadata
+               error:(NSError**)error;
+- (BOOL)finish:(NSError**)error;
+
+/** Throws away the temporary file, leaving the destination untouched. */
+- (void)abort;
+
+@end
@@ -0,0 +1,413 @@
+//
+// Copyright 2013 BiasedBit
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+//
+//  Created by Bruno de Carvalho (@biasedbit, http://biasedbit.com)
+//  Copyright (c) 2013 BiasedBit. All rights reserved.
+//
+
+#import "BBRepositoryIndexFile.h"
+
+#import <fcntl.h>
+#import <unistd.h>
+
+
+
+#pragma mark - Constants
+
+static const char kBBRepositoryIndexFileMagic[4] = {'B', 'B', 'R', 'I'};
+static const uint32_t kBBRepositoryIndexFileVersion = 3;
+static const uint32_t kBBRepositoryIndexFileMetadataVersion = 2;
+static const uint32_t kBBRepositoryIndexFileGenerationVersion = 3;
+static const NSUInteger kBBRepositoryIndexFileHeaderLength = 8;
+static const NSUInteger kBBRepositoryIndexFileV1TrailerLength = 20;
+static const NSUInteger kBBRepositoryIndexFileV2TrailerLength = 28;
+static const NSUInteger kBBRepositoryIndexFileTrailerLength = 36;
+static const NSUInteger kBBRepositoryIndexFileMetadataLength = 16;
+static const NSUInteger kBBRepositoryIndexFileWriteBufferSize = 65536;
+
+
+
+#pragma mark - Utility functions
+
+static uint32_t BBReadUInt32(const uint8_t* bytes)
+{
+    uint32_t value;
+    memcpy(&value, bytes, sizeof(uint32_t));
+    return CFSwapInt32BigToHost(value);
+}
+
+static uint64_t BBReadUInt64(const uint8_t* bytes)
+{
+    uint64_t value;
+    memcpy(&value, bytes, sizeof(uint64_t));
+    return CFSwapInt64BigToHost(value);
+}
+
+static double BBReadFloat64(const uint8_t* bytes)
+{
+    CFSwappedFloat64 value;
+    memcpy(&value, bytes, sizeof(CFSwappedFloat64));
+    return CFConvertFloat64SwappedToHost(value);
+}
+
+static void BBAppendUInt32(NSMutableData* data, uint32_t value)
+{
+    value = CFSwapInt32HostToBig(value);
+    [data appendBytes:&value length:sizeof(uint32_t)];
+}
+
+static void BBAppendUInt64(NSMutableData* data, uint64_t value)
+{
+    value = CFSwapInt64HostToBig(value);
+    [data appendBytes:&value length:sizeof(uint64_t)];
+}
+
+static void BBAppendFloat64(NSMutableData* data, double value)
+{
+    CFSwappedFloat64 swapped = CFConvertFloat64HostToSwapped(value);
+    [data appendBytes:&swapped length:sizeof(CFSwappedFloat64)];
+}
+
+
+
+#pragma mark -
+
+@interface BBRepositoryIndexFile ()
+
+@property(strong, nonatomic, readonly) NSData* data;
+
+@end
+
+
+
+#pragma mark -
+
+@implementation BBRepositoryIndexRecord
+
+
+#pragma mark Creation
+
+- (instancetype)initWithIndexFile:(BBRepositoryIndexFile*)indexFile range:(NSRange)range
+                         metadata:(BBRepositoryItemMetadata)metadata
+{
+    self = [super init];
+    if (self != nil) {
+        _indexFile = indexFile;
+        _range = range;
+        _metadata = metadata;
+    }
+
+    return self;
+}
+
+
+#pragma mark Properties
+
+- (BOOL)hasMetadata
+{
+    return [_indexFile hasMetadata];
+}
+
+
+#pragma mark Interface
+
+- (NSData*)data
+{
+    // The subdata keeps the mapping alive for as long as the caller holds it, even past the record and the index file
+    return [[_indexFile data] subdataWithRange:_range];
+}
+
+- (NSDictionary*)dictionary
+{
+    NSDictionary* dictionary = [NSPropertyListSerialization propertyListWithData:[self data]
+                                                                         options:NSPropertyListImmutable
+                                                                          format:NULL error:nil];
+    if (![dictionary isKindOfClass:[NSDictionary class]]) return nil;
+
+    return dictionary;
+}
+
+@end
+
+
+
+#pragma mark -
+
+@implementation BBRepositoryIndexFile
+{
+    NSUInteger _tableOffset;
+    NSUInteger _tableEnd;
+    NSUInteger _metadataOffset;
+}
+
+
+#pragma mark Creation
+
++ (instancetype)indexFileWithContentsOfFile:(NSString*)path
+{
+    NSData* data = [NSData dataWithContentsOfFile:path options:NSDataReadingMappedAlways error:nil];
+    if (![self isIndexFileData:data]) return nil;
+
+    uint32_t version = BBReadUInt32((const uint8_t*)[data bytes] + 4);
+    BOOL hasMetadata = version >= kBBRepositoryIndexFileMetadataVersion;
+    BOOL hasGeneration = version >= kBBRepositoryIndexFileGenerationVersion;
+    NSUInteger trailerLength = hasGeneration ? kBBRepositoryIndexFileTrailerLength :
+                               hasMetadata ? kBBRepositoryIndexFileV2TrailerLength :
+                               kBBRepositoryIndexFileV1TrailerLength;
+
+    NSUInteger length = [data length];
+    if (length < (kBBRepositoryIndexFileHeaderLength + trailerLength)) return nil;
+
+    const uint8_t* trailer = (const uint8_t*)[data bytes] + length - trailerLength;
+    if (memcmp(trailer + trailerLength - 4, kBBRepositoryIndexFileMagic, 4) != 0) return nil;
+
+    uint64_t tableOffset = BBReadUInt64(trailer);
+    uint64_t metadataOffset = hasMetadata ? BBReadUInt64(trailer + 8) : (length - trailerLength);
+    uint64_t recordCount = BBReadUInt64(trailer + trailerLength - 12);
+    uint64_t checkpointGeneration = hasGeneration ? BBReadUInt64(trailer + 16) : 0;
+    if ((tableOffset < kBBRepositoryIndexFileHeaderLength) || (tableOffset > metadataOffset) ||
+        (metadataOffset > (length - trailerLength))) return nil;
+
+    // The metadata section has a fixed size; if it doesn't fit, the file is corrupt
+    if (hasMetadata && ((length - trailerLength - metadataOffset) != (recordCount * kBBRepositoryIndexFileMetadataLength))) {
+        return nil;
+    }
+
+    return [[self alloc] initWithPath:path data:data tableOffset:(NSUInteger)tableOffset
+                       metadataOffset:(NSUInteger)metadataOffset recordCount:(NSUInteger)recordCount
+                          hasMetadata:hasMetadata checkpointGeneration:checkpointGeneration];
+}
+
++ (BOOL)isIndexFileData:(NSData*)data
+{
+    if ([data length] < kBBRepositoryIndexFileHeaderLength) return NO;
+
+    const uint8_t* bytes = [data bytes];
+    return (memcmp(bytes, kBBRepositoryIndexFileMagic, 4) == 0) && (BBReadUInt32(bytes + 4) <= kBBRepositoryIndexFileVersion);
+}
+
+- (instancetype)initWithPath:(NSString*)path data:(NSData*)data tableOffset:(NSUInteger)tableOffset
+              metadataOffset:(NSUInteger)metadataOffset recordCount:(NSUInteger)recordCount
+                 hasMetadata:(BOOL)hasMetadata checkpointGeneration:(uint64_t)checkpointGeneration
+{
+    self = [super init];
+    if (self != nil) {
+        _path = path;
+        _data = data;
+        _tableOffset = tableOffset;
+        _tableEnd = metadataOffset;
+        _metadataOffset = metadataOffset;
+        _recordCount = recordCount;
+        _hasMetadata = hasMetadata;
+        _checkpointGeneration = checkpointGeneration;
+    }
+
+    return self;
+}
+
+
+#pragma mark Properties
+
+- (NSUInteger)length
+{
+    return [_data length];
+}
+
+
+#pragma mark Interface
+
+- (void)enumerateRecordsUsingBlock:(void (^)(NSString* key, BBRepositoryIndexRecord* record, BOOL* stop))block
+{
+    const uint8_t* bytes = [_data bytes];
+    NSUInteger tableEnd = _tableEnd;
+    NSUInteger offset = _tableOffset;
+    BOOL stop = NO;
+
+    for (NSUInteger i = 0; (i < _recordCount) && !stop; i++) {
+        if ((offset + 16) > tableEnd) break;
+
+        uint64_t recordOffset = BBReadUInt64(bytes + offset);
+        uint32_t recordLength = BBReadUInt32(bytes + offset + 8);
+        uint32_t keyLength = BBReadUInt32(bytes + offset + 12);
+        offset += 16;
+
+        if (((offset + keyLength) > tableEnd) || ((recordOffset + recordLength) > _tableOffset)) break;
+
+        NSString* key = [[NSString alloc] initWithBytes:(bytes + offset) length:keyLength
+                                               encoding:NSUTF8StringEncoding];
+        offset += keyLength;
+        if (key == nil) continue;
+
+        BBRepositoryItemMetadata metadata = {0, 0};
+        if (_hasMetadata) {
+            const uint8_t* metadataBytes = bytes + _metadataOffset + (i * kBBRepositoryIndexFileMetadataLength);
+            metadata.expirationTimestamp = BBReadFloat64(metadataBytes);
+            metadata.resourceUsage = BBReadFloat64(metadataBytes + 8);
+        }
+
+        NSRange range = NSMakeRange((NSUInteger)recordOffset, recordLength);
+        block(key, [[BBRepositoryIndexRecord alloc] initWithIndexFile:self range:range metadata:metadata], &stop);
+    }
+}
+
+@end
+
+
+
+#pragma mark -
+
+@implementation BBRepositoryIndexFileWriter
+{
+    NSString* _temporaryPath;
+    int _fd;
+    NSMutableData* _buffer;
+    NSMutableData* _table;
+    NSMutableData* _metadata;
+    uint64_t _offset;
+}
+
+
+#pragma mark Creation
+
+- (instancetype)initWithPath:(NSString*)path
+{
+    self = [super init];
+    if (self != nil) {
+        _path = path;
+        _temporaryPath = [path stringByAppendingFormat:@".%u.tmp", (unsigned int)getpid()];
+        _fd = -1;
+        _buffer = [NSMutableData dataWithCapacity:kBBRepositoryIndexFileWriteBufferSize];
+        _table = [NSMutableData data];
+        _metadata = [NSMutableData data];
+
+        uint32_t version = CFSwapInt32HostToBig(kBBRepositoryIndexFileVersion);
+        [_buffer appendBytes:kBBRepositoryIndexFileMagic length:4];
+        [_buffer appendBytes:&version length:sizeof(uint32_t)];
+        _offset = kBBRepositoryIndexFileHeaderLength;
+    }
+
+    return self;
+}
+
+- (void)dealloc
+{
+    if (_fd >= 0) [self abort];
+}
+
+
+#pragma mark Interface
+
+- (BOOL)appendRecord:(NSData*)record forKey:(NSString*)key error:(NSError**)error
+{
+    BBRepositoryItemMetadata metadata = {0, 0};
+    return [self appendRecord:record forKey:key metadata:metadata error:error];
+}
+
+- (BOOL)appendRecord:(NSData*)record forKey:(NSString*)key metadata:(BBRepositoryItemMetadata)metadata
+               error:(NSError**)error
+{
+    NSData* keyData = [key dataUsingEncoding:NSUTF8StringEncoding];
+
+    BBAppendUInt64(_table, _offset);
+    BBAppendUInt32(_table, (uint32_t)[record length]);
+    BBAppendUInt32(_table, (uint32_t)[keyData length]);
+    [_table appendData:keyData];
+
+    BBAppendFloat64(_metadata, metadata.expirationTimestamp);
+    BBAppendFloat64(_metadata, metadata.resourceUsage);
+
+    [_buffer appendData:record];
+    _offset += [record length];
+    _recordCount++;
+
+    if ([_buffer length] < kBBRepositoryIndexFileWriteBufferSize) return YES;
+
+    return [self writeBuffer:error];
+}
+
+- (BOOL)finish:(NSError**)error
+{
+    // Key table and metadata go at the end, so records can be streamed out before we know every key.
+    uint64_t metadataOffset = _offset + [_table length];
+    [_table appendData:_metadata];
+    BBAppendUInt64(_table, _offset);
+    BBAppendUInt64(_table, metadataOffset);
+    BBAppendUInt64(_table, _checkpointGeneration);
+    BBAppendUInt64(_table, _recordCount);
+    [_table appendBytes:kBBRepositoryIndexFileMagic length:4];
+    [_buffer appendData:_table];
+
+    if (![self writeBuffer:error]) return NO;
+
+    if (fsync(_fd) != 0) return [self failWithPOSIXError:error];
+
+    close(_fd);
+    _fd = -1;
+
+    if (rename([_temporaryPath fileSystemRepresentation], [_path fileSystemRepresentation]) != 0) {
+        return [self failWithPOSIXError:error];
+    }
+
+    return YES;
+}
+
+- (void)abort
+{
+    if (_fd >= 0) close(_fd);
+    _fd = -1;
+
+    unlink([_temporaryPath fileSystemRepresentation]);
+}
+
+
+#pragma mark Private helpers
+
+- (BOOL)writeBuffer:(NSError**)error
+{
+    if (_fd < 0) {
+        _fd = open([_temporaryPath fileSystemRepresentation], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (_fd < 0) return [self failWithPOSIXError:error];
+    }
+
+    const uint8_t* bytes = [_buffer bytes];
+    NSUInteger remaining = [_buffer length];
+    while (remaining > 0) {
+        ssize_t written = write(_fd, bytes, remaining);
+        if (written < 0) return [self failWithPOSIXError:error];
+
+        bytes += written;
+        remaining -= written;
+        _length += written;
+    }
+
+    [_buffer setLength:0];
+
+    return YES;
+}
+
+- (BOOL)failWithPOSIXError:(NSError**)error
+{
+    // Grab errno before cleaning up gets a chance to clobber it
+    int code = errno;
+    [self abort];
+
+    if (error != NULL) *error = [NSError errorWithDomain:NSPOSIXErrorDomain code:code userInfo:nil];
+
+    return NO;
+}
+
+@end
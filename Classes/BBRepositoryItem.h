@@ -19,6 +19,23 @@
 //  Copyright (c) 2013 BiasedBit. All rights reserved.
 //
 
+#pragma mark - Types
+
+/**
+ Summary of an item that the repository can keep around without the item itself, so that compaction, eviction and
+ usage accounting don't require items to be loaded.
+
+ @see [BBRepository metadataForItem:]
+ */
+typedef struct {
+    /** Instant after which the item may be purged, as seconds since the reference date, or `0` if it never expires. */
+    NSTimeInterval expirationTimestamp;
+    /** Amount of whatever resource the item uses, in whatever unit its repository caps on. */
+    double resourceUsage;
+} BBRepositoryItemMetadata;
+
+
+
 #pragma mark -
 
 /**
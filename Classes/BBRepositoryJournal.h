@@ -0,0 +1,118 @@
+//
+// Copyright 2013 BiasedBit
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+//
+//  Created by Bruno de Carvalho (@biasedbit, http://biasedbit.com)
+//  Copyright (c) 2013 BiasedBit. All rights reserved.
+//
+
+#pragma mark -
+
+/**
+ Append-only log of changes made to a repository since its index file was last written.
+
+ Each record is a 4 byte big-endian length followed by a binary property list array. Updates are stored as
+ `@[generation, key, dictionary]` and removals as `@[generation, key]`; records written before generations were
+ introduced lack the leading number and count as generation 0.
+
+ The generation is a checkpoint sequence number. Every checkpoint bumps it, and index files are tagged with the
+ generation they were written at, so that a crash between writing the index and discarding the journal doesn't replay
+ records the index already covers (see `replayOntoEntries:checkpointForKey:`).
+
+ Records are buffered in memory as they're appended and only hit the disk on `commit:`, which makes flushing a
+ journaled repository cost proportional to the number of changes rather than to the number of entries.
+
+ Appending is thread-safe. Committing, replaying and checkpointing must be serialized by the caller.
+
+ @see [BBRepository journaled]
+ */
+@interface BBRepositoryJournal : NSObject
+
+
+#pragma mark Creation
+
+- (instancetype)initWithPath:(NSString*)path;
+
+
+#pragma mark Properties
+
+@property(strong, nonatomic, readonly) NSString* path;
+
+/** Number of records in the journal, both committed to disk and still buffered in memory. */
+@property(assign, nonatomic, readonly) NSUInteger recordCount;
+
+/** Number of records appended since the last `commit:`. */
+@property(assign, nonatomic, readonly) NSUInteger pendingRecordCount;
+
+/** Number of bytes the records appended since the last `commit:` take. */
+@property(assign, nonatomic, readonly) NSUInteger pendingLength;
+
+/** Generation new records are tagged with. Only ever grows; set on reload to that of the newest index file. */
+@property(assign, nonatomic) uint64_t generation;
+
+
+#pragma mark Interface
+
+- (void)appendUpdateForKey:(NSString*)key dictionary:(NSDictionary*)dictionary;
+- (void)appendRemovalForKey:(NSString*)key;
+
+/**
+ Writes all buffered records to the end of the journal file and syncs it to disk.
+
+ @param error Set to the cause of failure if this method returns `NO`.
+
+ @return `YES` if the buffered records are now durable, `NO` otherwise.
+ */
+- (BOOL)commit:(NSError**)error;
+
+/**
+ Applies the records in the journal file, in order, to the given dictionary of serialized entries.
+
+ Records older than the index file their key belongs to, i.e. whose generation is lower than the one the file was
+ written at, are already covered by it and skipped. Afterwards, `generation` is at least that of the newest record.
+
+ A partially written record at the tail of the file (e.g. after a crash during `commit:`) is discarded and the file is
+ truncated back to the last complete record so that subsequent appends remain readable.
+
+ @param entries The `NSDictionary` representations of the entries read from the index file, keyed by item key.
+ @param checkpointForKey Returns the generation of the index file the given key belongs to; 0 if it predates them.
+
+ @return Number of records applied.
+ */
+- (NSUInteger)replayOntoEntries:(NSMutableDictionary*)entries
+               checkpointForKey:(uint64_t (^)(NSString* key))checkpointForKey;
+
+/**
+ Marks the records appended so far as about to be folded into the index file, and starts a new generation.
+
+ Must be called before taking the snapshot of the entries that will be written to the index file.
+
+ @return The generation the index file must be tagged with. Every record appended so far is older than it.
+ */
+- (uint64_t)beginCheckpoint;
+
+/**
+ Discards every record appended up until `beginCheckpoint`, both buffered and on disk.
+
+ Called after the repository's index file has been fully rewritten. Records appended after `beginCheckpoint` was called
+ are kept in the buffer, to be written on the next `commit:`.
+ */
+- (BOOL)completeCheckpoint;
+
+/** Discards every record, both buffered and on disk. */
+- (BOOL)reset;
+
+@end
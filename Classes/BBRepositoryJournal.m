@@ -0,0 +1,325 @@
+//
+// Copyright 2013 BiasedBit
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+//
+//  Created by Bruno de Carvalho (@biasedbit, http://biasedbit.com)
+//  Copyright (c) 2013 BiasedBit. All rights reserved.
+//
+
+#import "BBRepositoryJournal.h"
+
+#import <fcntl.h>
+#import <pthread.h>
+#import <unistd.h>
+
+
+
+#pragma mark -
+
+@implementation BBRepositoryJournal
+{
+    pthread_mutex_t _lock;
+    NSMutableData* _buffer;
+    NSUInteger _committedRecordCount;
+    NSUInteger _pendingRecordCount;
+    NSUInteger _checkpointBufferLength;
+    NSUInteger _checkpointPendingRecordCount;
+    uint64_t _generation;
+}
+
+
+#pragma mark Creation
+
+- (instancetype)initWithPath:(NSString*)path
+{
+    self = [super init];
+    if (self != nil) {
+        pthread_mutex_init(&_lock, NULL);
+        _path = path;
+        _buffer = [NSMutableData data];
+    }
+
+    return self;
+}
+
+- (void)dealloc
+{
+    pthread_mutex_destroy(&_lock);
+}
+
+
+#pragma mark Properties
+
+- (NSUInteger)recordCount
+{
+    pthread_mutex_lock(&_lock);
+    NSUInteger recordCount = _committedRecordCount + _pendingRecordCount;
+    pthread_mutex_unlock(&_lock);
+
+    return recordCount;
+}
+
+- (NSUInteger)pendingRecordCount
+{
+    pthread_mutex_lock(&_lock);
+    NSUInteger pendingRecordCount = _pendingRecordCount;
+    pthread_mutex_unlock(&_lock);
+
+    return pendingRecordCount;
+}
+
+- (NSUInteger)pendingLength
+{
+    pthread_mutex_lock(&_lock);
+    NSUInteger pendingLength = [_buffer length];
+    pthread_mutex_unlock(&_lock);
+
+    return pendingLength;
+}
+
+
+- (uint64_t)generation
+{
+    pthread_mutex_lock(&_lock);
+    uint64_t generation = _generation;
+    pthread_mutex_unlock(&_lock);
+
+    return generation;
+}
+
+- (void)setGeneration:(uint64_t)generation
+{
+    pthread_mutex_lock(&_lock);
+    _generation = MAX(_generation, generation);
+    pthread_mutex_unlock(&_lock);
+}
+
+
+#pragma mark Interface
+
+- (void)appendUpdateForKey:(NSString*)key dictionary:(NSDictionary*)dictionary
+{
+    [self appendRecordWithKey:key dictionary:dictionary];
+}
+
+- (void)appendRemovalForKey:(NSString*)key
+{
+    [self appendRecordWithKey:key dictionary:nil];
+}
+
+- (BOOL)commit:(NSError**)error
+{
+    // Take the buffered records and let appends carry on while we write them out
+    pthread_mutex_lock(&_lock);
+    NSData* records = [_buffer copy];
+    NSUInteger recordCount = _pendingRecordCount;
+    [_buffer setLength:0];
+    _pendingRecordCount = 0;
+    _checkpointBufferLength = 0;
+    _checkpointPendingRecordCount = 0;
+    pthread_mutex_unlock(&_lock);
+
+    if (recordCount == 0) return YES;
+
+    if ([self writeRecords:records error:error]) {
+        pthread_mutex_lock(&_lock);
+        _committedRecordCount += recordCount;
+        pthread_mutex_unlock(&_lock);
+
+        return YES;
+    }
+
+    // Put them back in front of whatever was appended meanwhile, so they're retried on the next commit
+    pthread_mutex_lock(&_lock);
+    NSMutableData* buffer = [records mutableCopy];
+    [buffer appendData:_buffer];
+    _buffer = buffer;
+    _pendingRecordCount += recordCount;
+    pthread_mutex_unlock(&_lock);
+
+    return NO;
+}
+
+- (NSUInteger)replayOntoEntries:(NSMutableDictionary*)entries
+               checkpointForKey:(uint64_t (^)(NSString* key))checkpointForKey
+{
+    NSData* data = [NSData dataWithContentsOfFile:_path options:NSDataReadingMappedIfSafe error:nil];
+    if (data == nil) return 0;
+
+    const uint8_t* bytes = [data bytes];
+    NSUInteger length = [data length];
+    NSUInteger offset = 0;
+    NSUInteger valid = 0;
+    NSUInteger applied = 0;
+    uint64_t newestGeneration = 0;
+
+    while ((offset + sizeof(uint32_t)) <= length) {
+        uint32_t recordLength;
+        memcpy(&recordLength, bytes + offset, sizeof(uint32_t));
+        recordLength = CFSwapInt32BigToHost(recordLength);
+
+        NSUInteger recordStart = offset + sizeof(uint32_t);
+        if ((recordStart + recordLength) > length) break;
+
+        NSData* recordData = [data subdataWithRange:NSMakeRange(recordStart, recordLength)];
+        NSArray* record = [NSPropertyListSerialization propertyListWithData:recordData
+                                                                    options:NSPropertyListImmutable
+                                                                     format:NULL error:nil];
+        if (![record isKindOfClass:[NSArray class]] || [record count] == 0) break;
+
+        // Records from before generations were introduced start right away with the key
+        uint64_t generation = 0;
+        if ([record[0] isKindOfClass:[NSNumber class]]) {
+            generation = [record[0] unsignedLongLongValue];
+            record = [record subarrayWithRange:NSMakeRange(1, [record count] - 1)];
+            if ([record count] == 0) break;
+        }
+        newestGeneration = MAX(newestGeneration, generation);
+        valid++;
+        offset = recordStart + recordLength;
+
+        // Already in the index file, which may be newer than the rest of the journal if we crashed mid-checkpoint
+        if (generation < checkpointForKey(record[0])) continue;
+
+        if ([record count] == 1) [entries removeObjectForKey:record[0]];
+        else entries[record[0]] = record[1];
+
+        applied++;
+    }
+
+    // Chop off whatever garbage a crash mid-commit may have left behind so new records are appended after valid ones.
+    if (offset < length) truncate([_path fileSystemRepresentation], (off_t)offset);
+
+    pthread_mutex_lock(&_lock);
+    _committedRecordCount = valid;
+    _generation = MAX(_generation, newestGeneration);
+    _pendingRecordCount = 0;
+    _checkpointBufferLength = 0;
+    _checkpointPendingRecordCount = 0;
+    [_buffer setLength:0];
+    pthread_mutex_unlock(&_lock);
+
+    return applied;
+}
+
+- (uint64_t)beginCheckpoint
+{
+    pthread_mutex_lock(&_lock);
+    _checkpointBufferLength = [_buffer length];
+    _checkpointPendingRecordCount = _pendingRecordCount;
+    uint64_t generation = ++_generation;
+    pthread_mutex_unlock(&_lock);
+
+    return generation;
+}
+
+- (BOOL)completeCheckpoint
+{
+    pthread_mutex_lock(&_lock);
+    [_buffer replaceBytesInRange:NSMakeRange(0, _checkpointBufferLength) withBytes:NULL length:0];
+    _pendingRecordCount -= _checkpointPendingRecordCount;
+    _committedRecordCount = 0;
+    _checkpointBufferLength = 0;
+    _checkpointPendingRecordCount = 0;
+    pthread_mutex_unlock(&_lock);
+
+    return [self removeFile];
+}
+
+- (BOOL)reset
+{
+    pthread_mutex_lock(&_lock);
+    _committedRecordCount = 0;
+    _pendingRecordCount = 0;
+    _checkpointBufferLength = 0;
+    _checkpointPendingRecordCount = 0;
+    [_buffer setLength:0];
+    pthread_mutex_unlock(&_lock);
+
+    return [self removeFile];
+}
+
+
+#pragma mark Private helpers
+
+- (void)appendRecordWithKey:(NSString*)key dictionary:(NSDictionary*)dictionary
+{
+    // Callers make the change visible before journaling it, so a record tagged with the generation from before a
+    // checkpoint began describes a change that checkpoint's snapshot includes, even if it's buffered after it
+    NSNumber* generation = @([self generation]);
+    NSArray* record = (dictionary != nil) ? @[generation, key, dictionary] : @[generation, key];
+    NSData* recordData = [NSPropertyListSerialization dataWithPropertyList:record
+                                                                    format:NSPropertyListBinaryFormat_v1_0
+                                                                   options:0 error:nil];
+    if (recordData == nil) return;
+
+    uint32_t recordLength = CFSwapInt32HostToBig((uint32_t)[recordData length]);
+
+    pthread_mutex_lock(&_lock);
+    [_buffer appendBytes:&recordLength length:sizeof(uint32_t)];
+    [_buffer appendData:recordData];
+    _pendingRecordCount++;
+    pthread_mutex_unlock(&_lock);
+}
+
+- (BOOL)writeRecords:(NSData*)records error:(NSError**)error
+{
+    int fd = open([_path fileSystemRepresentation], O_WRONLY | O_APPEND | O_CREAT, 0644);
+    if (fd < 0) return [self failWithPOSIXError:error closingDescriptor:-1];
+
+    // Remember where the valid records end so a failed write doesn't leave half a record in the middle of the log
+    off_t validLength = lseek(fd, 0, SEEK_END);
+
+    const uint8_t* bytes = [records bytes];
+    NSUInteger remaining = [records length];
+    while (remaining > 0) {
+        ssize_t written = write(fd, bytes, remaining);
+        if (written < 0) {
+            int code = errno;
+            ftruncate(fd, validLength);
+            errno = code;
+            return [self failWithPOSIXError:error closingDescriptor:fd];
+        }
+
+        bytes += written;
+        remaining -= written;
+    }
+
+    if (fsync(fd) != 0) return [self failWithPOSIXError:error closingDescriptor:fd];
+    close(fd);
+
+    return YES;
+}
+
+- (BOOL)removeFile
+{
+    if (![[NSFileManager defaultManager] fileExistsAtPath:_path]) return YES;
+
+    return [[NSFileManager defaultManager] removeItemAtPath:_path error:nil];
+}
+
+- (BOOL)failWithPOSIXError:(NSError**)error closingDescriptor:(int)fd
+{
+    // Grab errno before close() gets a chance to clobber it
+    int code = errno;
+    if (fd >= 0) close(fd);
+
+    if (error != NULL) *error = [NSError errorWithDomain:NSPOSIXErrorDomain code:code userInfo:nil];
+
+    return NO;
+}
+
+@end
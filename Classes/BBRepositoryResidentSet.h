@@ -0,0 +1,57 @@
+//
+// Copyright 2013 BiasedBit
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+//
+//  Created by Bruno de Carvalho (@biasedbit, http://biasedbit.com)
+//  Copyright (c) 2013 BiasedBit. All rights reserved.
+//
+
+#pragma mark -
+
+/**
+ Keeps track of which items a tiered repository holds in memory, and picks which ones to evict using the CLOCK
+ algorithm, an approximation of LRU where recording an access is a single bit flip.
+
+ All methods are thread-safe.
+
+ @see [BBRepository maximumResidentItemCount]
+ */
+@interface BBRepositoryResidentSet : NSObject
+
+
+#pragma mark Properties
+
+@property(assign, nonatomic, readonly) NSUInteger count;
+
+/** Sum of the cost of every key in the set. */
+@property(assign, nonatomic, readonly) double totalCost;
+
+
+#pragma mark Interface
+
+/** Adds a key, or updates its cost if it's already in the set. Either way, the key is marked as recently accessed. */
+- (void)addKey:(NSString*)key cost:(double)cost;
+- (void)removeKey:(NSString*)key;
+
+/** Marks a key as recently accessed, giving it a second chance the next time the clock hand goes over it. */
+- (void)touchKey:(NSString*)key;
+
+/** Removes and returns the next key to evict, or `nil` if the set is empty. */
+- (NSString*)popVictim;
+
+- (void)removeAllKeys;
+
+@end
@@ -0,0 +1,195 @@
+//
+// Copyright 2013 BiasedBit
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+//
+//  Created by Bruno de Carvalho (@biasedbit, http://biasedbit.com)
+//  Copyright (c) 2013 BiasedBit. All rights reserved.
+//
+
+#import "BBRepositoryResidentSet.h"
+
+#import <pthread.h>
+
+
+
+#pragma mark -
+
+@implementation BBRepositoryResidentSet
+{
+    pthread_mutex_t _lock;
+    // The clock: a ring of slots, each either a key or NSNull if freed, plus a reference bit per slot
+    NSMutableArray* _slots;
+    uint8_t* _referenced;
+    NSUInteger _capacity;
+    NSUInteger _hand;
+    NSMutableIndexSet* _freeSlots;
+    NSMutableDictionary* _slotsByKey;
+    NSMutableDictionary* _costsByKey;
+    double _totalCost;
+}
+
+
+#pragma mark Creation
+
+- (instancetype)init
+{
+    self = [super init];
+    if (self != nil) {
+        pthread_mutex_init(&_lock, NULL);
+        _capacity = 64;
+        _referenced = calloc(_capacity, sizeof(uint8_t));
+        [self setupSlots];
+    }
+
+    return self;
+}
+
+- (void)dealloc
+{
+    free(_referenced);
+    pthread_mutex_destroy(&_lock);
+}
+
+
+#pragma mark Properties
+
+- (NSUInteger)count
+{
+    pthread_mutex_lock(&_lock);
+    NSUInteger count = [_slotsByKey count];
+    pthread_mutex_unlock(&_lock);
+
+    return count;
+}
+
+- (double)totalCost
+{
+    pthread_mutex_lock(&_lock);
+    double totalCost = _totalCost;
+    pthread_mutex_unlock(&_lock);
+
+    return totalCost;
+}
+
+
+#pragma mark Interface
+
+- (void)addKey:(NSString*)key cost:(double)cost
+{
+    pthread_mutex_lock(&_lock);
+    NSNumber* slot = _slotsByKey[key];
+    if (slot == nil) {
+        NSUInteger index = [_freeSlots firstIndex];
+        if (index != NSNotFound) {
+            [_freeSlots removeIndex:index];
+            _slots[index] = key;
+        } else {
+            index = [_slots count];
+            if (index == _capacity) {
+                _capacity *= 2;
+                _referenced = realloc(_referenced, _capacity * sizeof(uint8_t));
+            }
+            [_slots addObject:key];
+        }
+
+        slot = @(index);
+        _slotsByKey[key] = slot;
+    }
+
+    _referenced[[slot unsignedIntegerValue]] = 1;
+    _totalCost += cost - [_costsByKey[key] doubleValue];
+    if (cost != 0) _costsByKey[key] = @(cost);
+    else [_costsByKey removeObjectForKey:key];
+    pthread_mutex_unlock(&_lock);
+}
+
+- (void)removeKey:(NSString*)key
+{
+    pthread_mutex_lock(&_lock);
+    [self removeKeyLocked:key];
+    pthread_mutex_unlock(&_lock);
+}
+
+- (void)touchKey:(NSString*)key
+{
+    pthread_mutex_lock(&_lock);
+    NSNumber* slot = _slotsByKey[key];
+    if (slot != nil) _referenced[[slot unsignedIntegerValue]] = 1;
+    pthread_mutex_unlock(&_lock);
+}
+
+- (NSString*)popVictim
+{
+    pthread_mutex_lock(&_lock);
+    NSString* victim = nil;
+    NSUInteger slotCount = [_slots count];
+    // Two full turns are enough: the first one clears every reference bit
+    for (NSUInteger steps = 0; (steps < (2 * slotCount)) && ([_slotsByKey count] > 0); steps++) {
+        if (_hand >= slotCount) _hand = 0;
+
+        NSUInteger index = _hand++;
+        id key = _slots[index];
+        if (key == [NSNull null]) continue;
+
+        if (_referenced[index]) {
+            _referenced[index] = 0;
+        } else {
+            victim = key;
+            [self removeKeyLocked:victim];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&_lock);
+
+    return victim;
+}
+
+- (void)removeAllKeys
+{
+    pthread_mutex_lock(&_lock);
+    [self setupSlots];
+    pthread_mutex_unlock(&_lock);
+}
+
+
+#pragma mark Private helpers
+
+- (void)setupSlots
+{
+    _slots = [NSMutableArray array];
+    _freeSlots = [NSMutableIndexSet indexSet];
+    _slotsByKey = [NSMutableDictionary dictionary];
+    _costsByKey = [NSMutableDictionary dictionary];
+    _hand = 0;
+    _totalCost = 0;
+}
+
+- (void)removeKeyLocked:(NSString*)key
+{
+    NSNumber* slot = _slotsByKey[key];
+    if (slot == nil) return;
+
+    NSUInteger index = [slot unsignedIntegerValue];
+    _slots[index] = [NSNull null];
+    _referenced[index] = 0;
+    [_freeSlots addIndex:index];
+    [_slotsByKey removeObjectForKey:key];
+
+    _totalCost -= [_costsByKey[key] doubleValue];
+    [_costsByKey removeObjectForKey:key];
+}
+
+@end
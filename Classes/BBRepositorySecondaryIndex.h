@@ -0,0 +1,75 @@
+//
+// Copyright 2013 BiasedBit
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+//
+//  Created by Bruno de Carvalho (@biasedbit, http://biasedbit.com)
+//  Copyright (c) 2013 BiasedBit. All rights reserved.
+//
+
+#import "BBRepositoryItem.h"
+
+
+
+#pragma mark - Types
+
+/**
+ Extracts the key under which an item is indexed; return `nil` to leave the item out of the index.
+
+ Must be thread-safe, and must return the same key for as long as the item is in the repository.
+ */
+typedef id<NSCopying> (^BBRepositorySecondaryIndexKeyBlock)(id item);
+
+
+
+#pragma mark -
+
+/**
+ Maps keys extracted from a repository's items back to the items' primary keys.
+
+ A unique index maps each key to a single item; when two items share a key, the one added last wins. A multi-valued
+ index maps each key to every item that shares it.
+
+ All methods are thread-safe.
+
+ @see [BBRepository addIndexWithName:unique:keyBlock:]
+ */
+@interface BBRepositorySecondaryIndex : NSObject
+
+
+#pragma mark Creation
+
+- (instancetype)initWithName:(NSString*)name unique:(BOOL)unique keyBlock:(BBRepositorySecondaryIndexKeyBlock)keyBlock;
+
+
+#pragma mark Properties
+
+@property(strong, nonatomic, readonly) NSString* name;
+@property(assign, nonatomic, readonly, getter = isUnique) BOOL unique;
+@property(copy, nonatomic, readonly) BBRepositorySecondaryIndexKeyBlock keyBlock;
+
+
+#pragma mark Interface
+
+- (void)addItem:(id<BBRepositoryItem>)item;
+- (void)removeItem:(id<BBRepositoryItem>)item;
+
+/** Discards every entry and indexes the given items instead. */
+- (void)rebuildWithItems:(NSArray*)items;
+
+/** Primary keys of the items indexed under the given key; at most one for unique indexes. */
+- (NSArray*)itemKeysForKey:(id<NSCopying>)key;
+
+@end
@@ -0,0 +1,139 @@
+//
+// Copyright 2013 BiasedBit
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+//
+//  Created by Bruno de Carvalho (@biasedbit, http://biasedbit.com)
+//  Copyright (c) 2013 BiasedBit. All rights reserved.
+//
+
+#import "BBRepositorySecondaryIndex.h"
+
+#import <pthread.h>
+
+
+
+#pragma mark -
+
+@implementation BBRepositorySecondaryIndex
+{
+    pthread_mutex_t _lock;
+    // Index key -> item key for unique indexes, index key -> NSMutableSet of item keys otherwise
+    NSMutableDictionary* _entries;
+}
+
+
+#pragma mark Creation
+
+- (instancetype)initWithName:(NSString*)name unique:(BOOL)unique keyBlock:(BBRepositorySecondaryIndexKeyBlock)keyBlock
+{
+    self = [super init];
+    if (self != nil) {
+        pthread_mutex_init(&_lock, NULL);
+        _name = name;
+        _unique = unique;
+        _keyBlock = [keyBlock copy];
+        _entries = [NSMutableDictionary dictionary];
+    }
+
+    return self;
+}
+
+- (void)dealloc
+{
+    pthread_mutex_destroy(&_lock);
+}
+
+
+#pragma mark Interface
+
+- (void)addItem:(id<BBRepositoryItem>)item
+{
+    id<NSCopying> key = _keyBlock(item);
+    if (key == nil) return;
+
+    pthread_mutex_lock(&_lock);
+    [self addItemKey:[item key] forKey:key];
+    pthread_mutex_unlock(&_lock);
+}
+
+- (void)removeItem:(id<BBRepositoryItem>)item
+{
+    id<NSCopying> key = _keyBlock(item);
+    if (key == nil) return;
+
+    pthread_mutex_lock(&_lock);
+    if (_unique) {
+        // Only if it's still pointing at this item; another one may have taken over the key since
+        if ([_entries[key] isEqualToString:[item key]]) [_entries removeObjectForKey:key];
+    } else {
+        NSMutableSet* itemKeys = _entries[key];
+        [itemKeys removeObject:[item key]];
+        if ([itemKeys count] == 0) [_entries removeObjectForKey:key];
+    }
+    pthread_mutex_unlock(&_lock);
+}
+
+- (void)rebuildWithItems:(NSArray*)items
+{
+    // Extract keys outside the lock, it's where most of the time goes
+    NSMutableDictionary* entries = [NSMutableDictionary dictionaryWithCapacity:[items count]];
+    NSMutableArray* keys = [NSMutableArray arrayWithCapacity:[items count]];
+    for (id<BBRepositoryItem> item in items) {
+        id<NSCopying> key = _keyBlock(item);
+        [keys addObject:(key != nil) ? key : [NSNull null]];
+    }
+
+    pthread_mutex_lock(&_lock);
+    _entries = entries;
+    [keys enumerateObjectsUsingBlock:^(id key, NSUInteger i, BOOL* stop) {
+        if (key != [NSNull null]) [self addItemKey:[items[i] key] forKey:key];
+    }];
+    pthread_mutex_unlock(&_lock);
+}
+
+- (NSArray*)itemKeysForKey:(id<NSCopying>)key
+{
+    if (key == nil) return @[];
+
+    pthread_mutex_lock(&_lock);
+    id entry = _entries[key];
+    NSArray* itemKeys = (entry == nil) ? @[] : (_unique ? @[entry] : [entry allObjects]);
+    pthread_mutex_unlock(&_lock);
+
+    return itemKeys;
+}
+
+
+#pragma mark Private helpers
+
+- (void)addItemKey:(NSString*)itemKey forKey:(id<NSCopying>)key
+{
+    // Must be called with the lock held
+    if (_unique) {
+        _entries[key] = itemKey;
+        return;
+    }
+
+    NSMutableSet* itemKeys = _entries[key];
+    if (itemKeys == nil) {
+        itemKeys = [NSMutableSet set];
+        _entries[key] = itemKeys;
+    }
+
+    [itemKeys addObject:itemKey];
+}
+
+@end
@@ -0,0 +1,142 @@
+//
+// Copyright 2013 BiasedBit
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+//
+//  Created by Bruno de Carvalho (@biasedbit, http://biasedbit.com)
+//  Copyright (c) 2013 BiasedBit. All rights reserved.
+//
+
+#pragma mark - Enums
+
+/** Counters kept by every repository. See `[BBRepository statistics]`. */
+typedef NS_ENUM(NSUInteger, BBRepositoryStatistic) {
+    /** `itemForKey:` calls that found an item. */
+    BBRepositoryStatisticHits = 0,
+    /** `itemForKey:` calls that didn't. */
+    BBRepositoryStatisticMisses,
+    /** Items added under a key that wasn't in the repository. */
+    BBRepositoryStatisticAdds,
+    /** Items added under a key that was already in the repository. */
+    BBRepositoryStatisticReplaces,
+    /** Items removed, for whatever reason. */
+    BBRepositoryStatisticRemoves,
+    /** Items removed by `BBCache` because they expired. Also counted as removes. */
+    BBRepositoryStatisticExpirations,
+    /** Items removed by `BBCappedCache` to get back under its resource usage limit. Also counted as removes. */
+    BBRepositoryStatisticEvictions,
+    /** Bytes of index files, journal and evicted items read back from disk. */
+    BBRepositoryStatisticBytesRead,
+    /** Bytes of index files and journal records written to disk. */
+    BBRepositoryStatisticBytesWritten,
+    /** Calls to `flush` and `checkpoint` that wrote anything. */
+    BBRepositoryStatisticFlushes,
+    /** Background flushes requested by `flushInBackground:` that were folded into a later (or explicit) flush. */
+    BBRepositoryStatisticCoalescedFlushes,
+    /** Calls to `reload`. */
+    BBRepositoryStatisticReloads,
+
+    BBRepositoryStatisticCount
+};
+
+
+
+#pragma mark -
+
+/**
+ Latency histogram with power of two buckets, from 1 microsecond up to about half an hour.
+
+ Recording is lock-free and costs a couple of relaxed atomic increments, so it's fine to leave on in production.
+ */
+@interface BBRepositoryLatencyHistogram : NSObject <NSCopying>
+
+
+#pragma mark Properties
+
+/** Number of durations recorded. */
+@property(assign, nonatomic, readonly) uint64_t count;
+
+/** Sum of every duration recorded, in seconds. */
+@property(assign, nonatomic, readonly) NSTimeInterval totalDuration;
+
+@property(assign, nonatomic, readonly) NSUInteger bucketCount;
+
+
+#pragma mark Interface
+
+- (void)recordDuration:(NSTimeInterval)duration;
+
+- (uint64_t)countInBucket:(NSUInteger)bucket;
+
+/** Largest duration, in seconds, that falls in the given bucket. */
+- (NSTimeInterval)upperBoundOfBucket:(NSUInteger)bucket;
+
+/**
+ Estimates the duration below which the given fraction of the recorded durations fall.
+
+ @param percentile A value between 0 and 1, e.g. 0.99 for the 99th percentile.
+
+ @return The upper bound of the bucket holding that percentile, or 0 if nothing was recorded.
+ */
+- (NSTimeInterval)durationAtPercentile:(double)percentile;
+
+- (void)reset;
+
+@end
+
+
+
+#pragma mark -
+
+/**
+ Snapshot of the counters and histograms of a repository, taken by `[BBRepository statistics]`.
+
+ Counters are read one at a time, without stopping the repository, so a snapshot taken while the repository is in use
+ may be off by whatever happened while it was being taken.
+ */
+@interface BBRepositoryStatistics : NSObject
+
+
+#pragma mark Creation
+
+- (instancetype)initWithCounts:(const uint64_t*)counts flushLatencies:(BBRepositoryLatencyHistogram*)flushLatencies
+                reloadLatencies:(BBRepositoryLatencyHistogram*)reloadLatencies;
+
+
+#pragma mark Properties
+
+@property(strong, nonatomic, readonly) BBRepositoryLatencyHistogram* flushLatencies;
+@property(strong, nonatomic, readonly) BBRepositoryLatencyHistogram* reloadLatencies;
+
+@property(assign, nonatomic) NSUInteger itemCount;
+
+/** Filled in by repositories that track resource usage, such as `BBCappedCache`; `0` otherwise. */
+@property(assign, nonatomic) double resourceUsage;
+
+/** Estimated false positive rate of the key filter, or `0` if the repository doesn't use one. */
+@property(assign, nonatomic) double keyFilterFalsePositiveRate;
+
+
+#pragma mark Interface
+
+- (uint64_t)countForStatistic:(BBRepositoryStatistic)statistic;
+
+/**
+ Property list friendly representation of the snapshot, with stable keys, suitable for logging or writing to a file to
+ compare across runs.
+ */
+- (NSDictionary*)dictionaryRepresentation;
+
+@end
@@ -0,0 +1,219 @@
+//
+// Copyright 2013 BiasedBit
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+//
+//  Created by Bruno de Carvalho (@biasedbit, http://biasedbit.com)
+//  Copyright (c) 2013 BiasedBit. All rights reserved.
+//
+
+#import "BBRepositoryStatistics.h"
+
+#import <stdatomic.h>
+
+
+
+#pragma mark - Constants
+
+static NSUInteger const kBBRepositoryLatencyHistogramBucketCount = 32;
+
+
+
+#pragma mark -
+
+@implementation BBRepositoryLatencyHistogram
+{
+    _Atomic uint64_t _buckets[kBBRepositoryLatencyHistogramBucketCount];
+    _Atomic uint64_t _count;
+    _Atomic uint64_t _totalMicroseconds;
+}
+
+
+#pragma mark Creation
+
+- (instancetype)init
+{
+    self = [super init];
+    if (self != nil) [self reset];
+
+    return self;
+}
+
+
+#pragma mark Properties
+
+- (uint64_t)count
+{
+    return atomic_load_explicit(&_count, memory_order_relaxed);
+}
+
+- (NSTimeInterval)totalDuration
+{
+    return atomic_load_explicit(&_totalMicroseconds, memory_order_relaxed) / 1000000.0;
+}
+
+- (NSUInteger)bucketCount
+{
+    return kBBRepositoryLatencyHistogramBucketCount;
+}
+
+
+#pragma mark Interface
+
+- (void)recordDuration:(NSTimeInterval)duration
+{
+    uint64_t microseconds = (duration > 0) ? (uint64_t)(duration * 1000000) : 0;
+
+    // Bucket i holds durations up to 2^i microseconds
+    NSUInteger bucket = 0;
+    if (microseconds > 1) bucket = MIN((NSUInteger)(64 - __builtin_clzll(microseconds - 1)),
+                                       kBBRepositoryLatencyHistogramBucketCount - 1);
+
+    atomic_fetch_add_explicit(&_buckets[bucket], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&_count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&_totalMicroseconds, microseconds, memory_order_relaxed);
+}
+
+- (uint64_t)countInBucket:(NSUInteger)bucket
+{
+    if (bucket >= kBBRepositoryLatencyHistogramBucketCount) return 0;
+
+    return atomic_load_explicit(&_buckets[bucket], memory_order_relaxed);
+}
+
+- (NSTimeInterval)upperBoundOfBucket:(NSUInteger)bucket
+{
+    return (double)(1ULL << MIN(bucket, kBBRepositoryLatencyHistogramBucketCount - 1)) / 1000000.0;
+}
+
+- (NSTimeInterval)durationAtPercentile:(double)percentile
+{
+    uint64_t count = 0;
+    uint64_t counts[kBBRepositoryLatencyHistogramBucketCount];
+    for (NSUInteger i = 0; i < kBBRepositoryLatencyHistogramBucketCount; i++) {
+        counts[i] = [self countInBucket:i];
+        count += counts[i];
+    }
+    if (count == 0) return 0;
+
+    uint64_t rank = (uint64_t)ceil(MAX(MIN(percentile, 1.0), 0.0) * count);
+    uint64_t seen = 0;
+    for (NSUInteger i = 0; i < kBBRepositoryLatencyHistogramBucketCount; i++) {
+        seen += counts[i];
+        if ((seen >= rank) && (counts[i] > 0)) return [self upperBoundOfBucket:i];
+    }
+
+    return [self upperBoundOfBucket:(kBBRepositoryLatencyHistogramBucketCount - 1)];
+}
+
+- (void)reset
+{
+    for (NSUInteger i = 0; i < kBBRepositoryLatencyHistogramBucketCount; i++) {
+        atomic_store_explicit(&_buckets[i], 0, memory_order_relaxed);
+    }
+    atomic_store_explicit(&_count, 0, memory_order_relaxed);
+    atomic_store_explicit(&_totalMicroseconds, 0, memory_order_relaxed);
+}
+
+
+#pragma mark NSCopying
+
+- (id)copyWithZone:(NSZone*)zone
+{
+    BBRepositoryLatencyHistogram* copy = [[[self class] allocWithZone:zone] init];
+    for (NSUInteger i = 0; i < kBBRepositoryLatencyHistogramBucketCount; i++) {
+        atomic_store_explicit(&copy->_buckets[i], [self countInBucket:i], memory_order_relaxed);
+    }
+    atomic_store_explicit(&copy->_count, [self count], memory_order_relaxed);
+    atomic_store_explicit(&copy->_totalMicroseconds, atomic_load_explicit(&_totalMicroseconds, memory_order_relaxed),
+                          memory_order_relaxed);
+
+    return copy;
+}
+
+@end
+
+
+
+#pragma mark -
+
+@implementation BBRepositoryStatistics
+{
+    uint64_t _counts[BBRepositoryStatisticCount];
+}
+
+
+#pragma mark Creation
+
+- (instancetype)initWithCounts:(const uint64_t*)counts flushLatencies:(BBRepositoryLatencyHistogram*)flushLatencies
+                reloadLatencies:(BBRepositoryLatencyHistogram*)reloadLatencies
+{
+    self = [super init];
+    if (self != nil) {
+        memcpy(_counts, counts, sizeof(_counts));
+        _flushLatencies = [flushLatencies copy];
+        _reloadLatencies = [reloadLatencies copy];
+    }
+
+    return self;
+}
+
+
+#pragma mark Interface
+
+- (uint64_t)countForStatistic:(BBRepositoryStatistic)statistic
+{
+    if (statistic >= BBRepositoryStatisticCount) return 0;
+
+    return _counts[statistic];
+}
+
+- (NSDictionary*)dictionaryRepresentation
+{
+    static NSArray* names;
+    static dispatch_once_t onceToken;
+    dispatch_once(&onceToken, ^{
+        names = @[@"hits", @"misses", @"adds", @"replaces", @"removes", @"expirations", @"evictions",
+                  @"bytesRead", @"bytesWritten", @"flushes", @"coalescedFlushes", @"reloads"];
+    });
+
+    NSMutableDictionary* dictionary = [NSMutableDictionary dictionary];
+    for (NSUInteger i = 0; i < BBRepositoryStatisticCount; i++) dictionary[names[i]] = @(_counts[i]);
+
+    dictionary[@"itemCount"] = @(_itemCount);
+    dictionary[@"resourceUsage"] = @(_resourceUsage);
+    dictionary[@"keyFilterFalsePositiveRate"] = @(_keyFilterFalsePositiveRate);
+    dictionary[@"flushLatencies"] = [self dictionaryForHistogram:_flushLatencies];
+    dictionary[@"reloadLatencies"] = [self dictionaryForHistogram:_reloadLatencies];
+
+    return dictionary;
+}
+
+
+#pragma mark Private helpers
+
+- (NSDictionary*)dictionaryForHistogram:(BBRepositoryLatencyHistogram*)histogram
+{
+    NSMutableArray* buckets = [NSMutableArray arrayWithCapacity:[histogram bucketCount]];
+    for (NSUInteger i = 0; i < [histogram bucketCount]; i++) [buckets addObject:@([histogram countInBucket:i])];
+
+    return @{@"count": @([histogram count]),
+             @"totalDuration": @([histogram totalDuration]),
+             @"p50": @([histogram durationAtPercentile:0.5]),
+             @"p99": @([histogram durationAtPercentile:0.99]),
+             @"buckets": buckets};
+}
+
+@end
@@ -0,0 +1,66 @@
+//
+// Copyright 2013 BiasedBit
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+//
+//  Created by Bruno de Carvalho (@biasedbit, http://biasedbit.com)
+//  Copyright (c) 2013 BiasedBit. All rights reserved.
+//
+
+#pragma mark -
+
+/**
+ Set of string keys kept in ascending order, compared literally (by UTF-16 code unit), which keeps all keys sharing a
+ prefix next to each other.
+
+ Keys are stored in a sorted array, so lookups, prefix and range queries are O(log n + k), where k is the number of keys
+ returned. Adding and removing keys is O(log n) to find their position plus a shift of the array's tail, which for the
+ sizes a repository holds is a single `memmove`.
+
+ All methods are thread-safe.
+ */
+@interface BBSortedKeySet : NSObject
+
+
+#pragma mark Properties
+
+@property(assign, nonatomic, readonly) NSUInteger count;
+
+
+#pragma mark Interface
+
+- (void)addKey:(NSString*)key;
+- (void)removeKey:(NSString*)key;
+- (BOOL)containsKey:(NSString*)key;
+
+/** Replaces every key in the set with the given ones, sorting them once. */
+- (void)setKeys:(NSArray*)keys;
+- (void)removeAllKeys;
+
+/** Every key in the set, in order. */
+- (NSArray*)allKeys;
+
+/** Every key that starts with `prefix`, in order. */
+- (NSArray*)keysWithPrefix:(NSString*)prefix;
+
+/**
+ Every key in the range [`startKey`, `endKey`), in order.
+
+ @param startKey First key of the range, inclusive. `nil` to start from the first key.
+ @param endKey Last key of the range, exclusive. `nil` to go until the last key.
+ */
+- (NSArray*)keysFromKey:(NSString*)startKey toKey:(NSString*)endKey;
+
+@end
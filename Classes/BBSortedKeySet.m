@@ -0,0 +1,170 @@
+//
+// Copyright 2013 BiasedBit
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+//
+//  Created by Bruno de Carvalho (@biasedbit, http://biasedbit.com)
+//  Copyright (c) 2013 BiasedBit. All rights reserved.
+//
+
+#import "BBSortedKeySet.h"
+
+#import <pthread.h>
+
+
+
+#pragma mark - Utility functions
+
+static NSComparator const BBSortedKeySetComparator = ^NSComparisonResult(NSString* a, NSString* b) {
+    return [a compare:b options:NSLiteralSearch];
+};
+
+
+
+#pragma mark -
+
+@implementation BBSortedKeySet
+{
+    pthread_mutex_t _lock;
+    NSMutableArray* _keys;
+}
+
+
+#pragma mark Creation
+
+- (instancetype)init
+{
+    self = [super init];
+    if (self != nil) {
+        pthread_mutex_init(&_lock, NULL);
+        _keys = [NSMutableArray array];
+    }
+
+    return self;
+}
+
+- (void)dealloc
+{
+    pthread_mutex_destroy(&_lock);
+}
+
+
+#pragma mark Properties
+
+- (NSUInteger)count
+{
+    pthread_mutex_lock(&_lock);
+    NSUInteger count = [_keys count];
+    pthread_mutex_unlock(&_lock);
+
+    return count;
+}
+
+
+#pragma mark Interface
+
+- (void)addKey:(NSString*)key
+{
+    pthread_mutex_lock(&_lock);
+    NSUInteger index = [self lowerBoundForKey:key];
+    if ((index == [_keys count]) || ![_keys[index] isEqualToString:key]) [_keys insertObject:key atIndex:index];
+    pthread_mutex_unlock(&_lock);
+}
+
+- (void)removeKey:(NSString*)key
+{
+    pthread_mutex_lock(&_lock);
+    NSUInteger index = [self lowerBoundForKey:key];
+    if ((index < [_keys count]) && [_keys[index] isEqualToString:key]) [_keys removeObjectAtIndex:index];
+    pthread_mutex_unlock(&_lock);
+}
+
+- (BOOL)containsKey:(NSString*)key
+{
+    pthread_mutex_lock(&_lock);
+    NSUInteger index = [self lowerBoundForKey:key];
+    BOOL contains = (index < [_keys count]) && [_keys[index] isEqualToString:key];
+    pthread_mutex_unlock(&_lock);
+
+    return contains;
+}
+
+- (void)setKeys:(NSArray*)keys
+{
+    // Sort outside the lock, it's where most of the time goes
+    NSMutableArray* sortedKeys = [[keys sortedArrayUsingComparator:BBSortedKeySetComparator] mutableCopy];
+
+    pthread_mutex_lock(&_lock);
+    _keys = sortedKeys;
+    pthread_mutex_unlock(&_lock);
+}
+
+- (void)removeAllKeys
+{
+    pthread_mutex_lock(&_lock);
+    [_keys removeAllObjects];
+    pthread_mutex_unlock(&_lock);
+}
+
+- (NSArray*)allKeys
+{
+    pthread_mutex_lock(&_lock);
+    NSArray* keys = [_keys copy];
+    pthread_mutex_unlock(&_lock);
+
+    return keys;
+}
+
+- (NSArray*)keysWithPrefix:(NSString*)prefix
+{
+    if ([prefix length] == 0) return [self allKeys];
+
+    pthread_mutex_lock(&_lock);
+    // Keys sharing a prefix are contiguous and the prefix itself sorts before all of them
+    NSUInteger start = [self lowerBoundForKey:prefix];
+    NSUInteger end = start;
+    NSUInteger count = [_keys count];
+    while ((end < count) && [_keys[end] hasPrefix:prefix]) end++;
+
+    NSArray* keys = [_keys subarrayWithRange:NSMakeRange(start, end - start)];
+    pthread_mutex_unlock(&_lock);
+
+    return keys;
+}
+
+- (NSArray*)keysFromKey:(NSString*)startKey toKey:(NSString*)endKey
+{
+    pthread_mutex_lock(&_lock);
+    NSUInteger start = (startKey != nil) ? [self lowerBoundForKey:startKey] : 0;
+    NSUInteger end = (endKey != nil) ? [self lowerBoundForKey:endKey] : [_keys count];
+
+    NSArray* keys = (start < end) ? [_keys subarrayWithRange:NSMakeRange(start, end - start)] : @[];
+    pthread_mutex_unlock(&_lock);
+
+    return keys;
+}
+
+
+#pragma mark Private helpers
+
+- (NSUInteger)lowerBoundForKey:(NSString*)key
+{
+    // Must be called with the lock held. Index of the first key that's not lower than the given one.
+    return [_keys indexOfObject:key inSortedRange:NSMakeRange(0, [_keys count])
+                        options:(NSBinarySearchingFirstEqual | NSBinarySearchingInsertionIndex)
+                usingComparator:BBSortedKeySetComparator];
+}
+
+@end